@@ -0,0 +1,98 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "buffer.h"
+#include "debug.h"
+
+struct ring_buffer *ring_buffer_new(size_t capacity) {
+    struct ring_buffer *rb = malloc(sizeof(*rb));
+    if (rb == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+    rb->data = malloc(capacity);
+    if (rb->data == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        free(rb);
+        return NULL;
+    }
+    rb->capacity = capacity;
+    rb->head = 0u;
+    rb->length = 0u;
+    return rb;
+}
+
+void ring_buffer_free(struct ring_buffer *rb) {
+    if (rb != NULL) {
+        free(rb->data);
+        free(rb);
+    }
+}
+
+size_t ring_buffer_space(struct ring_buffer *rb) {
+    return rb->capacity - rb->length;
+}
+
+bool ring_buffer_is_empty(struct ring_buffer *rb) {
+    return rb->length == 0u;
+}
+
+/**
+ * Copies len bytes from src onto the end of the buffer.
+ *
+ * On error (not enough space): returns -1 and leaves the buffer unchanged.
+ */
+int ring_buffer_append(struct ring_buffer *rb, const char *src, size_t len) {
+    if (len > ring_buffer_space(rb)) {
+        REPORT_ERROR("Not enough space in ring buffer");
+        return -1;
+    }
+    size_t tail = (rb->head + rb->length) % rb->capacity;
+    size_t first = rb->capacity - tail;
+    if (first > len)
+        first = len;
+    memcpy(rb->data + tail, src, first);
+    memcpy(rb->data, src + first, len - first);
+    rb->length += len;
+    return 0;
+}
+
+/**
+ * Writes as much of the buffer to fd as fd will accept without blocking,
+ * and discards the bytes written from the front of the buffer.
+ *
+ * Returns the number of bytes written, or -1 with errno set as by writev(2).
+ */
+ssize_t ring_buffer_write_to_fd(struct ring_buffer *rb, int fd) {
+    if (rb->length == 0u)
+        return 0;
+
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = rb->data + rb->head;
+    if (rb->head + rb->length <= rb->capacity) {
+        iov[0].iov_len = rb->length;
+    }
+    else {
+        iov[0].iov_len = rb->capacity - rb->head;
+        iov[1].iov_base = rb->data;
+        iov[1].iov_len = rb->length - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    ssize_t bytes = writev(fd, iov, iovcnt);
+    if (bytes > 0) {
+        rb->head = (rb->head + (size_t)bytes) % rb->capacity;
+        rb->length -= (size_t)bytes;
+        if (rb->length == 0u)
+            rb->head = 0u;
+    }
+    return bytes;
+}
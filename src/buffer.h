@@ -0,0 +1,31 @@
+#ifndef HP4_BUFFER_H
+#define HP4_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/* Fixed-capacity FIFO of bytes, used to hold data for a tee'd edge whose
+ * destination pipe is full. */
+struct ring_buffer {
+    char *data;
+    size_t capacity;
+    /* index of the oldest byte in data */
+    size_t head;
+    size_t length;
+};
+
+struct ring_buffer *ring_buffer_new(size_t capacity);
+
+void ring_buffer_free(struct ring_buffer *rb);
+
+size_t ring_buffer_space(struct ring_buffer *rb);
+
+bool ring_buffer_is_empty(struct ring_buffer *rb);
+
+int ring_buffer_append(struct ring_buffer *rb, const char *src, size_t len);
+
+ssize_t ring_buffer_write_to_fd(struct ring_buffer *rb, int fd);
+
+#endif /* HP4_BUFFER_H */
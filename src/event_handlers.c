@@ -5,28 +5,47 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <event2/event.h>
 
+#include "buffer.h"
 #include "debug.h"
 #include "event_handlers.h"
 #include "parser.h"
 #include "pipe.h"
+#include "pipe_budget.h"
+#include "spill.h"
 #include "stats.h"
-
-#ifndef MAX_BYTES_TO_SPLICE
-#define MAX_BYTES_TO_SPLICE 65536
-#endif /* MAX_BYTES_TO_SPLICE */
+#include "uring.h"
 
 int fd_dev_null = -1;
 
+/* Set when splices and tees are run through io_uring. Each relay thread
+ * has its own ring, flush event and queue. */
+__thread struct uring *relay_uring = NULL;
+__thread struct event *relay_flush_event = NULL;
+
+/* Single edges whose next splice waits for relay_flush_event */
+__thread struct writable_ev_args **queued_relays = NULL;
+__thread size_t n_queued_relays = 0u;
+__thread size_t queued_relays_capacity = 0u;
+__thread bool relay_flushing = false;
+
+/* Scratch space for building a batch of io_uring operations */
+__thread struct uring_op *uring_ops = NULL;
+__thread struct writable_ev_args **uring_targets = NULL;
+__thread size_t uring_scratch_capacity = 0u;
+
 int open_dev_null(void) {
-    fd_dev_null = open("/dev/null", O_WRONLY|O_NONBLOCK);
+    fd_dev_null = open("/dev/null", O_WRONLY|O_NONBLOCK|O_CLOEXEC);
     if (fd_dev_null < 0)
         REPORT_ERRORF("%s", strerror(errno));
     return fd_dev_null;
@@ -88,20 +107,144 @@ void sigint_handler(evutil_socket_t fd, short what, void *arg) {
     }
 }
 
+/**
+ * Has the event loop call a branch's writable handler soon, if its pipe is
+ * known to have room. Otherwise the edge-triggered writable event will call
+ * it once the pipe gains room.
+ */
+void wake_branch(struct writable_ev_args *wea) {
+    if (wea->writable && wea->to_pipe->write_fd_is_open)
+        event_active(wea->writable_event, EV_WRITE, 0);
+}
+
+/**
+ * Has the event loop call a source's readable handler soon, if its pipe is
+ * known to hold data. Otherwise the edge-triggered readable event will call
+ * it once data arrives.
+ */
+void wake_source(struct readable_ev_args *rea) {
+    if (rea->readable && rea->from_pipe->read_fd_is_open)
+        event_active(rea->readable_event, EV_READ, 0);
+}
+
+/**
+ * Removes a source's persistent event from the loop and closes its pipe.
+ * The event must go first, as the fd may be reused once closed.
+ */
+void close_source(struct readable_ev_args *rea) {
+    event_del(rea->readable_event);
+    rea->readable = false;
+    if (rea->from_pipe->read_fd_is_open && close(rea->from_pipe->read_fd) == 0)
+        rea->from_pipe->read_fd_is_open = false;
+    pipe_budget_release(rea->from_pipe);
+}
+
+/**
+ * Removes a branch's persistent event from the loop and closes its pipe.
+ */
+void close_branch(struct writable_ev_args *wea) {
+    event_del(wea->writable_event);
+    wea->writable = false;
+    if (wea->to_pipe->write_fd_is_open && close(wea->to_pipe->write_fd) == 0)
+        wea->to_pipe->write_fd_is_open = false;
+    pipe_budget_release(wea->to_pipe);
+}
+
+/**
+ * Adds bytes relayed along an edge to its count. Counts are read by the
+ * stats handler, which may run on another thread.
+ */
+void count_bytes_spliced(struct writable_ev_args *wea, ssize_t bytes) {
+    __atomic_fetch_add(wea->bytes_spliced, (int64_t)bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Runs on the thread which relays to a node that has exited: takes the
+ * branch's persistent event out of the loop. This must be done for each
+ * branch into the node before any of their pipes is closed, as branches may
+ * share a pipe, and its fd may be reused once closed.
+ */
+void detach_branch(evutil_socket_t fd, short what, void *arg) {
+    struct writable_ev_args *wea = arg;
+    if (event_del(wea->writable_event) < 0)
+        PRINT_DEBUG("Edge %s: failed to remove writable event\n", wea->edge->id);
+    wea->writable = false;
+}
+
+/**
+ * Runs after detach_branch: closes the branch's pipe. The source's
+ * readable_handler will notice that the branch has closed, and will close
+ * the upstream node's output as required.
+ */
+void release_branch(evutil_socket_t fd, short what, void *arg) {
+    struct writable_ev_args *wea = arg;
+    if (close_pipe(wea->to_pipe) < 0)
+        PRINT_DEBUG("Closing pipe for edge %s failed: %s\n",
+                    wea->edge->id, strerror(errno));
+    if (wea->from_pipe->read_fd_is_open)
+        event_active(wea->readable_event, EV_READ, 0);
+}
+
+bool all_branches_closed(struct readable_ev_args *rea) {
+    for (int i = 0; i < (int)rea->to_pipes->length; i++) {
+        if (get_pipe(rea->to_pipes, i)->write_fd_is_open)
+            return false;
+    }
+    return true;
+}
+
 void close_node(pid_t p, struct sigchld_args *sa) {
-    ++sa->n_children_exited;
     struct p4_node *pn = find_node_by_pid(sa->pf, p);
-    PRINT_DEBUG("%dth child process ended; node %s\n", sa->n_children_exited, pn->id);
-
     if (pn == NULL) {
+        ++sa->n_children_exited;
         REPORT_ERROR("Failed to find a node which matching pid of "
                      "recently-closed child process");
         return;
     }
+    end_node(pn, sa);
+}
 
-    if (pn->in_pipes && pipe_array_close(pn->in_pipes) < 0) {
-        PRINT_DEBUG("Closing all incoming pipes to node %s failed: %s\n",
-                pn->id, strerror(errno));
+/**
+ * Closes the pipes of a node which has finished, whether a process which
+ * has exited or a node run by hp4 itself, and ends the event loop once
+ * every node has finished.
+ */
+void end_node(struct p4_node *pn, struct sigchld_args *sa) {
+    ++sa->n_children_exited;
+    PRINT_DEBUG("%dth node ended; node %s\n", sa->n_children_exited, pn->id);
+
+    /* set if the node's in_pipes are left to relay threads to close */
+    bool deferred = false;
+    if (pn->writable_events) {
+        /* a branch relayed by another thread is detached on that thread,
+         * which runs the callbacks in the order they are added */
+        for (int pass = 0; pass < 2; pass++) {
+            event_callback_fn cb = pass == 0 ? detach_branch : release_branch;
+            for (int k = 0; k < (int)pn->writable_events->length; k++) {
+                struct event *wr_ev = pn->writable_events->events[k];
+                struct writable_ev_args *wea = event_get_callback_arg(wr_ev);
+                struct event_base *relay_eb = event_get_base(wr_ev);
+                if (relay_eb == sa->eb) {
+                    cb(-1, EV_TIMEOUT, wea);
+                }
+                else if (event_base_once(relay_eb, -1, EV_TIMEOUT, cb, wea, NULL) < 0) {
+                    PRINT_DEBUG("Node %s: failed to detach edge %s\n",
+                                pn->id, wea->edge->id);
+                }
+                else {
+                    deferred = true;
+                }
+            }
+        }
+    }
+
+    /* a direct pipe's write end is left to its producer, which sees EPIPE */
+    for (int k = 0; !deferred && pn->in_pipes && k < (int)pn->in_pipes->length; k++) {
+        struct pipe *in_pipe = get_pipe(pn->in_pipes, k);
+        if (!in_pipe->direct && close_pipe(in_pipe) < 0) {
+            PRINT_DEBUG("Closing incoming pipe to node %s failed: %s\n",
+                    pn->id, strerror(errno));
+        }
     }
 
     pn->ended = true;
@@ -118,28 +261,7 @@ void close_node(pid_t p, struct sigchld_args *sa) {
                 else if (close_successful == 0)
                     out_pipe->write_fd_is_open = false;
             }
-        }
-    }
-
-    if (pn->writable_events) {
-        for (int k = 0; k < (int)pn->writable_events->length; k++) {
-            struct event *wr_ev = pn->writable_events->events[k];
-            if (event_pending(wr_ev, EV_READ|EV_WRITE, NULL)) {
-                PRINT_DEBUG("Node %s: A writable_handler event was in the queue when "
-                            "node terminated exiting. Removing... ", pn->id);
-                int success = event_del(wr_ev);
-                if (success < 0)
-                    PRINT_DEBUG("Failed!\n");
-                else if (event_pending(wr_ev, EV_READ|EV_WRITE, NULL))
-                    PRINT_DEBUG("Seemed to succeed, but event is still in the queue!\n");
-                else
-                    PRINT_DEBUG("Succeeded!\n");
-
-                struct writable_ev_args *wea = event_get_callback_arg(wr_ev);
-                /* readable_handler will notice that this node has closed,
-                 * and will close the upstream node's output as required */
-                event_add(wea->readable_event, NULL);
-            }
+            pipe_budget_release(out_pipe);
         }
     }
 
@@ -147,7 +269,7 @@ void close_node(pid_t p, struct sigchld_args *sa) {
         struct p4_edge *pe = p4_file_get_edge(sa->pf, j);
         if (strcmp(pe->to, pn->id) == 0) {
             PRINT_DEBUG("edge %s finished after splicing %ld bytes\n",
-                   pe->id, pe->bytes_spliced);
+                   pe->id, __atomic_load_n(&pe->bytes_spliced, __ATOMIC_RELAXED));
         }
     }
 
@@ -164,8 +286,15 @@ void sigchld_handler(evutil_socket_t fd, short what, void *arg) {
      * So we loop until error (p == -1) or no processes have terminated (p == 0)
      */
     while (1) {
+        /* a direct edge's count is read from its producer, which is only
+         * possible until the producer is reaped */
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0)
+            sample_direct_edges(sa->pf, info.si_pid);
+
         int status;
-        pid_t p = waitpid(-1, &status, WNOHANG);
+        pid_t p = waitpid(info.si_pid != 0 ? info.si_pid : -1, &status, WNOHANG);
         if (p == -1) {
             if (errno == ECHILD) {
                 PRINT_DEBUG("Waited for a process to terminate, but all "
@@ -198,185 +327,880 @@ void sigchld_handler(evutil_socket_t fd, short what, void *arg) {
     }
 }
 
-int write_single(struct writable_ev_args *wea) {
-    int got_eof = 0;
-    struct pipe *to_pipe = get_pipe(wea->to_pipes, 0);
+/**
+ * Returns true once more than batch_time microseconds have passed since
+ * start.
+ */
+bool batch_expired(const struct timespec *start, size_t batch_time) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        return true;
+    int64_t elapsed = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+                      (now.tv_nsec - start->tv_nsec) / 1000;
+    return elapsed >= (int64_t)batch_time;
+}
+
+/**
+ * Raises chunk_size, batch_size and batch_time to at least those of edge pe,
+ * taking the default for any the edge leaves unset. Starting from zero and
+ * calling this for each edge gives the largest of them, as a relay takes
+ * across the edges tee'd from one pipe; a NULL pe stands for an edge which
+ * sets none.
+ */
+void raise_edge_limits(const struct p4_edge *pe, size_t *chunk_size,
+                       size_t *batch_size, size_t *batch_time) {
+    size_t cs = pe && pe->chunk_size > 0u ? pe->chunk_size : DEFAULT_CHUNK_SIZE;
+    size_t bs = pe && pe->batch_size > 0u ? pe->batch_size : DEFAULT_BATCH_SIZE;
+    size_t bt = pe && pe->batch_time > 0u ? pe->batch_time : DEFAULT_BATCH_TIME;
+    if (cs > *chunk_size)
+        *chunk_size = cs;
+    if (bs > *batch_size)
+        *batch_size = bs;
+    if (bt > *batch_time)
+        *batch_time = bt;
+}
+
+/**
+ * Works out which of a single edge's pipes blocked it, as EAGAIN from
+ * splice(2) does not say. Readiness is only cleared here for a pipe which
+ * is seen to be blocked, so any later change to it raises an edge-triggered
+ * event.
+ */
+void refresh_readiness(struct writable_ev_args *wea) {
+    struct pollfd fds[2];
+    fds[0].fd = wea->from_pipe->read_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wea->to_pipe->write_fd;
+    fds[1].events = POLLOUT;
+    if (poll(fds, 2, 0) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return;
+    }
+    wea->rea->readable = (fds[0].revents & (POLLIN|POLLHUP)) != 0;
+    wea->writable = (fds[1].revents & (POLLOUT|POLLERR)) != 0;
+}
+
+/**
+ * Splices from an edge's source pipe to its destination pipe, chunk_size
+ * bytes at a time, until one of them would block or the edge's batch_size
+ * or batch_time is used up. *budget_spent is set in the latter case, when
+ * there is likely more to do straight away.
+ *
+ * Returns 1 on EOF or if the destination has no reader, -1 on error and 0
+ * otherwise.
+ */
+int write_single(struct writable_ev_args *wea, bool *budget_spent) {
+    struct pipe *to_pipe = wea->to_pipe;
+    *budget_spent = false;
     if (!to_pipe->write_fd_is_open) {
         return 1;
     }
-    ssize_t bytes = splice(wea->from_pipe->read_fd,
-                           NULL,
-                           to_pipe->write_fd,
-                           NULL,
-                           MAX_BYTES_TO_SPLICE,
-                           SPLICE_F_NONBLOCK);
+    ssize_t available = -1;
+    if (pipe_budget.autogrow) {
+        /* only worth a system call when pipes may be grown */
+        available = pipe_bytes_available(wea->from_pipe);
+        if (available >= 0)
+            pipe_note_full(wea->from_pipe,
+                           (size_t)available >= wea->from_pipe->capacity);
+    }
 
-    if (bytes < 0) {
-        if (errno != EAGAIN) {
-            REPORT_ERRORF("%s", strerror(errno));
-            return -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (1) {
+        ssize_t bytes = splice(wea->from_pipe->read_fd,
+                               NULL,
+                               to_pipe->write_fd,
+                               NULL,
+                               wea->chunk_size,
+                               SPLICE_F_NONBLOCK);
+
+        if (bytes < 0) {
+            if (errno == EPIPE) {
+                return 1;
+            }
+            else if (errno != EAGAIN) {
+                REPORT_ERRORF("%s", strerror(errno));
+                return -1;
+            }
+            refresh_readiness(wea);
+            if (moved == 0u && available > 0)
+                pipe_note_full(to_pipe, !wea->writable);
+            return 0;
+        }
+        else if (bytes == 0) {
+            return 1;
+        }
+
+        if (moved == 0u)
+            pipe_note_full(to_pipe, false);
+        count_bytes_spliced(wea, bytes);
+        moved += (size_t)bytes;
+        if (moved >= wea->batch_size || batch_expired(&start, wea->batch_time)) {
+            *budget_spent = true;
+            return 0;
         }
     }
-    else if (bytes > 0) {
-        **wea->bytes_spliced += bytes;
-        to_pipe->bytes_written = (size_t)bytes;
+}
+
+/**
+ * Returns true if a tee'd branch has data waiting in its buffer or spill file.
+ */
+bool branch_has_backlog(struct writable_ev_args *wea) {
+    return (wea->buffer && !ring_buffer_is_empty(wea->buffer)) ||
+           (wea->spill && spill_file_pending(wea->spill) > 0u);
+}
+
+/**
+ * Returns how many more bytes a tee'd branch can hold for later.
+ */
+size_t branch_backlog_space(struct writable_ev_args *wea) {
+    if (wea->spill)
+        return SIZE_MAX;
+    return wea->buffer ? ring_buffer_space(wea->buffer) : 0u;
+}
+
+/**
+ * Holds len bytes from src for a tee'd branch, after any data it already
+ * holds. Data stays in memory up to the branch's spill_high_water; beyond
+ * that, and for as long as anything remains spilled, it goes to the spill
+ * file so that the branch's data stays in order.
+ */
+int branch_hold(struct writable_ev_args *wea, const char *src, size_t len) {
+    size_t to_memory = len;
+    if (wea->spill) {
+        if (spill_file_pending(wea->spill) > 0u ||
+                wea->buffer->length >= wea->spill_high_water)
+            to_memory = 0u;
+        else if (wea->spill_high_water - wea->buffer->length < len)
+            to_memory = wea->spill_high_water - wea->buffer->length;
     }
-    else {
-        got_eof = 1;
+
+    if (ring_buffer_append(wea->buffer, src, to_memory) < 0)
+        return -1;
+
+    if (to_memory < len) {
+        if (spill_file_append(wea->spill, src + to_memory, len - to_memory) < 0)
+            return -1;
+        __atomic_fetch_add(&wea->edge->bytes_spilled, (int64_t)(len - to_memory),
+                           __ATOMIC_RELAXED);
+        int64_t pending = (int64_t)spill_file_pending(wea->spill);
+        if (pending > wea->edge->spill_peak)
+            __atomic_store_n(&wea->edge->spill_peak, pending, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Makes room for n operations in the io_uring scratch space.
+ */
+int reserve_uring_scratch(size_t n) {
+    if (n <= uring_scratch_capacity)
+        return 0;
+    struct uring_op *ops = realloc(uring_ops, n * sizeof(*ops));
+    if (ops == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    uring_ops = ops;
+    struct writable_ev_args **targets = realloc(uring_targets, n * sizeof(*targets));
+    if (targets == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    uring_targets = targets;
+    uring_scratch_capacity = n;
+    return 0;
+}
+
+/**
+ * Gives up on this thread's io_uring after a submission fails, so that
+ * splice(2) and tee(2) are used from then on. Edges still queued for a
+ * batch have their sources woken to retry with system calls.
+ */
+void drop_io_uring(void) {
+    fprintf(stderr, "io_uring failed; falling back to splice(2) and tee(2)\n");
+    uring_free(relay_uring);
+    relay_uring = NULL;
+    for (size_t k = 0u; k < n_queued_relays; k++) {
+        queued_relays[k]->queued = false;
+        wake_source(queued_relays[k]->rea);
     }
+    n_queued_relays = 0u;
+}
 
-    return got_eof;
+/**
+ * Returns how many bytes a tee'd branch has been sent which are still in
+ * the source pipe, as tee(2) cannot skip over them.
+ */
+size_t branch_ahead(struct writable_ev_args *wea) {
+    return (size_t)(wea->sent - wea->rea->consumed);
 }
 
-int write_multiple(struct writable_ev_args *wea) {
-    int i = wea->to_pipe_idx;
-    struct pipe *to_pipe = get_pipe(wea->to_pipes, i);
+/**
+ * Sorts a tee'd pipe's branches for the next chunk in a single pass, and
+ * lowers *limit to the most bytes the chunk may hold.
+ *
+ * A branch which is ahead of the source has already been sent the first of
+ * the chunk's bytes, so it only limits the chunk to what it can hold beyond
+ * them. Of the others, those which are writable and have no backlog make up
+ * the ready set, unbuffered ones first; buffered branches which may be owed
+ * some of the chunk are held for. One ready branch is picked as the final
+ * branch, to be spliced into; an unbuffered one is preferred, as a buffered
+ * one may be owed data which must then be copied out.
+ *
+ * *limit is set to 0 if an unbuffered branch which must be sent the chunk is
+ * full, as nothing can then be moved.
+ *
+ * Returns the number of branches seen to be open.
+ */
+size_t plan_chunk(struct readable_ev_args *rea, size_t *limit) {
+    size_t capacity = rea->to_pipes->length;
+    size_t n_unbuffered = 0u;
+    size_t n_buffered = 0u;
+    size_t n_open = 0u;
+    rea->final = NULL;
+    rea->n_held = 0u;
 
-    if (to_pipe->bytes_written == 0) {
-        ssize_t bytes = tee(wea->from_pipe->read_fd,
-                            to_pipe->write_fd,
-                            MAX_BYTES_TO_SPLICE,
-                            SPLICE_F_NONBLOCK);
+    for (size_t i = 0u; i < capacity; i++) {
+        struct writable_ev_args *wea = rea->branches[i];
+        if (!wea->to_pipe->write_fd_is_open)
+            continue;
+        ++n_open;
 
-        if (bytes < 0) {
-            if (errno != EAGAIN) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
+        size_t ahead = branch_ahead(wea);
+        if (ahead > 0u || branch_has_backlog(wea)) {
+            /* cannot be tee'd to until the others catch up with it, or
+             * until its backlog is empty */
+            size_t space = branch_backlog_space(wea);
+            if (ahead < *limit && space < *limit - ahead)
+                *limit = ahead + space;
+            if (wea->buffer)
+                rea->held[rea->n_held++] = wea;
+        }
+        else if (wea->buffer == NULL) {
+            if (!wea->writable) {
+                /* its writable event will resume the source */
+                rea->final = NULL;
+                *limit = 0u;
+                return n_open;
             }
+            if (rea->final == NULL)
+                rea->final = wea;
+            else
+                rea->ready[n_unbuffered++] = wea;
         }
-        else if (bytes > 0) {
-            to_pipe->bytes_written = (size_t)bytes;
-            *wea->bytes_spliced[i] += bytes;
+        else {
+            size_t space = branch_backlog_space(wea);
+            if (space < *limit)
+                *limit = space;
+            if (wea->writable)
+                rea->ready[capacity - ++n_buffered] = wea;
+            else
+                rea->held[rea->n_held++] = wea;
         }
     }
 
-    if (to_pipe->bytes_written < *wea->bytes_safely_written) {
-        *wea->bytes_safely_written = to_pipe->bytes_written;
+    if (rea->final == NULL && n_buffered > 0u)
+        rea->final = rea->ready[capacity - n_buffered--];
+    /* buffered branches were added from the end */
+    memmove(rea->ready + n_unbuffered, rea->ready + capacity - n_buffered,
+            n_buffered * sizeof(*rea->ready));
+    rea->n_ready_unbuffered = n_unbuffered;
+    rea->n_ready = n_unbuffered + n_buffered;
+    return n_open;
+}
+
+/**
+ * Records the result of teeing to a branch: the bytes tee'd, or -errno.
+ *
+ * Returns the bytes the branch took (0 if its pipe was full or it has no
+ * reader and has been closed), or -1 on error.
+ */
+ssize_t tee_result(struct writable_ev_args *wea, ssize_t res) {
+    struct pipe *to_pipe = wea->to_pipe;
+    if (res == -EPIPE) {
+        PRINT_DEBUG("Edge %s has no reader; closing pipe...\n",
+                    to_pipe->edge_ids[0]);
+        close_branch(wea);
+        return 0;
     }
+    else if (res == -EAGAIN) {
+        res = 0;
+        wea->writable = false;
+    }
+    else if (res < 0) {
+        REPORT_ERRORF("%s", strerror((int)-res));
+        return -1;
+    }
+    pipe_note_full(to_pipe, res == 0);
+    wea->sent += (uint64_t)res;
+    count_bytes_spliced(wea, res);
+    return res;
+}
 
-    to_pipe->visited = true;
+/**
+ * Tees up to *limit bytes to each of the ready branches from first to last.
+ * If limiting, as for unbuffered branches, *limit drops to the least that
+ * any branch took; those which took more are left ahead of the source.
+ * With io_uring, the tees are submitted at once, falling back to tee(2) if
+ * the submission fails.
+ *
+ * Returns -1 on error and 0 otherwise.
+ */
+int tee_ready(struct readable_ev_args *rea, size_t first, size_t last,
+              bool limiting, size_t *limit) {
+    int from_fd = rea->from_pipe->read_fd;
+    if (relay_uring && last > first) {
+        size_t n = last - first;
+        if (reserve_uring_scratch(n) < 0)
+            return -1;
+        for (size_t k = 0u; k < n; k++) {
+            struct uring_op *op = &uring_ops[k];
+            op->opcode = URING_TEE;
+            op->fd_in = from_fd;
+            op->fd_out = rea->ready[first + k]->to_pipe->write_fd;
+            op->len = *limit;
+            op->flags = SPLICE_F_NONBLOCK;
+        }
+        if (uring_run(relay_uring, uring_ops, n) < 0)
+            drop_io_uring();
+
+        size_t sent = *limit;
+        for (size_t k = 0u; k < n; k++) {
+            struct writable_ev_args *wea = rea->ready[first + k];
+            ssize_t res = uring_ops[k].res;
+            /* a tee the failed ring did not complete is made with tee(2) */
+            if (res == -EINPROGRESS) {
+                res = tee(from_fd, wea->to_pipe->write_fd, *limit, SPLICE_F_NONBLOCK);
+                if (res < 0)
+                    res = -errno;
+            }
+            ssize_t bytes = tee_result(wea, res);
+            if (bytes < 0)
+                return -1;
+            if (limiting && wea->to_pipe->write_fd_is_open && (size_t)bytes < sent)
+                sent = (size_t)bytes;
+        }
+        *limit = sent;
+        return 0;
+    }
+
+    for (size_t k = first; k < last && *limit > 0u; k++) {
+        struct writable_ev_args *wea = rea->ready[k];
+        ssize_t bytes = tee(from_fd, wea->to_pipe->write_fd, *limit,
+                            SPLICE_F_NONBLOCK);
+        bytes = tee_result(wea, bytes < 0 ? -errno : bytes);
+        if (bytes < 0)
+            return -1;
+        if (limiting && wea->to_pipe->write_fd_is_open && (size_t)bytes < *limit)
+            *limit = (size_t)bytes;
+    }
     return 0;
 }
 
-void writable_handler(evutil_socket_t fd, short what, void *arg) {
-    struct writable_ev_args *wea = arg;
-    int got_eof = 0;
-    int last_writable_handler = 1;
+/**
+ * Returns true if a held or buffered branch is owed some of the first limit
+ * bytes in the source pipe, which must then be copied out rather than
+ * discarded.
+ */
+bool branch_owed_data(struct readable_ev_args *rea, size_t limit) {
+    for (size_t k = 0u; k < rea->n_held; k++) {
+        struct writable_ev_args *wea = rea->held[k];
+        if (wea->to_pipe->write_fd_is_open && branch_ahead(wea) < limit)
+            return true;
+    }
+    for (size_t k = rea->n_ready_unbuffered; k < rea->n_ready; k++) {
+        struct writable_ev_args *wea = rea->ready[k];
+        if (wea->to_pipe->write_fd_is_open && branch_ahead(wea) < limit)
+            return true;
+    }
+    return false;
+}
 
-    if ((what & EV_WRITE) == 0) {
-        return;
+/**
+ * Gives a buffered branch the bytes just removed from the source pipe
+ * (which begin at staging) that it had not been sent.
+ */
+int settle_branch(struct readable_ev_args *rea, struct writable_ev_args *wea,
+                  uint64_t staged_from) {
+    if (!wea->to_pipe->write_fd_is_open || wea->sent >= rea->consumed)
+        return 0;
+    if (branch_hold(wea, rea->staging + (wea->sent - staged_from),
+                    (size_t)(rea->consumed - wea->sent)) < 0)
+        return -1;
+    wea->sent = rea->consumed;
+    wake_branch(wea);
+    return 0;
+}
+
+/**
+ * Moves up to limit bytes out of a tee'd pipe: into the final branch if
+ * there is one, into staging if a buffered branch is owed some of them, or
+ * otherwise into /dev/null.
+ *
+ * Returns the number of bytes moved, which is 0 if the final branch is full
+ * or has been closed, or -1 on error.
+ */
+ssize_t consume_chunk(struct readable_ev_args *rea, size_t limit, bool copy) {
+    int from_fd = rea->from_pipe->read_fd;
+    struct writable_ev_args *final = rea->final;
+    ssize_t consumed;
+    if (final)
+        consumed = splice(from_fd, NULL, final->to_pipe->write_fd, NULL, limit,
+                          SPLICE_F_NONBLOCK);
+    else if (copy)
+        consumed = read(from_fd, rea->staging, limit);
+    else
+        consumed = splice(from_fd, NULL, fd_dev_null, NULL, limit,
+                          SPLICE_F_NONBLOCK);
+
+    if (consumed < 0) {
+        if (final && errno == EPIPE) {
+            PRINT_DEBUG("Edge %s has no reader; closing pipe...\n",
+                        final->to_pipe->edge_ids[0]);
+            close_branch(final);
+            /* the chunk is still in the source for the other branches */
+            wake_source(rea);
+            return 0;
+        }
+        else if (errno != EAGAIN) {
+            REPORT_ERRORF("%s", strerror(errno));
+            return -1;
+        }
+        /* the source is known to hold data, so it is the final branch
+         * which is full */
+        if (final)
+            final->writable = false;
+        else
+            rea->readable = false;
+        return 0;
+    }
+    if (final && consumed > 0) {
+        pipe_note_full(final->to_pipe, false);
+        final->sent += (uint64_t)consumed;
+        count_bytes_spliced(final, consumed);
     }
+    return consumed;
+}
+
+/**
+ * Moves up to chunk_size bytes from a tee'd pipe to each of its branches.
+ * *consumed is set to the number of bytes removed from the source pipe; if
+ * that is 0, the source or a branch is blocked and its edge-triggered event
+ * will resume the relay.
+ *
+ * Every ready branch but one is tee'd to; the chunk is then spliced into the
+ * final branch, which both delivers it and removes it from the source pipe.
+ *
+ * An unbuffered branch can only take what fits into its pipe, so the slowest
+ * unbuffered branch limits how much is removed from the source pipe. A
+ * buffered branch takes what fits into its pipe and holds the remainder in
+ * its buffer, so it only limits the source once that buffer is full.
+ *
+ * A branch which spills to disk never limits the source.
+ *
+ * Each branch's progress is kept as the offset in the source's stream up to
+ * which it has been sent data, so branches which are ahead of the source
+ * cost nothing as it catches up with them, however wide the fan-out.
+ *
+ * Returns 1 on EOF, -1 on error and 0 otherwise.
+ */
+int tee_chunk(struct readable_ev_args *rea, size_t *consumed_out) {
+    *consumed_out = 0u;
+    int n_branches = (int)rea->to_pipes->length;
 
-    if (wea->to_pipes->length == 1u) {
-        got_eof = write_single(wea);
+    ssize_t available = pipe_bytes_available(rea->from_pipe);
+    if (available < 0) {
+        return -1;
     }
-    else {
-        // tee/splice algorithm based on answer in
-        // https://stackoverflow.com/a/14200975
-        write_multiple(wea);
-
-        for (int i = 0; i < (int)wea->to_pipes->length; i++) {
-            struct pipe *p = get_pipe(wea->to_pipes, i);
-            if (p->write_fd_is_open && !p->visited) {
-                /* Not all pipes' writable events have fired; do not yet
-                 * splice to /dev/null or add readable event. */
-                last_writable_handler = 0;
-                break;
-            }
+    else if (available == 0) {
+        if (pipe_is_at_eof(rea->from_pipe))
+            return 1;
+        rea->readable = false;
+        return 0;
+    }
+    pipe_note_full(rea->from_pipe,
+                   (size_t)available >= rea->from_pipe->capacity);
+
+    size_t limit = (size_t)available < rea->chunk_size ?
+                   (size_t)available : rea->chunk_size;
+    if (plan_chunk(rea, &limit) == 0u) {
+        /* nothing is left to relay to */
+        close_source(rea);
+        return 0;
+    }
+
+    if (limit == 0u) {
+        /* Every byte must wait for a full buffer to drain */
+        for (int i = 0; i < n_branches; i++) {
+            struct writable_ev_args *wea = rea->branches[i];
+            if (wea->to_pipe->write_fd_is_open && wea->buffer &&
+                    branch_backlog_space(wea) == 0u)
+                wake_branch(wea);
         }
+        return 0;
+    }
 
-        if (last_writable_handler == 1) {
-            /* If all pipes have been visited, then this is the last
-             * writable_handler to fire. bytes_safely_written lists how many
-             * bytes from the input pipe have been safely tee'd to ALL output
-             * pipes, and can therefore safely be discarded to /dev/null. */
-            ssize_t bytes = splice(wea->from_pipe->read_fd,
-                                   NULL,
-                                   fd_dev_null,
-                                   NULL,
-                                   *wea->bytes_safely_written,
-                                   SPLICE_F_NONBLOCK);
-            if (bytes < 0) {
-                got_eof = 0;
-                if (errno != EAGAIN) {
-                    REPORT_ERRORF("%s", strerror(errno));
-                    return;
-                }
-            }
-            else if (bytes > 0) {
-                for (int j = 0; j < (int)wea->to_pipes->length; j++) {
-                    struct pipe *to_pipe = get_pipe(wea->to_pipes, j);
-                    to_pipe->bytes_written -= bytes;
-                }
-                got_eof = 0;
+    /* Unbuffered branches are tee'd to first, as each may reduce limit;
+     * buffered branches are then sent as much of limit as fits. */
+    if (tee_ready(rea, 0u, rea->n_ready_unbuffered, true, &limit) < 0 ||
+            (limit > 0u &&
+             tee_ready(rea, rea->n_ready_unbuffered, rea->n_ready, false, &limit) < 0))
+        return -1;
+
+    /* If a buffered branch is still owed some of the bytes, they must be
+     * copied out, so the final branch is tee'd to after all */
+    bool copy = limit > 0u && branch_owed_data(rea, limit);
+    if (copy && rea->final) {
+        struct writable_ev_args *final = rea->final;
+        rea->final = NULL;
+        ssize_t bytes = tee(rea->from_pipe->read_fd, final->to_pipe->write_fd,
+                            limit, SPLICE_F_NONBLOCK);
+        bytes = tee_result(final, bytes < 0 ? -errno : bytes);
+        if (bytes < 0)
+            return -1;
+        if (final->buffer)
+            rea->held[rea->n_held++] = final;
+        else if (final->to_pipe->write_fd_is_open && (size_t)bytes < limit)
+            limit = (size_t)bytes;
+    }
+
+    if (limit == 0u) {
+        /* An unbuffered branch's pipe is full; its writable event will
+         * resume the source */
+        rea->final = NULL;
+        return 0;
+    }
+
+    ssize_t consumed = consume_chunk(rea, limit, copy);
+    rea->final = NULL;
+    if (consumed <= 0)
+        return consumed < 0 ? -1 : 0;
+
+    uint64_t staged_from = rea->consumed;
+    rea->consumed += (uint64_t)consumed;
+    /* only buffered branches can fall behind the source */
+    for (size_t k = 0u; k < rea->n_held; k++) {
+        if (settle_branch(rea, rea->held[k], staged_from) < 0)
+            return -1;
+    }
+    for (size_t k = rea->n_ready_unbuffered; k < rea->n_ready; k++) {
+        if (settle_branch(rea, rea->ready[k], staged_from) < 0)
+            return -1;
+    }
+
+    *consumed_out = (size_t)consumed;
+    return 0;
+}
+
+/**
+ * Tees chunks from a pipe to its branches until the source or a branch
+ * would block, or the batch_size or batch_time is used up, in which case
+ * the relay is resumed after other events have had a turn.
+ *
+ * Returns 1 on EOF, -1 on error and 0 otherwise.
+ */
+int write_multiple(struct readable_ev_args *rea) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (1) {
+        size_t consumed;
+        int status = tee_chunk(rea, &consumed);
+        if (status != 0 || consumed == 0u)
+            return status;
+
+        moved += consumed;
+        if (moved >= rea->batch_size || batch_expired(&start, rea->batch_time)) {
+            wake_source(rea);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Writes out a tee'd branch's buffer, then its spill file, until the branch
+ * would block or its batch is used up. Once both are empty, the branch is
+ * closed if its source has reached EOF.
+ */
+void drain_branch(struct writable_ev_args *wea) {
+    struct pipe *to_pipe = wea->to_pipe;
+    if (!to_pipe->write_fd_is_open)
+        return;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (branch_has_backlog(wea) && moved < wea->batch_size) {
+        ssize_t bytes;
+        if (!ring_buffer_is_empty(wea->buffer))
+            bytes = ring_buffer_write_to_fd(wea->buffer, to_pipe->write_fd);
+        else
+            bytes = spill_file_splice_to_fd(wea->spill, to_pipe->write_fd,
+                                            wea->chunk_size);
+        if (bytes < 0) {
+            if (errno == EPIPE) {
+                PRINT_DEBUG("Edge %s has no reader; closing pipe...\n",
+                            to_pipe->edge_ids[0]);
+                close_branch(wea);
+                wake_source(wea->rea);
+                return;
             }
-            else {
-                got_eof = 1;
+            else if (errno != EAGAIN) {
+                REPORT_ERRORF("%s", strerror(errno));
+                return;
             }
+            wea->writable = false;
+            break;
+        }
+        else if (bytes == 0) {
+            break;
         }
+        count_bytes_spliced(wea, bytes);
+        moved += (size_t)bytes;
+        if (batch_expired(&start, wea->batch_time))
+            break;
     }
-    if (last_writable_handler == 1) {
-        if (got_eof == 1) {
-            struct pipe *from_pipe = wea->from_pipe;
-            PRINT_DEBUG("Edge %s (and possibly others) got EOF; closing pipes...\n",
-                        from_pipe->edge_ids[0]);
-            if (from_pipe->read_fd_is_open && close(from_pipe->read_fd) == 0)
-                from_pipe->read_fd_is_open = false;
-            for (int k = 0; k < (int)wea->to_pipes->length; k++) {
-                struct pipe *to_pipe = get_pipe(wea->to_pipes, k);
-                if (to_pipe->write_fd_is_open && close(to_pipe->write_fd) == 0)
-                    to_pipe->write_fd_is_open = false;
-            }
+
+    if (branch_has_backlog(wea)) {
+        /* only comes back if the batch ran out rather than the pipe */
+        wake_branch(wea);
+    }
+    else if (wea->rea->got_eof) {
+        PRINT_DEBUG("Edge %s drained after EOF; closing pipe...\n",
+                    to_pipe->edge_ids[0]);
+        close_branch(wea);
+    }
+
+    /* the source may have been waiting for this branch */
+    if (!wea->rea->got_eof)
+        wake_source(wea->rea);
+}
+
+/**
+ * Adds a single edge to the next io_uring batch.
+ */
+void queue_relay(struct writable_ev_args *wea) {
+    if (wea->queued)
+        return;
+    if (n_queued_relays == queued_relays_capacity) {
+        size_t capacity = queued_relays_capacity ? queued_relays_capacity * 2u : 16u;
+        struct writable_ev_args **realloced = realloc(queued_relays,
+                capacity * sizeof(*queued_relays));
+        if (realloced == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            return;
+        }
+        queued_relays = realloced;
+        queued_relays_capacity = capacity;
+    }
+    queued_relays[n_queued_relays++] = wea;
+    wea->queued = true;
+    if (!relay_flushing)
+        event_active(relay_flush_event, EV_TIMEOUT, 0);
+}
+
+/**
+ * Records the result of a single edge's splice in an io_uring batch: the
+ * bytes spliced, or -errno. The edge is queued for the next round of the
+ * batch if it may have more to move.
+ */
+void relay_result(struct writable_ev_args *wea, ssize_t res, const struct timespec *start) {
+    struct readable_ev_args *rea = wea->rea;
+    if (res > 0) {
+        pipe_note_full(wea->to_pipe, false);
+        count_bytes_spliced(wea, res);
+        wea->batch_moved += (size_t)res;
+        if (wea->batch_moved >= wea->batch_size ||
+                batch_expired(start, wea->batch_time)) {
+            /* yield to other events, but come straight back */
+            wea->batch_moved = 0u;
+            wake_source(rea);
         }
         else {
-            int success = event_add(wea->readable_event, NULL);
-            if (success < 0)
-                PRINT_DEBUG("Not allowed to add readable handler\n");
+            queue_relay(wea);
         }
     }
+    else if (res == 0 || res == -EPIPE) {
+        PRINT_DEBUG("Edge %s got EOF; closing pipes...\n",
+                    wea->from_pipe->edge_ids[0]);
+        close_source(rea);
+        close_branch(wea);
+    }
+    else if (res == -EAGAIN) {
+        wea->batch_moved = 0u;
+        refresh_readiness(wea);
+        pipe_note_full(wea->to_pipe, !wea->writable);
+        if (rea->readable && wea->writable)
+            wake_source(rea);
+    }
+    else {
+        REPORT_ERRORF("%s", strerror((int)-res));
+    }
+}
+
+/**
+ * Splices a chunk for every queued single edge with one io_uring
+ * submission, and repeats for those which may have more to move, so that
+ * the number of system calls does not grow with the number of edges.
+ */
+void relay_flush_handler(evutil_socket_t fd, short what, void *arg) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    relay_flushing = true;
+    while (n_queued_relays > 0u) {
+        if (reserve_uring_scratch(n_queued_relays) < 0)
+            break;
+        size_t n = 0u;
+        for (size_t i = 0u; i < n_queued_relays; i++) {
+            struct writable_ev_args *wea = queued_relays[i];
+            wea->queued = false;
+            /* a pipe may have been closed since the edge was queued */
+            if (!wea->from_pipe->read_fd_is_open || !wea->to_pipe->write_fd_is_open)
+                continue;
+            struct uring_op *op = &uring_ops[n];
+            op->opcode = URING_SPLICE;
+            op->fd_in = wea->from_pipe->read_fd;
+            op->fd_out = wea->to_pipe->write_fd;
+            op->len = wea->chunk_size;
+            op->flags = SPLICE_F_NONBLOCK;
+            uring_targets[n++] = wea;
+        }
+        n_queued_relays = 0u;
+        if (n == 0u)
+            break;
+
+        if (uring_run(relay_uring, uring_ops, n) < 0) {
+            drop_io_uring();
+            relay_flushing = false;
+            /* the readable handlers will retry with system calls */
+            for (size_t k = 0u; k < n; k++)
+                wake_source(uring_targets[k]->rea);
+            return;
+        }
+
+        for (size_t k = 0u; k < n; k++)
+            relay_result(uring_targets[k], uring_ops[k].res, &start);
+    }
+    relay_flushing = false;
+}
+
+/**
+ * Moves splices and tees onto an io_uring, so that those for many edges
+ * cost one system call.
+ *
+ * On error (io_uring is unavailable): returns -1 with errno set, and
+ * system calls continue to be used.
+ */
+int use_io_uring(struct event_base *eb) {
+    relay_uring = uring_new(URING_ENTRIES);
+    if (relay_uring == NULL)
+        return -1;
+    relay_flush_event = event_new(eb, -1, 0, relay_flush_handler, NULL);
+    if (relay_flush_event == NULL) {
+        uring_free(relay_uring);
+        relay_uring = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+void stop_io_uring(void) {
+    if (relay_flush_event) {
+        event_free(relay_flush_event);
+        relay_flush_event = NULL;
+    }
+    uring_free(relay_uring);
+    relay_uring = NULL;
+    free(queued_relays);
+    queued_relays = NULL;
+    n_queued_relays = queued_relays_capacity = 0u;
+    free(uring_ops);
+    uring_ops = NULL;
+    free(uring_targets);
+    uring_targets = NULL;
+    uring_scratch_capacity = 0u;
+}
+
+/**
+ * Relays a single edge for as long as both of its pipes are ready.
+ */
+void relay_single(struct writable_ev_args *wea) {
+    struct readable_ev_args *rea = wea->rea;
+    if (!rea->readable || !wea->writable)
+        return;
+
+    if (relay_uring) {
+        queue_relay(wea);
+        return;
+    }
+
+    bool budget_spent;
+    int got_eof = write_single(wea, &budget_spent);
+    if (got_eof == 1) {
+        PRINT_DEBUG("Edge %s got EOF; closing pipes...\n",
+                    wea->from_pipe->edge_ids[0]);
+        close_source(rea);
+        close_branch(wea);
+    }
+    else if (got_eof == 0 && (budget_spent || (rea->readable && wea->writable))) {
+        /* yield to other events, but come straight back */
+        wake_source(rea);
+    }
+}
+
+void writable_handler(evutil_socket_t fd, short what, void *arg) {
+    struct writable_ev_args *wea = arg;
+
+    if ((what & EV_WRITE) == 0 || !wea->to_pipe->write_fd_is_open) {
+        return;
+    }
+    wea->writable = true;
+
+    if (wea->rea->to_pipes->length > 1u) {
+        drain_branch(wea);
+        return;
+    }
+
+    relay_single(wea);
 }
 
 void readable_handler(evutil_socket_t fd, short what, void *arg) {
     struct readable_ev_args *rea = arg;
-    if ((what & EV_READ) == 0) {
+    if ((what & EV_READ) == 0 || !rea->from_pipe->read_fd_is_open) {
         return;
     }
+    rea->readable = true;
 
-    *rea->bytes_safely_written = SIZE_MAX;
-    for (int i = 0; i < (int)rea->to_pipes->length; i++) {
-        struct pipe *to_pipe = get_pipe(rea->to_pipes, i);
-        to_pipe->visited = false;
+    if (all_branches_closed(rea)) {
+        close_source(rea);
+        return;
     }
 
-    int all_writable_fds_closed = 1;
-    for (int j = 0; j < (int)rea->writable_events->length; j++) {
-        struct event *ev = rea->writable_events->events[j];
-        if (ev == NULL)
-            continue;
-        /* Test if fd is still valid */
-        struct pipe *to_pipe = get_pipe(rea->to_pipes, j);
-        if (to_pipe->write_fd_is_open) {
-            all_writable_fds_closed = 0;
-            int success = event_add(ev, NULL);
-            if (success < 0)
-                PRINT_DEBUG("Not allowed to add writable handler\n");
-        }
-        else {
-            free(event_get_callback_arg(ev));
-            event_free(ev);
-            rea->writable_events->events[j] = NULL;
-        }
+    if (rea->to_pipes->length == 1u) {
+        relay_single(rea->branches[0]);
+        return;
     }
 
-    if (all_writable_fds_closed) {
-        free(rea);
-        if (close(fd) == 0)
-            rea->from_pipe->read_fd_is_open = false;
+    int got_eof = write_multiple(rea);
+    if (got_eof == 1) {
+        PRINT_DEBUG("Edge %s (and possibly others) got EOF; closing pipes...\n",
+                    rea->from_pipe->edge_ids[0]);
+        rea->got_eof = true;
+        close_source(rea);
+        for (int j = 0; j < (int)rea->to_pipes->length; j++) {
+            struct writable_ev_args *wea = rea->branches[j];
+            if (!branch_has_backlog(wea))
+                close_branch(wea);
+        }
     }
 }
 
 void stats_handler(evutil_socket_t fd, short what, void *arg) {
     struct stats_ev_args *sa = arg;
     struct p4_file *pf = sa->pf;
+    sample_direct_edges(pf, 0);
     create_stats_file(pf);
 }
@@ -2,11 +2,29 @@
 #define HP4_EVENT_HANDLERS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <event2/event.h>
 
 #include "parser.h"
 
+struct p4_node;
+
+/* Defaults for an edge's chunk_size, batch_size and batch_time (in
+ * microseconds); see struct p4_edge */
+#ifndef DEFAULT_CHUNK_SIZE
+#define DEFAULT_CHUNK_SIZE 65536
+#endif /* DEFAULT_CHUNK_SIZE */
+
+#ifndef DEFAULT_BATCH_SIZE
+#define DEFAULT_BATCH_SIZE 1048576
+#endif /* DEFAULT_BATCH_SIZE */
+
+#ifndef DEFAULT_BATCH_TIME
+#define DEFAULT_BATCH_TIME 1000
+#endif /* DEFAULT_BATCH_TIME */
+
 struct event_array {
     struct event **events;
     size_t length;
@@ -14,14 +32,47 @@ struct event_array {
 
 struct writable_ev_args {
     struct pipe *from_pipe;
-    struct pipe_array *to_pipes;
-    ssize_t **bytes_spliced;
+    struct pipe *to_pipe;
+    int64_t *bytes_spliced;
+
+    /* Holds data tee'd from from_pipe which did not yet fit in to_pipe.
+     * NULL if the edge is unbuffered. */
+    struct ring_buffer *buffer;
 
-    size_t *bytes_safely_written;
+    /* Holds data which did not fit below spill_high_water in buffer, once
+     * the edge has fallen that far behind. NULL if the edge does not spill. */
+    struct spill_file *spill;
+    size_t spill_high_water;
 
-    int to_pipe_idx;
+    struct p4_edge *edge;
 
+    /* Most bytes per splice(2), and most bytes and microseconds relayed
+     * before returning to the event loop */
+    size_t chunk_size;
+    size_t batch_size;
+    size_t batch_time;
+
+    struct readable_ev_args *rea;
+
+    /* Persistent, edge-triggered events */
+    struct event *writable_event;
     struct event *readable_event;
+
+    /* Whether to_pipe may have room. Set by writable_event and cleared once
+     * a write would block, so that a full pipe is not retried until the
+     * kernel reports that it has drained. */
+    bool writable;
+
+    /* Whether the edge is waiting for the next io_uring batch, and how much
+     * it has moved in the current one */
+    bool queued;
+    size_t batch_moved;
+
+    /* Offset in the source's stream up to which a tee'd branch has been
+     * sent data, whether into to_pipe or its backlog. Bytes between the
+     * source's consumed offset and this are in to_pipe but still in the
+     * source pipe too. */
+    uint64_t sent;
 };
 
 struct readable_ev_args {
@@ -29,7 +80,42 @@ struct readable_ev_args {
     struct pipe *from_pipe;
     struct pipe_array *to_pipes;
 
-    size_t *bytes_safely_written;
+    /* One per pipe in to_pipes, in the same order */
+    struct writable_ev_args **branches;
+
+    /* Scratch space of chunk_size bytes, used when data must be copied into
+     * a branch's buffer; NULL if no branch is buffered. */
+    char *staging;
+
+    /* Bytes removed from from_pipe so far */
+    uint64_t consumed;
+
+    /* The branches sorted for the current chunk, each with room for every
+     * branch: those ready to be tee'd to (n_ready_unbuffered unbuffered ones
+     * first), and buffered ones which may be owed some of the chunk */
+    struct writable_ev_args **ready;
+    size_t n_ready;
+    size_t n_ready_unbuffered;
+    struct writable_ev_args **held;
+    size_t n_held;
+
+    /* Branch which is sent the current chunk by splice(2), which moves it out
+     * of from_pipe, rather than by tee(2); NULL if there is none */
+    struct writable_ev_args *final;
+
+    /* Largest of the branches' chunk_size, batch_size and batch_time */
+    size_t chunk_size;
+    size_t batch_size;
+    size_t batch_time;
+
+    /* Persistent, edge-triggered event */
+    struct event *readable_event;
+
+    /* Whether from_pipe may hold data, in the same way as
+     * writable_ev_args.writable */
+    bool readable;
+
+    bool got_eof;
 };
 
 struct sigchld_args {
@@ -50,14 +136,25 @@ void event_array_free(struct event_array *ev_arr);
 
 void sigint_handler(evutil_socket_t fd, short what, void *arg);
 
+void end_node(struct p4_node *pn, struct sigchld_args *sa);
+
 void sigchld_handler(evutil_socket_t fd, short what, void *arg);
 
+bool batch_expired(const struct timespec *start, size_t batch_time);
+
+void raise_edge_limits(const struct p4_edge *pe, size_t *chunk_size,
+                       size_t *batch_size, size_t *batch_time);
+
 void writable_handler(evutil_socket_t fd, short what, void *arg);
 
 void readable_handler(evutil_socket_t fd, short what, void *arg);
 
 void stats_handler(evutil_socket_t fd, short what, void *arg);
 
+int use_io_uring(struct event_base *eb);
+
+void stop_io_uring(void);
+
 int open_dev_null(void);
 
 void close_dev_null(void);
@@ -0,0 +1,566 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <event2/event.h>
+
+#include "debug.h"
+#include "event_handlers.h"
+#include "file_node.h"
+#include "parser.h"
+#include "pipe.h"
+#include "pipe_budget.h"
+
+bool node_is_file(struct p4_node *pn) {
+    return strcmp(pn->type, "INFILE") == 0 || strcmp(pn->type, "OUTFILE") == 0;
+}
+
+/**
+ * Returns true if the file of the given name is a regular file, or, if
+ * may_be_missing, there is no such file yet. FIFOs and devices such as
+ * /dev/stdin cannot be read or written at an offset.
+ */
+bool file_is_regular(const char *name, bool may_be_missing) {
+    struct stat st;
+    if (stat(name, &st) < 0)
+        return may_be_missing && errno == ENOENT;
+    return S_ISREG(st.st_mode);
+}
+
+/**
+ * Takes the node's chunk_size, batch_size and batch_time from the largest
+ * of those of the edges using its pipe, or copied from or to it if it has
+ * none, each edge giving the defaults for any it leaves unset.
+ */
+void file_node_limits(struct p4_file *pf, struct file_node *fn) {
+    bool found = false;
+    fn->chunk_size = fn->batch_size = fn->batch_time = 0u;
+    for (int k = 0; fn->pipe && k < fn->pipe->n_edge_ids; k++) {
+        struct p4_edge *pe = find_edge_by_id(pf, fn->pipe->edge_ids[k]);
+        if (pe == NULL)
+            continue;
+        raise_edge_limits(pe, &fn->chunk_size, &fn->batch_size, &fn->batch_time);
+        found = true;
+    }
+    for (int i = 0; fn->pipe == NULL && i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (!pe->copy || strcmp(fn->output ? pe->to : pe->from, fn->node->id) != 0)
+            continue;
+        raise_edge_limits(pe, &fn->chunk_size, &fn->batch_size, &fn->batch_time);
+        found = true;
+    }
+    if (!found)
+        raise_edge_limits(NULL, &fn->chunk_size, &fn->batch_size, &fn->batch_time);
+}
+
+int64_t elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Keeps an OUTFILE node's dirty pages to about two write_behind windows:
+ * writeback is started on each window as it fills, and the window before
+ * it, which has had a window's time to reach the disk, is waited for and
+ * dropped from the page cache.
+ */
+void write_behind(struct file_node *fn) {
+    loff_t window = (loff_t)fn->node->write_behind;
+    if (window == 0 || fn->offset - fn->writeback_offset < window)
+        return;
+
+    if (fn->writeback_offset > fn->flushed_offset) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sync_file_range(fn->fd, fn->flushed_offset,
+                        fn->writeback_offset - fn->flushed_offset,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        __atomic_fetch_add(&fn->flush_us, elapsed_us(&start), __ATOMIC_RELAXED);
+        posix_fadvise(fn->fd, fn->flushed_offset,
+                      fn->writeback_offset - fn->flushed_offset, POSIX_FADV_DONTNEED);
+        fn->flushed_offset = fn->writeback_offset;
+    }
+    sync_file_range(fn->fd, fn->writeback_offset, fn->offset - fn->writeback_offset,
+                    SYNC_FILE_RANGE_WRITE);
+    fn->writeback_offset = fn->offset;
+}
+
+/**
+ * Makes sure that what an OUTFILE node wrote is on disk, if it asked for
+ * that, timing how long it takes.
+ */
+void flush_file_node(struct file_node *fn) {
+    if (!fn->node->fsync)
+        return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fsync(fn->fd) < 0)
+        REPORT_ERRORF("Node %s failed to sync %s: %s", fn->node->id,
+                      fn->node->name, strerror(errno));
+    __atomic_fetch_add(&fn->flush_us, elapsed_us(&start), __ATOMIC_RELAXED);
+}
+
+/**
+ * Stops moving data for a node once its file or pipe is done with, and
+ * closes the node's pipes as if its process had exited.
+ */
+void finish_file_node(struct file_node *fn) {
+    PRINT_DEBUG("File node %s finished after %ld bytes\n", fn->node->id,
+                (long)fn->bytes);
+    if (fn->event) {
+        event_free(fn->event);
+        fn->event = NULL;
+    }
+    if (fn->file_event) {
+        event_free(fn->file_event);
+        fn->file_event = NULL;
+    }
+    fn->ready = false;
+    if (fn->output) {
+        flush_file_node(fn);
+        /* the read end of the node's pipe is hp4's own, even if direct */
+        if (fn->pipe && fn->pipe->read_fd_is_open && close(fn->pipe->read_fd) == 0)
+            fn->pipe->read_fd_is_open = false;
+        if (fn->pipe)
+            pipe_budget_release(fn->pipe);
+    }
+    if (fn->fd >= 0) {
+        if (close(fn->fd) < 0)
+            REPORT_ERRORF("Node %s failed to close %s: %s", fn->node->id,
+                          fn->node->name, strerror(errno));
+        fn->fd = -1;
+    }
+    end_node(fn->node, fn->sa);
+}
+
+/**
+ * Works out which side of an INFILE node's splice blocked, as splice(2)
+ * only says that one did: a FIFO or device may have no data for now, as
+ * well as the pipe being full. Only that side is marked not ready, so that
+ * the node waits for its event; if neither now seems to block, the event
+ * loop is asked to come straight back.
+ */
+void infile_blocked(struct file_node *fn) {
+    if (fn->seekable) {
+        fn->ready = false;
+        return;
+    }
+    struct pollfd fds[2] = {
+        { .fd = fn->fd, .events = POLLIN },
+        { .fd = fn->pipe->write_fd, .events = POLLOUT }
+    };
+    if (poll(fds, 2, 0) < 0) {
+        event_active(fn->event, EV_WRITE, 0);
+        return;
+    }
+    fn->file_ready = (fds[0].revents & (POLLIN|POLLHUP|POLLERR)) != 0;
+    fn->ready = (fds[1].revents & (POLLOUT|POLLERR)) != 0;
+    if (fn->file_ready && fn->ready)
+        event_active(fn->event, EV_WRITE, 0);
+}
+
+/**
+ * Splices between a file node's file and its pipe until either would
+ * block, the data runs out, or the node's batch_size or batch_time is
+ * spent; in the last case the event loop is asked to come straight back.
+ * An INFILE node asks the kernel to start reading ahead each next batch.
+ */
+void move_file_node(struct file_node *fn) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (fn->ready && fn->file_ready) {
+        size_t len = fn->chunk_size;
+        if (fn->remaining < (uint64_t)len)
+            len = (size_t)fn->remaining;
+        if (len == 0u) {
+            finish_file_node(fn);
+            return;
+        }
+
+        ssize_t bytes;
+        if (fn->output)
+            bytes = splice(fn->pipe->read_fd, NULL, fn->fd, &fn->offset,
+                           len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        else
+            bytes = splice(fn->fd, fn->seekable ? &fn->offset : NULL, fn->pipe->write_fd,
+                           NULL, len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (bytes < 0) {
+            if (errno == EAGAIN) {
+                if (fn->output)
+                    fn->ready = false;
+                else
+                    infile_blocked(fn);
+                return;
+            }
+            /* EPIPE: an INFILE node's readers have all gone */
+            if (errno != EPIPE)
+                REPORT_ERRORF("Node %s: %s", fn->node->id, strerror(errno));
+            finish_file_node(fn);
+            return;
+        }
+        else if (bytes == 0) {
+            finish_file_node(fn);
+            return;
+        }
+
+        if (fn->remaining != UINT64_MAX)
+            fn->remaining -= (uint64_t)bytes;
+        __atomic_fetch_add(&fn->bytes, (int64_t)bytes, __ATOMIC_RELAXED);
+        if (fn->bytes_spliced)
+            __atomic_fetch_add(fn->bytes_spliced, (int64_t)bytes, __ATOMIC_RELAXED);
+        moved += (size_t)bytes;
+        if (fn->output)
+            write_behind(fn);
+        if (moved >= fn->batch_size || batch_expired(&start, fn->batch_time)) {
+            if (!fn->output && fn->seekable)
+                posix_fadvise(fn->fd, fn->offset, (off_t)fn->batch_size,
+                              POSIX_FADV_WILLNEED);
+            event_active(fn->event, fn->output ? EV_READ : EV_WRITE, 0);
+            return;
+        }
+    }
+}
+
+void file_node_handler(evutil_socket_t fd, short what, void *arg) {
+    struct file_node *fn = arg;
+    if (fn->output) {
+        if ((what & EV_READ) == 0 || !fn->pipe->read_fd_is_open)
+            return;
+    }
+    else if ((what & EV_WRITE) == 0 || !fn->pipe->write_fd_is_open) {
+        return;
+    }
+    fn->ready = true;
+    move_file_node(fn);
+}
+
+void file_ready_handler(evutil_socket_t fd, short what, void *arg) {
+    struct file_node *fn = arg;
+    fn->file_ready = true;
+    move_file_node(fn);
+}
+
+/**
+ * Copies up to len bytes from offset *in_off of in_fd to the end of what
+ * has been written to dst's file. copy_file_range(2) lets the filesystem
+ * share blocks rather than copy them where it can; where it cannot be used
+ * between the two files, sendfile(2) still keeps the copy in the kernel.
+ *
+ * Returns as for copy_file_range(2).
+ */
+ssize_t copy_range(int in_fd, loff_t *in_off, struct file_node *dst, size_t len) {
+#ifdef HAVE_COPY_FILE_RANGE
+    if (!dst->use_sendfile) {
+        ssize_t bytes = copy_file_range(in_fd, in_off, dst->fd, &dst->offset, len, 0u);
+        if (bytes >= 0 || (errno != EXDEV && errno != EINVAL &&
+                           errno != ENOSYS && errno != EOPNOTSUPP))
+            return bytes;
+        PRINT_DEBUG("Node %s: copy_file_range failed (%s); using sendfile\n",
+                    dst->node->id, strerror(errno));
+        dst->use_sendfile = true;
+    }
+#endif /* HAVE_COPY_FILE_RANGE */
+    /* sendfile(2) writes at the file position, which copying did not move */
+    if (lseek(dst->fd, dst->offset, SEEK_SET) < 0)
+        return -1;
+    off_t off = (off_t)*in_off;
+    ssize_t bytes = sendfile(dst->fd, in_fd, &off, len);
+    if (bytes > 0) {
+        *in_off = (loff_t)off;
+        dst->offset += bytes;
+    }
+    return bytes;
+}
+
+/**
+ * Copies the next batch of an INFILE node's file to each of the OUTFILE
+ * nodes its edges go to which has not finished, then has the event loop
+ * come back for the next. As when splicing, each call copies at most the
+ * node's chunk_size, and each destination stops after batch_size bytes or
+ * batch_time, so that a slow disk does not hold up the event loop. Each
+ * copy keeps its own place, so a failing destination does not hold up the
+ * others.
+ */
+void copy_file_node(struct file_node *src) {
+    bool more = false;
+    for (size_t i = 0u; i < src->n_copies; i++) {
+        struct file_node *dst = src->copies[i];
+        if (dst->node->ended)
+            continue;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t moved = 0u;
+        ssize_t bytes;
+        do {
+            size_t len = src->chunk_size;
+            if (src->remaining - (uint64_t)dst->offset < (uint64_t)len)
+                len = (size_t)(src->remaining - (uint64_t)dst->offset);
+            bytes = 0;
+            if (len > 0u) {
+                loff_t in_off = (loff_t)src->node->offset + dst->offset;
+                bytes = copy_range(src->fd, &in_off, dst, len);
+            }
+            if (bytes <= 0)
+                break;
+
+            __atomic_fetch_add(&dst->bytes, (int64_t)bytes, __ATOMIC_RELAXED);
+            __atomic_fetch_add(dst->bytes_spliced, (int64_t)bytes, __ATOMIC_RELAXED);
+            if (dst->offset > src->bytes)
+                __atomic_store_n(&src->bytes, (int64_t)dst->offset, __ATOMIC_RELAXED);
+            write_behind(dst);
+            moved += (size_t)bytes;
+        } while (moved < src->batch_size && !batch_expired(&start, src->batch_time));
+
+        if (bytes < 0)
+            REPORT_ERRORF("Node %s failed to copy to node %s: %s", src->node->id,
+                          dst->node->id, strerror(errno));
+        if (bytes <= 0) {
+            finish_file_node(dst);
+            continue;
+        }
+        more = true;
+    }
+
+    if (more)
+        event_active(src->event, EV_TIMEOUT, 0);
+    else
+        finish_file_node(src);
+}
+
+void copy_handler(evutil_socket_t fd, short what, void *arg) {
+    copy_file_node(arg);
+}
+
+/**
+ * Has an INFILE node's file copied to an OUTFILE node along edge pe, within
+ * the limits file_node_limits took from its copy edges. If the OUTFILE node
+ * was not told what size to expect, space is allocated for the whole copy.
+ */
+int file_node_add_copy(struct file_node *src, struct file_node *dst, struct p4_edge *pe) {
+    struct file_node **copies = realloc(src->copies,
+                                        (src->n_copies + 1u) * sizeof(*copies));
+    if (copies == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    src->copies = copies;
+    src->copies[src->n_copies++] = dst;
+    dst->bytes_spliced = &pe->bytes_spliced;
+
+    struct stat st;
+    if (dst->node->size == 0u && fstat(src->fd, &st) == 0 &&
+            (uint64_t)st.st_size > (uint64_t)src->node->offset) {
+        uint64_t size = (uint64_t)st.st_size - (uint64_t)src->node->offset;
+        if (size > src->remaining)
+            size = src->remaining;
+        if (fallocate(dst->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) < 0 &&
+                errno != EOPNOTSUPP) {
+            REPORT_ERRORF("Node %s failed to allocate %lu bytes for %s: %s",
+                          dst->node->id, (unsigned long)size, dst->node->name,
+                          strerror(errno));
+            return -1;
+        }
+    }
+
+    event_active(src->event, EV_TIMEOUT, 0);
+    return 0;
+}
+
+/**
+ * Opens the file of an INFILE node. Reading is sequential, so the kernel
+ * is told to read ahead aggressively; a range set by the node's offset and
+ * length is read with pread-style offsets, leaving the file position alone.
+ * A FIFO or device is just read from where it is. It is opened without
+ * blocking, as a FIFO's writer may be a node which has yet to be started.
+ */
+int open_infile(struct file_node *fn) {
+    struct p4_node *pn = fn->node;
+    fn->offset = (loff_t)pn->offset;
+    fn->remaining = pn->length > 0u ? (uint64_t)pn->length : UINT64_MAX;
+    fn->fd = open(pn->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (fn->fd < 0) {
+        REPORT_ERRORF("Node %s failed to open %s: %s", pn->id, pn->name,
+                      strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fn->fd, &st) < 0) {
+        REPORT_ERRORF("Node %s failed to stat %s: %s", pn->id, pn->name,
+                      strerror(errno));
+        return -1;
+    }
+    fn->seekable = S_ISREG(st.st_mode);
+    if (fn->seekable) {
+        posix_fadvise(fn->fd, fn->offset, (off_t)pn->length, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fn->fd, fn->offset, (off_t)fn->batch_size, POSIX_FADV_WILLNEED);
+    }
+    return 0;
+}
+
+/**
+ * Creates or truncates the file of an OUTFILE node. If the node gives the
+ * size it expects, the space is allocated up front, so that the file is
+ * laid out contiguously and a full disk is found straight away; the file's
+ * size still grows only as data is written.
+ */
+int open_outfile(struct file_node *fn) {
+    struct p4_node *pn = fn->node;
+    fn->offset = 0;
+    fn->remaining = UINT64_MAX;
+    fn->fd = open(pn->name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+                  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if (fn->fd < 0) {
+        REPORT_ERRORF("Node %s failed to open %s: %s", pn->id, pn->name,
+                      strerror(errno));
+        return -1;
+    }
+    /* filesystems which cannot allocate ahead just do without */
+    if (pn->size > 0u &&
+            fallocate(fn->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)pn->size) < 0 &&
+            errno != EOPNOTSUPP) {
+        REPORT_ERRORF("Node %s failed to allocate %zu bytes for %s: %s",
+                      pn->id, pn->size, pn->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens the file of an INFILE or OUTFILE node and starts moving data
+ * between it and the node's pipe from eb's event loop.
+ */
+struct file_node *file_node_new(struct p4_file *pf, struct p4_node *pn,
+                                struct event_base *eb, struct sigchld_args *sa) {
+    bool output = strcmp(pn->type, "OUTFILE") == 0;
+    struct pipe_array *pipes = output ? pn->in_pipes : pn->out_pipes;
+    /* a node without a pipe has its edges copied */
+    if (pipes->length > 1u) {
+        REPORT_ERRORF("%s node %s must have at most one %s", pn->type, pn->id,
+                      output ? "input" : "output");
+        return NULL;
+    }
+
+    struct file_node *fn = malloc(sizeof(*fn));
+    if (fn == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+    fn->node = pn;
+    fn->pipe = pipes->length > 0u ? get_pipe(pipes, 0) : NULL;
+    fn->output = output;
+    fn->fd = -1;
+    fn->copies = NULL;
+    fn->n_copies = 0u;
+    fn->use_sendfile = false;
+    fn->seekable = true;
+    fn->bytes = 0;
+    fn->writeback_offset = 0;
+    fn->flushed_offset = 0;
+    fn->flush_us = 0;
+    fn->bytes_spliced = NULL;
+    fn->event = NULL;
+    fn->ready = false;
+    fn->file_event = NULL;
+    fn->file_ready = true;
+    fn->sa = sa;
+    file_node_limits(pf, fn);
+
+    /* a direct pipe is not relayed, so its edge is counted here; by the
+     * OUTFILE node if both ends are file nodes */
+    if (fn->pipe && fn->pipe->direct) {
+        struct p4_edge *pe = find_edge_by_id(pf, fn->pipe->edge_ids[0]);
+        struct p4_node *to = pe ? find_node_by_id(pf, pe->to) : NULL;
+        if (pe && (output || to == NULL || !node_is_file(to)))
+            fn->bytes_spliced = &pe->bytes_spliced;
+    }
+
+    if ((output ? open_outfile(fn) : open_infile(fn)) < 0) {
+        file_node_free(fn);
+        return NULL;
+    }
+
+    /* copying is driven by the INFILE node, with no fd to wait on */
+    if (fn->pipe == NULL) {
+        if (!output) {
+            fn->event = event_new(eb, -1, 0, copy_handler, fn);
+            if (fn->event == NULL) {
+                REPORT_ERROR("Failed to create new file node event");
+                file_node_free(fn);
+                return NULL;
+            }
+        }
+        return fn;
+    }
+
+    int fd = output ? fn->pipe->read_fd : fn->pipe->write_fd;
+    int current_flags = fcntl(fd, F_GETFL, NULL);
+    if (current_flags < 0 || fcntl(fd, F_SETFL, current_flags | O_NONBLOCK) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        file_node_free(fn);
+        return NULL;
+    }
+
+    fn->event = event_new(eb, fd, (output ? EV_READ : EV_WRITE)|EV_PERSIST|EV_ET,
+                          file_node_handler, fn);
+    if (fn->event == NULL) {
+        REPORT_ERROR("Failed to create new file node event");
+        file_node_free(fn);
+        return NULL;
+    }
+    if (event_add(fn->event, NULL) < 0) {
+        REPORT_ERROR("Failed to add file node event");
+        event_free(fn->event);
+        file_node_free(fn);
+        return NULL;
+    }
+
+    /* a FIFO or device may have no data yet, and a FIFO reads as ended until
+     * its writer has opened it, so it is not read until it says it is
+     * ready; one which cannot be waited on is taken as never blocking */
+    if (!output && !fn->seekable) {
+        fn->file_event = event_new(eb, fn->fd, EV_READ|EV_PERSIST|EV_ET,
+                                   file_ready_handler, fn);
+        if (fn->file_event == NULL) {
+            REPORT_ERROR("Failed to create new file node event");
+            event_free(fn->event);
+            file_node_free(fn);
+            return NULL;
+        }
+        if (event_add(fn->file_event, NULL) == 0) {
+            fn->file_ready = false;
+        }
+        else {
+            event_free(fn->file_event);
+            fn->file_event = NULL;
+        }
+    }
+    return fn;
+}
+
+/**
+ * Frees a file node. Its event is freed once the node finishes; one which
+ * has not finished is left to its event_base, which may already be gone.
+ */
+void file_node_free(struct file_node *fn) {
+    if (fn != NULL) {
+        if (fn->fd >= 0)
+            close(fn->fd);
+        free(fn->copies);
+        free(fn);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef HP4_FILE_NODE_H
+#define HP4_FILE_NODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "event_handlers.h"
+#include "parser.h"
+#include "pipe.h"
+
+/* A node which hp4 runs itself, moving data between a file and the node's
+ * pipe, rather than forking a process to do so: out of the file for an
+ * INFILE node, and into it for an OUTFILE node */
+struct file_node {
+    struct p4_node *node;
+    /* NULL if the node's edges are copied */
+    struct pipe *pipe;
+    int fd;
+    bool output;
+
+    /* INFILE nodes whose edges are copied within the kernel: the OUTFILE
+     * nodes they are copied to */
+    struct file_node **copies;
+    size_t n_copies;
+
+    /* OUTFILE nodes copied to: whether copy_file_range(2) has been found not
+     * to work between the two files, so that sendfile(2) is used instead */
+    bool use_sendfile;
+
+    /* Whether the file is a regular file, which is read at offset, rather
+     * than a FIFO or device, which is read from wherever it is */
+    bool seekable;
+
+    /* Offset in the file of the next byte to move, and how many bytes are
+     * left to move (UINT64_MAX for the rest of the file) */
+    loff_t offset;
+    uint64_t remaining;
+
+    /* Bytes moved so far */
+    int64_t bytes;
+
+    /* OUTFILE nodes: offsets up to which writeback has been started, and
+     * up to which it has finished and the pages been dropped; and
+     * microseconds spent waiting for data to reach the disk */
+    loff_t writeback_offset;
+    loff_t flushed_offset;
+    int64_t flush_us;
+
+    /* Count of the node's edge when its pipe is direct, and so not counted
+     * by a relay; NULL otherwise */
+    int64_t *bytes_spliced;
+
+    /* Largest of the chunk_size, batch_size and batch_time of the node's
+     * edges */
+    size_t chunk_size;
+    size_t batch_size;
+    size_t batch_time;
+
+    /* Persistent, edge-triggered event, and whether the pipe may be ready,
+     * as for a relayed edge */
+    struct event *event;
+    bool ready;
+
+    /* INFILE nodes whose file is not seekable: persistent, edge-triggered
+     * event on the file, and whether it may have data; always true for
+     * other nodes, whose files never block */
+    struct event *file_event;
+    bool file_ready;
+
+    struct sigchld_args *sa;
+};
+
+bool node_is_file(struct p4_node *pn);
+
+bool file_is_regular(const char *name, bool may_be_missing);
+
+struct file_node *file_node_new(struct p4_file *pf, struct p4_node *pn,
+                                struct event_base *eb, struct sigchld_args *sa);
+
+int file_node_add_copy(struct file_node *src, struct file_node *dst, struct p4_edge *pe);
+
+void file_node_free(struct file_node *fn);
+
+#endif /* HP4_FILE_NODE_H */
@@ -6,20 +6,30 @@
 #include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <event2/event.h>
 
+#include "buffer.h"
 #include "debug.h"
 #include "event_handlers.h"
+#include "file_node.h"
 #include "hp4.h"
 #include "parser.h"
 #include "pipe.h"
+#include "pipe_budget.h"
+#include "record_node.h"
+#include "relay_threads.h"
+#include "replicas.h"
+#include "launch.h"
+#include "spill.h"
 #include "stats.h"
-#include "strutil.h"
+#include "uring.h"
 #include "validate.h"
 
 #define DEFAULT_INTERVAL 1000
@@ -35,12 +45,14 @@ int build_edge_exec_to_exec(struct p4_edge *pe, struct p4_node *from, struct p4_
         if (pipe_array_append_new(from->out_pipes, pe->from_port, pe->id) < 0) {
             return -1;
         }
+        p = get_pipe(from->out_pipes, from->out_pipes->length - 1);
     }
     else {
         if (pipe_append_edge_id(p, pe->id) < 0) {
             return -1;
         }
     }
+    pipe_request_capacity(p, pe->pipe_size, pe->pipe_priority);
 
     p = pipe_array_find_pipe_with_port(to->in_pipes, pe->to_port);
     /* if to->in_pipes does NOT have a pipe with to_port
@@ -49,12 +61,14 @@ int build_edge_exec_to_exec(struct p4_edge *pe, struct p4_node *from, struct p4_
         if (pipe_array_append_new(to->in_pipes, pe->to_port, pe->id) < 0) {
             return -1;
         }
+        p = get_pipe(to->in_pipes, to->in_pipes->length - 1);
     }
     else {
         if (pipe_append_edge_id(p, pe->id) < 0) {
             return -1;
         }
     }
+    pipe_request_capacity(p, pe->pipe_size, pe->pipe_priority);
 
     if (append_edge_to_array(&from->listening_edges, pe) < 0) {
         return -1;
@@ -62,6 +76,83 @@ int build_edge_exec_to_exec(struct p4_edge *pe, struct p4_node *from, struct p4_
     return 0;
 }
 
+/**
+ * Returns true if an edge can be wired directly: it joins one node's stdout
+ * to another's stdin, no other edge uses either, and exact byte counts are
+ * not wanted for it.
+ */
+bool edge_is_direct(struct p4_file *pf, struct p4_edge *pe) {
+    if (pe->exact_bytes || strcmp(pe->from, pe->to) == 0 ||
+            strcmp(pe->from_port, STDIO_PORT) != 0 ||
+            strcmp(pe->to_port, STDIO_PORT) != 0)
+        return false;
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *other = p4_file_get_edge(pf, i);
+        if (other == pe)
+            continue;
+        if ((strcmp(other->from, pe->from) == 0 &&
+                    strcmp(other->from_port, pe->from_port) == 0) ||
+                (strcmp(other->to, pe->to) == 0 &&
+                    strcmp(other->to_port, pe->to_port) == 0))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns true if no edge but pe goes into its destination.
+ */
+bool edge_is_only_input(struct p4_file *pf, struct p4_edge *pe) {
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *other = p4_file_get_edge(pf, i);
+        if (other != pe && strcmp(other->to, pe->to) == 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns true if an edge can be copied from file to file within the
+ * kernel: it joins an INFILE node to an OUTFILE node, and every other edge
+ * from the INFILE node does the same, so that no pipe is needed. Each
+ * OUTFILE node must have no other input, and the INFILE node's file must be
+ * a regular file, as each copy reads it at its own offset.
+ */
+bool edge_is_copy(struct p4_file *pf, struct p4_edge *pe) {
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *other = p4_file_get_edge(pf, i);
+        if (strcmp(other->from, pe->from) != 0)
+            continue;
+        struct p4_node *from = find_node_by_id(pf, other->from);
+        struct p4_node *to = find_node_by_id(pf, other->to);
+        if (from == NULL || to == NULL || strcmp(from->type, "INFILE") != 0 ||
+                strcmp(to->type, "OUTFILE") != 0 ||
+                !edge_is_only_input(pf, other) ||
+                !file_is_regular(from->name, false))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Creates a single pipe for a direct edge, which both nodes share, so that
+ * data passes between them without being relayed by hp4.
+ */
+int build_edge_direct(struct p4_edge *pe, struct p4_node *from, struct p4_node *to) {
+    if (pipe_array_append_new(from->out_pipes, pe->from_port, pe->id) < 0) {
+        return -1;
+    }
+    struct pipe *p = get_pipe(from->out_pipes, from->out_pipes->length - 1);
+    p->direct = true;
+    pipe_request_capacity(p, pe->pipe_size, pe->pipe_priority);
+
+    if (pipe_array_append(to->in_pipes, p) < 0) {
+        return -1;
+    }
+    pe->direct = true;
+    return 0;
+}
+
 /**
  * Creates pipes for each edge in the graph.
  */
@@ -83,152 +174,32 @@ int build_edges(struct p4_file *pf) {
             return -1;
         }
 
-        if (strncmp(from->type, "EXEC\0", 5) == 0 && strncmp(to->type, "EXEC\0", 5) == 0) {
-            if (build_edge_exec_to_exec(pe, from, to) < 0)
-                return -1;
-        }
-        else {
-            free_p4_file(pf);
-            fprintf(stderr, "Non-EXEC nodes are not supported\n");
-            return -1;
-        }
-    }
-    return 0;
-}
-
-/**
- * Runs in child processes.
- * Configures and initialises pipes containing output data.
- */
-int setup_out_pipes(struct p4_node *pn, struct argstruct *pa) {
-    pid_t ppid = getppid();
-    bool default_stdout = true;
-    for (int m = 0; m < (int)pn->out_pipes->length; m++) {
-        struct pipe *out_pipe = get_pipe(pn->out_pipes, m);
-        if (strcmp(out_pipe->port, "-") == 0) {
-            if (!default_stdout) {
-                /* this means that another pipe has already changed this node's
-                 * stdout. It should not happen; two edges which read stdout from
-                 * same node should share an out_pipe. */
-                REPORT_ERROR("Tried to change a node's stdout a second time");
-                return -1;
+        /* INFILE nodes only write, and OUTFILE nodes only read, using
+         * pipes of their own as an EXEC node's process would; record nodes
+         * do both */
+        if ((strncmp(from->type, "EXEC\0", 5) == 0 || strcmp(from->type, "INFILE") == 0 ||
+                    node_is_record(from)) &&
+                (strncmp(to->type, "EXEC\0", 5) == 0 || strcmp(to->type, "OUTFILE") == 0 ||
+                    node_is_record(to))) {
+            if (edge_is_copy(pf, pe)) {
+                /* the file nodes copy between themselves */
+                pe->copy = true;
             }
-            else if (dup2(out_pipe->write_fd, STDOUT_FILENO) < 0) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
-            }
-            default_stdout = false;
-        }
-        else {
-            /* ppid and out_pipe->write_fd should not become large enough to overflow
-             * 50 bytes */
-            char *out_port_fs = calloc(50u, sizeof(*out_port_fs));
-            if (out_port_fs == NULL) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
-            }
-            if (sprintf(out_port_fs, "/proc/%u/fd/%d", ppid, out_pipe->write_fd) < 0) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
-            }
-            for (int n = 0; n < pa->argc; n++) {
-                char *replaced = strrep(pa->argv[n], out_pipe->port, out_port_fs);
-                if (replaced == NULL)
+            else if (edge_is_direct(pf, pe)) {
+                if (build_edge_direct(pe, from, to) < 0)
                     return -1;
-                pa->argv[n] = replaced;
-            }
-        }
-    }
-    if (default_stdout) {
-        close(STDOUT_FILENO);
-    }
-    return 0;
-}
-
-/**
- * Runs in child processes.
- * Configures and initialises pipes containing input data.
- */
-int setup_in_pipes(struct p4_node *pn, struct argstruct *pa) {
-    pid_t ppid = getppid();
-    bool default_stdin = true;
-    for (int o = 0; o < (int)pn->in_pipes->length; o++) {
-        struct pipe *in_pipe = get_pipe(pn->in_pipes, o);
-        if (strcmp(in_pipe->port, "-") == 0) {
-            if (!default_stdin) {
-                /* this means that another pipe has already changed this node's
-                 * stdin. This should not happen; two edges which read stdin from the
-                 * same node should share in_pipe. */
-                REPORT_ERROR("Tried to change a node's stdin a second time");
-                return -1;
             }
-            else if (dup2(in_pipe->read_fd, STDIN_FILENO) < 0) {
-                REPORT_ERRORF("%s", strerror(errno));
+            else if (build_edge_exec_to_exec(pe, from, to) < 0) {
                 return -1;
             }
-            default_stdin = false;
         }
         else {
-            /* ppid and in_pipe->read_fd should not become large enough to overflow
-             * 50 bytes */
-            char *in_port_fs = calloc(50u, sizeof(*in_port_fs));
-            if (in_port_fs == NULL) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
-            }
-            if (sprintf(in_port_fs, "/proc/%u/fd/%d", ppid, in_pipe->read_fd) < 0) {
-                REPORT_ERRORF("%s", strerror(errno));
-                return -1;
-            }
-            for (int p = 0; p < pa->argc; p++) {
-                char *replaced = strrep(pa->argv[p], in_pipe->port, in_port_fs);
-                if (replaced == NULL)
-                    return -1;
-                pa->argv[p] = replaced;
-            }
-        }
-    }
-    if (default_stdin) {
-        close(STDIN_FILENO);
-    }
-    return 0;
-}
-
-/**
- * Runs in child processes.
- * Initialises pipes, then calls execvp().
- */
-int run_node(struct p4_file *pf, struct p4_node *pn) {
-    struct argstruct *pa = malloc(sizeof(*pa));
-    if (pa == NULL)
-        return -1;
-
-    if (parse_argstring(pa, pn->cmd) < 0)
-        return -1;
-
-    if (setup_out_pipes(pn, pa) < 0)
-        return -1;
-
-    if (setup_in_pipes(pn, pa) < 0)
-        return -1;
-
-    for (int q = 0; q < (int)pf->nodes->length; q++) {
-        struct p4_node *po = p4_file_get_node(pf, q);
-        if (po->in_pipes && pipe_array_close(po->in_pipes) < 0) {
-            return -1;
-        }
-        if (po->out_pipes && pipe_array_close(po->out_pipes) < 0) {
+            fprintf(stderr, "Edge %s: edges from %s nodes to %s nodes are not supported\n",
+                    pe->id, from->type, to->type);
             return -1;
         }
     }
-    /* TODO should stderr be closed? */
-    PRINT_DEBUG("Node %s about to exec\n", pn->id);
-    int success = execvp(pa->argv[0], pa->argv);
-    if (success < 0) {
-        REPORT_ERRORF("Node %s failed to exec; is %s in PATH?", pn->id, pn->cmd);
-        exit(EXIT_FAILURE);
-    }
-    return success;
+    return 0;
 }
 
 int setup_writable_event(struct p4_file *pf, struct p4_edge *edge, struct event_base *eb, struct readable_ev_args *rea, struct writable_ev_args *wea) {
@@ -254,17 +225,25 @@ int setup_writable_event(struct p4_file *pf, struct p4_edge *edge, struct event_
         return -1;
     }
 
-    if (pipe_array_append(wea->to_pipes, to_pipe) < 0) {
-        return -1;
-    }
+    wea->to_pipe = to_pipe;
+    wea->writable = false;
+    wea->queued = false;
+    wea->batch_moved = 0u;
 
     struct event *writable = event_new(eb, to_pipe->write_fd,
-                                       EV_WRITE, writable_handler,
-                                       wea);
+                                       EV_WRITE|EV_PERSIST|EV_ET,
+                                       writable_handler, wea);
     if (writable == NULL) {
         REPORT_ERROR("Failed to create new writable event");
         return -1;
     }
+    wea->writable_event = writable;
+
+    if (event_add(writable, NULL) < 0) {
+        REPORT_ERROR("Failed to add writable event");
+        event_free(writable);
+        return -1;
+    }
 
     if (event_array_append(dest->writable_events, writable) < 0) {
         event_free(writable);
@@ -276,12 +255,55 @@ int setup_writable_event(struct p4_file *pf, struct p4_edge *edge, struct event_
         return -1;
     }
 
+    rea->branches[rea->to_pipes->length] = wea;
+    if (pipe_array_append(rea->to_pipes, to_pipe) < 0) {
+        return -1;
+    }
+
     return 0;
 }
 
-int setup_events(struct p4_file *pf, struct p4_node *pn, struct event_base *eb) {
+/**
+ * Creates the memory buffer and spill file, if any, for an edge tee'd from
+ * the same pipe as others.
+ */
+int setup_branch_buffer(struct p4_edge *edge, struct readable_ev_args *rea, struct writable_ev_args *wea) {
+    size_t capacity = edge->buffer_size;
+    if (edge->spill_high_water > 0u) {
+        if (capacity == 0u)
+            capacity = edge->spill_high_water;
+        wea->spill_high_water = edge->spill_high_water < capacity ?
+                                edge->spill_high_water : capacity;
+    }
+    if (capacity == 0u)
+        return 0;
+
+    wea->buffer = ring_buffer_new(capacity);
+    if (wea->buffer == NULL)
+        return -1;
+
+    if (edge->spill_high_water > 0u) {
+        wea->spill = spill_file_new(edge->spill_dir);
+        if (wea->spill == NULL) {
+            ring_buffer_free(wea->buffer);
+            wea->buffer = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Creates events to relay each of a node's out_pipes. With a relay pool, a
+ * pipe's events go on the event_base of the thread planned for it;
+ * otherwise they go on eb.
+ */
+int setup_events(struct p4_file *pf, struct p4_node *pn, struct event_base *eb, struct relay_pool *rp) {
     for (int j = 0; j < (int)pn->out_pipes->length; j++) {
         struct pipe *from_pipe = get_pipe(pn->out_pipes, j);
+        if (from_pipe->direct)
+            continue;
+        struct event_base *relay_eb = rp ? relay_pool_base(rp, from_pipe) : eb;
 
         struct readable_ev_args *rea = malloc(sizeof(*rea));
         if (rea == NULL) {
@@ -289,50 +311,64 @@ int setup_events(struct p4_file *pf, struct p4_node *pn, struct event_base *eb)
             return -1;
         }
         rea->from_pipe = from_pipe;
+        rea->staging = NULL;
+        rea->final = NULL;
+        rea->consumed = 0u;
+        rea->n_ready = rea->n_ready_unbuffered = rea->n_held = 0u;
+        rea->chunk_size = 0u;
+        rea->batch_size = 0u;
+        rea->batch_time = 0u;
+        rea->readable = false;
+        rea->got_eof = false;
 
         int read_fd = from_pipe->read_fd;
         int current_read_flags = fcntl(read_fd, F_GETFL, NULL);
         if (current_read_flags < 0) {
             REPORT_ERRORF("%s", strerror(errno));
+            free(rea);
             return -1;
         }
         if (fcntl(read_fd, F_SETFL, current_read_flags | O_NONBLOCK) < 0) {
             REPORT_ERRORF("%s", strerror(errno));
+            free(rea);
             return -1;
         }
-        struct pipe_array *to_pipes = pipe_array_new();
-        if (to_pipes == NULL) {
+        rea->to_pipes = pipe_array_new();
+        if (rea->to_pipes == NULL) {
+            free(rea);
             return -1;
         }
-        rea->to_pipes = to_pipes;
-        ssize_t **bytes_spliced = calloc(pn->listening_edges->length,
-                sizeof(&pn->listening_edges->edges[0]->bytes_spliced));
-        if (bytes_spliced == NULL) {
+        rea->branches = calloc(from_pipe->n_edge_ids, sizeof(*rea->branches));
+        rea->ready = calloc(from_pipe->n_edge_ids, sizeof(*rea->ready));
+        rea->held = calloc(from_pipe->n_edge_ids, sizeof(*rea->held));
+        if (rea->branches == NULL || rea->ready == NULL || rea->held == NULL) {
             REPORT_ERRORF("%s", strerror(errno));
+            free(rea->branches);
+            free(rea->ready);
+            free(rea->held);
+            free(rea->to_pipes);
+            free(rea);
             return -1;
         }
 
-        struct event *readable = event_new(eb, from_pipe->read_fd,
-                                           EV_READ, readable_handler,
-                                           rea);
+        /* Events stay registered until their pipe is closed; handlers
+         * track readiness themselves, so the kernel need only report
+         * changes to it */
+        struct event *readable = event_new(relay_eb, from_pipe->read_fd,
+                                           EV_READ|EV_PERSIST|EV_ET,
+                                           readable_handler, rea);
         if (readable == NULL) {
             REPORT_ERROR("Failed to create new readable event");
             return -1;
         }
+        rea->readable_event = readable;
 
         rea->writable_events = event_array_new();
         if (rea->writable_events == NULL) {
             return -1;
         }
 
-        size_t *bytes_safely_written = malloc(sizeof(*bytes_safely_written));
-        if (bytes_safely_written == NULL) {
-            REPORT_ERRORF("%s", strerror(errno));
-            return -1;
-        }
-
-        *bytes_safely_written = SIZE_MAX;
-        rea->bytes_safely_written = bytes_safely_written;
+        bool needs_staging = false;
 
         for (int k = 0; k < (int)pn->listening_edges->length; k++) {
             struct p4_edge *edge = get_edge(pn->listening_edges, k);
@@ -349,31 +385,48 @@ int setup_events(struct p4_file *pf, struct p4_node *pn, struct event_base *eb)
                 return -1;
             }
             wea->from_pipe = from_pipe;
-            wea->to_pipes = to_pipes;
-            wea->bytes_spliced = bytes_spliced;
-            wea->to_pipe_idx = k;
+            wea->bytes_spliced = &edge->bytes_spliced;
+            wea->rea = rea;
             wea->readable_event = readable;
-            wea->bytes_safely_written = bytes_safely_written;
-            bytes_spliced[k] = &edge->bytes_spliced;
-
-            if (setup_writable_event(pf, edge, eb, rea, wea) < 0) {
-                event_array_free(rea->writable_events);
-                free(rea);
-                pipe_array_free(to_pipes);
-                event_free(readable);
-                free(bytes_spliced);
+            wea->edge = edge;
+            wea->buffer = NULL;
+            wea->spill = NULL;
+            wea->spill_high_water = 0u;
+            wea->sent = 0u;
+            wea->chunk_size = wea->batch_size = wea->batch_time = 0u;
+            raise_edge_limits(edge, &wea->chunk_size, &wea->batch_size,
+                              &wea->batch_time);
+            raise_edge_limits(edge, &rea->chunk_size, &rea->batch_size,
+                              &rea->batch_time);
+
+            /* Buffering only decouples an edge from others tee'd from
+             * the same pipe */
+            if (from_pipe->n_edge_ids > 1 && setup_branch_buffer(edge, rea, wea) < 0) {
                 free(wea);
                 return -1;
             }
+
+            if (setup_writable_event(pf, edge, relay_eb, rea, wea) < 0) {
+                ring_buffer_free(wea->buffer);
+                spill_file_free(wea->spill);
+                free(wea);
+                return -1;
+            }
+            if (wea->buffer)
+                needs_staging = true;
+        }
+
+        /* buffered branches are sent data by way of staging */
+        if (needs_staging) {
+            rea->staging = malloc(rea->chunk_size);
+            if (rea->staging == NULL) {
+                REPORT_ERRORF("%s", strerror(errno));
+                return -1;
+            }
         }
 
         if (event_add(readable, NULL) < 0) {
             REPORT_ERROR("Failed to add readable event");
-            event_array_free(rea->writable_events);
-            free(rea);
-            pipe_array_free(to_pipes);
-            free(bytes_spliced);
-            event_free(readable);
             return -1;
         }
     }
@@ -381,11 +434,133 @@ int setup_events(struct p4_file *pf, struct p4_node *pn, struct event_base *eb)
 }
 
 /**
- * Calls event creation functions for each node, then forks and runs the node's cmd.
+ * Closes hp4's copies of the pipe ends which belong to its processes: a
+ * producer's write end and a consumer's read end. hp4 keeps only the ends
+ * it relays, and readers see EOF and writers EPIPE as soon as the process
+ * at the other end is gone. The ends of file and record nodes are hp4's
+ * own, and are kept; a direct pipe shared by two processes is closed entirely.
+ */
+int close_node_ends(struct p4_file *pf) {
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        if (pn->file != NULL || pn->record != NULL)
+            continue;
+        for (int j = 0; j < (int)pn->out_pipes->length; j++) {
+            struct pipe *p = get_pipe(pn->out_pipes, j);
+            if (!p->write_fd_is_open)
+                continue;
+            if (close(p->write_fd) < 0) {
+                REPORT_ERRORF("%s", strerror(errno));
+                return -1;
+            }
+            p->write_fd_is_open = false;
+        }
+        for (int j = 0; j < (int)pn->in_pipes->length; j++) {
+            struct pipe *p = get_pipe(pn->in_pipes, j);
+            if (!p->read_fd_is_open)
+                continue;
+            if (close(p->read_fd) < 0) {
+                REPORT_ERRORF("%s", strerror(errno));
+                return -1;
+            }
+            p->read_fd_is_open = false;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Starts a node's process, and records how long it took to exec.
+ */
+int launch_node(struct p4_file *pf, struct p4_node *pn, struct event_base *eb,
+                struct relay_pool *rp) {
+    if (setup_events(pf, pn, eb, rp) < 0)
+        return -1;
+    if (node_argv_compile(pn) < 0)
+        return -1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pn->pid = spawn_node(pn);
+    if (pn->pid < 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pn->exec_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                  (end.tv_nsec - start.tv_nsec) / 1000;
+    PRINT_DEBUG("Node %s exec'd in %lldus\n", pn->id, (long long)pn->exec_us);
+    pn->ended = false;
+    return 0;
+}
+
+/**
+ * Waits until the given launch is due, so that no more than launch_rate
+ * nodes are started a second; 0 for no limit.
  */
-int build_nodes(struct p4_file *pf, struct event_base *eb) {
-    for (int i=0; i < (int)pf->nodes->length; i++) {
+void pace_launch(struct timespec *start, unsigned long launch_rate, int n_launched) {
+    if (launch_rate == 0u || n_launched == 0)
+        return;
+    uint64_t due_ns = (uint64_t)n_launched * 1000000000u / launch_rate;
+    struct timespec due = *start;
+    due.tv_sec += (time_t)(due_ns / 1000000000u);
+    due.tv_nsec += (long)(due_ns % 1000000000u);
+    if (due.tv_nsec >= 1000000000) {
+        ++due.tv_sec;
+        due.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+        ;
+}
+
+/**
+ * Calls event creation functions for each node, then spawns the node's cmd.
+ * Nodes which hp4 runs itself are set up first, so that a file which cannot
+ * be opened stops hp4 before any process is started. Processes are started
+ * sinks first, no more than launch_rate a second if it is not 0. The time
+ * taken is reported in detailed stats as startup_us.
+ */
+int build_nodes(struct p4_file *pf, struct event_base *eb, struct relay_pool *rp,
+                struct sigchld_args *sa, unsigned long launch_rate) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
         struct p4_node *pn = p4_file_get_node(pf, i);
+        if (node_is_file(pn)) {
+            if (setup_events(pf, pn, eb, rp) < 0)
+                return -1;
+            pn->file = file_node_new(pf, pn, eb, sa);
+            if (pn->file == NULL)
+                return -1;
+        }
+        else if (node_is_record(pn)) {
+            if (setup_events(pf, pn, eb, rp) < 0)
+                return -1;
+            pn->record = record_node_new(pf, pn, eb, sa);
+            if (pn->record == NULL)
+                return -1;
+        }
+        else {
+            continue;
+        }
+        pn->ended = false;
+    }
+
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (pe->copy && file_node_add_copy(find_node_by_id(pf, pe->from)->file,
+                                           find_node_by_id(pf, pe->to)->file, pe) < 0)
+            return -1;
+    }
+
+    /* sinks first, so that every node's consumers are running before it */
+    struct p4_node **order;
+    int n_order = plan_launch_order(pf, &order);
+    if (n_order < 0)
+        return -1;
+
+    int n_launched = 0;
+    for (int i = 0; i < n_order; i++) {
+        struct p4_node *pn = order[i];
         if (strncmp(pn->type, "EXEC\0", 5) == 0) {
             if (pn->in_pipes->length == 0u && pn->out_pipes->length == 0u) {
                 // node is not joined to the graph, skip
@@ -393,26 +568,27 @@ int build_nodes(struct p4_file *pf, struct event_base *eb) {
                 PRINT_DEBUG("EXEC node %s is not connected to graph\n", pn->id);
                 continue;
             }
-            if (setup_events(pf, pn, eb) < 0)
+            pace_launch(&start, launch_rate, n_launched);
+            if (launch_node(pf, pn, eb, rp) < 0) {
+                free(order);
                 return -1;
-            pid_t pid = fork();
-            if (pid < 0) {
-                REPORT_ERRORF("%s", strerror(errno));
-            }
-            else if (pid == 0) { // child
-                return run_node(pf, pn);
-            } // end child
-            else {
-                pn->pid = pid;
-                pn->ended = false;
             }
+            ++n_launched;
         }
         else {
-            free_p4_file(pf);
-            fprintf(stderr, "Non-EXEC nodes not yet supported\n");
+            fprintf(stderr, "Node %s: %s nodes are not supported\n", pn->id, pn->type);
+            free(order);
             return -1;
         }
     }
+    free(order);
+
+    if (close_node_ends(pf) < 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pf->startup_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                     (end.tv_nsec - start.tv_nsec) / 1000;
     return 0;
 }
 
@@ -424,6 +600,22 @@ void usage(char **argv) {
     printf("  -i, --interval  set time in milliseconds between dumping stats\n");
     printf("                    to stdout; defaults to %d\n", DEFAULT_INTERVAL);
     printf("  -f, --file      file containing json definition of process graph\n");
+    printf("  -m, --pipe-memory\n");
+    printf("                  limit in bytes on kernel memory for pipe buffers;\n");
+    printf("                    pipes which keep filling up are grown within it\n");
+    printf("  -u, --io-uring  relay data through io_uring where the kernel allows,\n");
+    printf("                    batching the system calls for many edges\n");
+    printf("  -t, --relay-threads\n");
+    printf("                  number of threads relaying data, each with its own\n");
+    printf("                    share of the edges; defaults to relaying on the\n");
+    printf("                    main thread\n");
+    printf("  -r, --launch-rate\n");
+    printf("                  most nodes to start a second; defaults to starting\n");
+    printf("                    them all at once\n");
+    printf("  -s, --detailed-stats\n");
+    printf("                  nest edge counts under \"edges\" in the stats,\n");
+    printf("                    beside spills, file and record nodes, and start\n");
+    printf("                    times\n");
     return;
 }
 
@@ -432,13 +624,18 @@ int get_args(int argc, char **argv, struct hp4_args *args) {
     {
         {"interval", required_argument, 0, 'i'},
         {"file",     required_argument, 0, 'f'},
+        {"pipe-memory", required_argument, 0, 'm'},
+        {"io-uring", no_argument,       0, 'u'},
+        {"relay-threads", required_argument, 0, 't'},
+        {"launch-rate", required_argument, 0, 'r'},
+        {"detailed-stats", no_argument, 0, 's'},
         {"version",  no_argument,       0, 'V'},
         {"help",     no_argument,       0, 'h'},
         {0,          0,                 0,  0 }
     };
     char c;
     int option_index = 0;
-    while ((c = getopt_long(argc, argv, "i:f:Vh", long_options, &option_index)) >= 0) {
+    while ((c = getopt_long(argc, argv, "i:f:m:ut:r:sVh", long_options, &option_index)) >= 0) {
         switch (c) {
             case 'h':
                 args->help = 1;
@@ -452,6 +649,21 @@ int get_args(int argc, char **argv, struct hp4_args *args) {
             case 'f':
                 args->graph_file = optarg;
                 break;
+            case 'm':
+                args->pipe_memory = optarg;
+                break;
+            case 'u':
+                args->io_uring = 1;
+                break;
+            case 't':
+                args->relay_threads = optarg;
+                break;
+            case 'r':
+                args->launch_rate = optarg;
+                break;
+            case 's':
+                args->detailed_stats = 1;
+                break;
             default:
                 break;
         }
@@ -463,6 +675,11 @@ int main(int argc, char **argv) {
     struct hp4_args args;
     args.stats_interval = NULL;
     args.graph_file = NULL;
+    args.pipe_memory = NULL;
+    args.io_uring = 0;
+    args.relay_threads = NULL;
+    args.launch_rate = NULL;
+    args.detailed_stats = 0;
     args.help = 0;
     args.version = 0;
 
@@ -487,6 +704,46 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    size_t pipe_memory = SIZE_MAX;
+    if (args.pipe_memory) {
+        char *end;
+        errno = 0;
+        unsigned long long v = strtoull(args.pipe_memory, &end, 10);
+        if (errno != 0 || end == args.pipe_memory || *end != '\0' || v == 0u) {
+            printf("Invalid pipe memory limit: %s\n", args.pipe_memory);
+            usage(argv);
+            return 1;
+        }
+        pipe_memory = (size_t)v;
+    }
+    pipe_budget_init(pipe_memory, args.pipe_memory != NULL);
+
+    size_t n_relay_threads = 0u;
+    if (args.relay_threads) {
+        char *end;
+        errno = 0;
+        unsigned long v = strtoul(args.relay_threads, &end, 10);
+        if (errno != 0 || end == args.relay_threads || *end != '\0' ||
+                v == 0u || v > MAX_RELAY_THREADS) {
+            printf("Invalid number of relay threads: %s\n", args.relay_threads);
+            usage(argv);
+            return 1;
+        }
+        n_relay_threads = (size_t)v;
+    }
+
+    unsigned long launch_rate = 0u;
+    if (args.launch_rate) {
+        char *end;
+        errno = 0;
+        launch_rate = strtoul(args.launch_rate, &end, 10);
+        if (errno != 0 || end == args.launch_rate || *end != '\0' || launch_rate == 0u) {
+            printf("Invalid launch rate: %s\n", args.launch_rate);
+            usage(argv);
+            return 1;
+        }
+    }
+
     struct p4_file *pf = p4_file_new(args.graph_file);
     if (pf == NULL) {
         REPORT_ERROR("Failed to create new p4_file");
@@ -497,6 +754,7 @@ int main(int argc, char **argv) {
         REPORT_ERROR("Graph failed validation!");
         return 1;
     }
+    pf->detailed_stats = args.detailed_stats == 1;
 
     if (open_dev_null() < 0) {
         REPORT_ERROR("Failed to open /dev/null for writing");
@@ -504,17 +762,43 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    struct event_base *eb = event_base_new();
+    /* the pool must be created first, as it switches on libevent's
+     * locking for every event_base */
+    struct relay_pool *rp = NULL;
+    if (n_relay_threads > 0u) {
+        rp = relay_pool_new(n_relay_threads, args.io_uring && uring_supported());
+        if (rp == NULL) {
+            free_p4_file(pf);
+            return 1;
+        }
+    }
+
+    struct event_base *eb = relay_base_new();
     if (eb == NULL) {
-        REPORT_ERROR("Failed to create a new event_base");
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
 
+    /* a node which exits early must not take hp4 with it; writing to its
+     * pipe fails with EPIPE instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* relay threads each set up their own io_uring */
+    if (args.io_uring) {
+        if (!uring_supported())
+            fprintf(stderr, "hp4 was built without io_uring support; "
+                            "using splice(2) and tee(2)\n");
+        else if (rp == NULL && use_io_uring(eb) < 0)
+            fprintf(stderr, "io_uring is unavailable (%s); "
+                            "using splice(2) and tee(2)\n", strerror(errno));
+    }
+
     struct event *sigintev = evsignal_new(eb, SIGINT, sigint_handler, eb);
     if (sigintev == NULL) {
         REPORT_ERROR("Failed to create sigint event");
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -522,6 +806,7 @@ int main(int argc, char **argv) {
         REPORT_ERROR("Failed to add sigint event");
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -536,6 +821,7 @@ int main(int argc, char **argv) {
         REPORT_ERROR("Failed to create sigchld event");
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -544,6 +830,27 @@ int main(int argc, char **argv) {
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
+        free_p4_file(pf);
+        return 1;
+    }
+
+    if (expand_fan_in(pf) < 0 || expand_replicas(pf) < 0) {
+        REPORT_ERROR("Failed to expand the graph's fan-in and replicated nodes");
+        event_free(sigchldev);
+        event_free(sigintev);
+        event_base_free(eb);
+        relay_pool_free(rp);
+        free_p4_file(pf);
+        return 1;
+    }
+
+    if (plan_fd_limit(pf, n_relay_threads) < 0) {
+        REPORT_ERROR("Failed to plan file descriptors");
+        event_free(sigchldev);
+        event_free(sigintev);
+        event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -553,15 +860,48 @@ int main(int argc, char **argv) {
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
 
-    if (build_nodes(pf, eb) == -1) {
+    if (plan_pipe_capacities(pf) < 0) {
+        REPORT_ERROR("Failed to plan pipe capacities");
+        event_free(sigchldev);
+        event_free(sigintev);
+        event_base_free(eb);
+        relay_pool_free(rp);
+        free_p4_file(pf);
+        return 1;
+    }
+
+    if (rp && plan_relay_threads(pf, rp) < 0) {
+        REPORT_ERROR("Failed to plan relay threads");
+        event_free(sigchldev);
+        event_free(sigintev);
+        event_base_free(eb);
+        relay_pool_free(rp);
+        free_p4_file(pf);
+        return 1;
+    }
+
+    if (build_nodes(pf, eb, rp, &sa, launch_rate) == -1) {
         REPORT_ERROR("Failed to build nodes");
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
+        free_p4_file(pf);
+        return 1;
+    }
+
+    /* threads are only started once every node has been forked */
+    if (rp && relay_pool_start(rp) < 0) {
+        REPORT_ERROR("Failed to start relay threads");
+        event_free(sigchldev);
+        event_free(sigintev);
+        event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -589,6 +929,7 @@ int main(int argc, char **argv) {
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -598,6 +939,7 @@ int main(int argc, char **argv) {
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
@@ -607,16 +949,23 @@ int main(int argc, char **argv) {
         event_free(sigchldev);
         event_free(sigintev);
         event_base_free(eb);
+        relay_pool_free(rp);
         free_p4_file(pf);
         return 1;
     }
 
+    /* every node has exited, so the relay threads have nothing left to do */
+    if (rp)
+        relay_pool_stop(rp);
+
     stats_handler(0, 0, &sea);
 
     event_free(dump_stats);
     event_free(sigintev);
     event_free(sigchldev);
+    stop_io_uring();
     event_base_free(eb);
+    relay_pool_free(rp);
     free_p4_file(pf);
 
     close_dev_null();
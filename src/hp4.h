@@ -6,6 +6,16 @@ struct hp4_args {
 
     char *graph_file;
 
+    char *pipe_memory;
+
+    char io_uring;
+
+    char *relay_threads;
+
+    char *launch_rate;
+
+    char detailed_stats;
+
     char version;
 
     char help;
@@ -0,0 +1,338 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "file_node.h"
+#include "launch.h"
+#include "parser.h"
+#include "pipe.h"
+#include "record_node.h"
+#include "strutil.h"
+
+/**
+ * Returns the fd at which a node finds its end of a pipe: 0 or 1 for its
+ * stdio port, and from FIRST_PORT_FD up for its other ports, outputs first,
+ * so that they fill a compact range of its fd table.
+ */
+int node_pipe_fd(struct p4_node *pn, struct pipe *p) {
+    if (strcmp(p->port, STDIO_PORT) == 0)
+        return pipe_array_find_pipe_with_port(pn->out_pipes, p->port) == p ?
+               STDOUT_FILENO : STDIN_FILENO;
+    int fd = FIRST_PORT_FD;
+    for (size_t i = 0u; i < pn->out_pipes->length; i++) {
+        struct pipe *other = pn->out_pipes->pipes[i];
+        if (other == p)
+            return fd;
+        fd += strcmp(other->port, STDIO_PORT) != 0;
+    }
+    for (size_t i = 0u; i < pn->in_pipes->length; i++) {
+        struct pipe *other = pn->in_pipes->pipes[i];
+        if (other == p)
+            return fd;
+        fd += strcmp(other->port, STDIO_PORT) != 0;
+    }
+    return -1;
+}
+
+/**
+ * Returns the number of fds a node is started with: stdin, stdout, stderr
+ * and one for each of its other ports.
+ */
+int node_fd_count(struct p4_node *pn) {
+    int n_fds = FIRST_PORT_FD;
+    for (size_t i = 0u; i < pn->out_pipes->length; i++)
+        n_fds += strcmp(pn->out_pipes->pipes[i]->port, STDIO_PORT) != 0;
+    for (size_t i = 0u; i < pn->in_pipes->length; i++)
+        n_fds += strcmp(pn->in_pipes->pipes[i]->port, STDIO_PORT) != 0;
+    return n_fds;
+}
+
+/**
+ * Replaces each occurrence of a port in *arg with the path through which
+ * the node opens its own fd for it.
+ */
+int fill_port(char **arg, const char *port, int fd) {
+    if (**arg == '\0' || strstr(*arg, port) == NULL)
+        return 0;
+    char path[PORT_PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+    char *replaced = strrep(*arg, port, path);
+    if (replaced == NULL)
+        return -1;
+    free(*arg);
+    *arg = replaced;
+    return 0;
+}
+
+/**
+ * Builds pn->exec_argv, the argv a node is exec'd with: its cmd array, or
+ * its cmd string split into words and unwrapped from `bash -c` where no
+ * shell is needed, with each port replaced by /dev/fd/N for the fd at which
+ * the node is given its pipe. This runs in hp4 before spawning, so that the
+ * node need do no parsing or allocation before it execs.
+ */
+int node_argv_compile(struct p4_node *pn) {
+    struct argstruct pa = {0, NULL, NULL};
+    if (pn->argv != NULL) {
+        pa.argv = pn->argv;
+        while (pa.argv[pa.argc] != NULL)
+            ++pa.argc;
+    }
+    else {
+        if (parse_argstring(&pa, pn->cmd) < 0)
+            return -1;
+        struct argstruct direct;
+        int unwrapped = unwrap_shell(&pa, &direct);
+        if (unwrapped < 0) {
+            free_argstring(&pa);
+            return -1;
+        }
+        if (unwrapped) {
+            free_argstring(&pa);
+            pa = direct;
+        }
+    }
+    if (pa.argc == 0) {
+        REPORT_ERRORF("Node %s has an empty cmd", pn->id);
+        free_argstring(&pa);
+        return -1;
+    }
+
+    char **argv = calloc((size_t)pa.argc + 1u, sizeof(*argv));
+    int res = argv == NULL ? -1 : 0;
+    if (res < 0)
+        REPORT_ERRORF("%s", strerror(errno));
+    for (int i = 0; i < pa.argc && res == 0; i++) {
+        argv[i] = strdup(pa.argv[i]);
+        if (argv[i] == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            res = -1;
+        }
+        for (size_t j = 0u; j < pn->out_pipes->length && res == 0; j++) {
+            struct pipe *p = pn->out_pipes->pipes[j];
+            if (strcmp(p->port, STDIO_PORT) != 0)
+                res = fill_port(&argv[i], p->port, node_pipe_fd(pn, p));
+        }
+        for (size_t j = 0u; j < pn->in_pipes->length && res == 0; j++) {
+            struct pipe *p = pn->in_pipes->pipes[j];
+            if (strcmp(p->port, STDIO_PORT) != 0)
+                res = fill_port(&argv[i], p->port, node_pipe_fd(pn, p));
+        }
+    }
+    if (pn->argv == NULL)
+        free_argstring(&pa);
+    if (res < 0) {
+        free_argv(argv);
+        return -1;
+    }
+
+    free_argv(pn->exec_argv);
+    pn->exec_argv = argv;
+    return 0;
+}
+
+/**
+ * Adds to fa the actions which give a node its pipes at the fds chosen by
+ * node_pipe_fd(), closing stdin or stdout if it has no pipe for them.
+ *
+ * hp4's fds may themselves lie among the targets, so each is first dup'd
+ * above all of them, then into place, so that none is overwritten before
+ * it has been moved.
+ */
+int add_pipe_actions(posix_spawn_file_actions_t *fa, struct p4_node *pn) {
+    size_t n_pipes = pn->out_pipes->length + pn->in_pipes->length;
+    int *from = malloc((n_pipes + 1u) * sizeof(*from));
+    int *to = malloc((n_pipes + 1u) * sizeof(*to));
+    if (from == NULL || to == NULL) {
+        free(from);
+        free(to);
+        return errno;
+    }
+
+    bool has_stdin = false;
+    bool has_stdout = false;
+    int spare = FIRST_PORT_FD;
+    for (size_t i = 0u; i < n_pipes; i++) {
+        bool output = i < pn->out_pipes->length;
+        struct pipe *p = output ? pn->out_pipes->pipes[i] :
+                         pn->in_pipes->pipes[i - pn->out_pipes->length];
+        from[i] = output ? p->write_fd : p->read_fd;
+        to[i] = node_pipe_fd(pn, p);
+        has_stdout |= to[i] == STDOUT_FILENO;
+        has_stdin |= to[i] == STDIN_FILENO;
+        if (from[i] >= spare)
+            spare = from[i] + 1;
+        if (to[i] >= spare)
+            spare = to[i] + 1;
+    }
+
+    int err = 0;
+    for (size_t i = 0u; i < n_pipes && err == 0; i++)
+        err = posix_spawn_file_actions_adddup2(fa, from[i], spare + (int)i);
+    for (size_t i = 0u; i < n_pipes && err == 0; i++)
+        err = posix_spawn_file_actions_adddup2(fa, spare + (int)i, to[i]);
+    for (size_t i = 0u; i < n_pipes && err == 0; i++)
+        err = posix_spawn_file_actions_addclose(fa, spare + (int)i);
+    if (err == 0 && !has_stdout)
+        err = posix_spawn_file_actions_addclose(fa, STDOUT_FILENO);
+    if (err == 0 && !has_stdin)
+        err = posix_spawn_file_actions_addclose(fa, STDIN_FILENO);
+
+    free(from);
+    free(to);
+    return err;
+}
+
+/**
+ * Starts a node's process with its compiled argv, returning its pid, or -1
+ * if it could not be started.
+ *
+ * posix_spawnp(3) shares hp4's memory until the node execs, rather than
+ * copying its page tables as fork(2) would. The node's fd table is built
+ * in one pass: its pipes are dup'd into place, and everything above them is
+ * closed, as pipes are created close-on-exec anyway.
+ */
+pid_t spawn_node(struct p4_node *pn) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    int err = posix_spawn_file_actions_init(&fa);
+    if (err != 0) {
+        REPORT_ERRORF("%s", strerror(err));
+        return -1;
+    }
+    err = posix_spawnattr_init(&attr);
+    if (err != 0) {
+        REPORT_ERRORF("%s", strerror(err));
+        posix_spawn_file_actions_destroy(&fa);
+        return -1;
+    }
+
+    /* hp4 ignores SIGPIPE, but nodes should not */
+    sigset_t sigdefault;
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+
+    err = add_pipe_actions(&fa, pn);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    if (err == 0)
+        err = posix_spawn_file_actions_addclosefrom_np(&fa, node_fd_count(pn));
+#endif /* HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP */
+    if (err == 0)
+        err = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    if (err == 0)
+        err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid = -1;
+    if (err != 0) {
+        REPORT_ERRORF("%s", strerror(err));
+    }
+    else {
+        PRINT_DEBUG("Node %s about to exec\n", pn->id);
+        err = posix_spawnp(&pid, pn->exec_argv[0], &fa, &attr, pn->exec_argv, environ);
+        if (err != 0) {
+            REPORT_ERRORF("Node %s failed to exec %s: %s", pn->id, pn->exec_argv[0],
+                          strerror(err));
+            pid = -1;
+        }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return pid;
+}
+
+/**
+ * Returns the index in pf->nodes of the node with the given id, or -1.
+ */
+int node_index(struct p4_file *pf, const char *id) {
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        if (strcmp(p4_file_get_node(pf, i)->id, id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Returns true for a node which hp4 runs itself, with no process.
+ */
+bool node_is_own(struct p4_node *pn) {
+    return node_is_file(pn) || node_is_record(pn);
+}
+
+/**
+ * Sets *order to a _new_ array of the nodes whose processes hp4 starts, in
+ * the order to start them, and returns its length.
+ *
+ * Nodes are started in reverse topological order, each after every node it
+ * writes to, so that consumers are ready before data reaches them. Nodes
+ * left over by a cycle follow in the order of the graph file.
+ *
+ * On error: returns -1
+ */
+int plan_launch_order(struct p4_file *pf, struct p4_node ***order) {
+    size_t n_nodes = pf->nodes->length;
+    size_t n_edges = pf->edges->length;
+    /* for each node, the edges to processes yet to be started */
+    size_t *waiting = calloc(n_nodes + 1u, sizeof(*waiting));
+    int *from = malloc((n_edges + 1u) * sizeof(*from));
+    int *to = malloc((n_edges + 1u) * sizeof(*to));
+    bool *planned = calloc(n_nodes + 1u, sizeof(*planned));
+    *order = malloc((n_nodes + 1u) * sizeof(**order));
+    if (waiting == NULL || from == NULL || to == NULL || planned == NULL || *order == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        free(waiting);
+        free(from);
+        free(to);
+        free(planned);
+        free(*order);
+        *order = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0u; i < n_edges; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, (int)i);
+        from[i] = node_index(pf, pe->from);
+        to[i] = node_index(pf, pe->to);
+        if (from[i] >= 0 && to[i] >= 0 && from[i] != to[i] &&
+                !node_is_own(p4_file_get_node(pf, to[i])))
+            ++waiting[from[i]];
+    }
+
+    /* file and record nodes are hp4's own, and are not started */
+    int n_order = 0;
+    for (size_t i = 0u; i < n_nodes; i++)
+        planned[i] = node_is_own(p4_file_get_node(pf, (int)i));
+
+    for (bool progress = true; progress; ) {
+        progress = false;
+        for (size_t i = 0u; i < n_nodes; i++) {
+            if (planned[i] || waiting[i] > 0u)
+                continue;
+            planned[i] = true;
+            progress = true;
+            (*order)[n_order++] = p4_file_get_node(pf, (int)i);
+            for (size_t j = 0u; j < n_edges; j++) {
+                if (to[j] == (int)i && from[j] >= 0 && from[j] != (int)i)
+                    --waiting[from[j]];
+            }
+        }
+    }
+    for (size_t i = 0u; i < n_nodes; i++) {
+        if (!planned[i])
+            (*order)[n_order++] = p4_file_get_node(pf, (int)i);
+    }
+
+    free(waiting);
+    free(from);
+    free(to);
+    free(planned);
+    return n_order;
+}
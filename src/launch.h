@@ -0,0 +1,26 @@
+#ifndef HP4_LAUNCH_H
+#define HP4_LAUNCH_H
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "parser.h"
+#include "pipe.h"
+
+/* Longest path to a node's fd, as given to it for a port */
+#define PORT_PATH_MAX 32
+
+/* fd at which a node is given its first port other than stdio */
+#define FIRST_PORT_FD (STDERR_FILENO + 1)
+
+int node_pipe_fd(struct p4_node *pn, struct pipe *p);
+
+int node_fd_count(struct p4_node *pn);
+
+int node_argv_compile(struct p4_node *pn);
+
+int plan_launch_order(struct p4_file *pf, struct p4_node ***order);
+
+pid_t spawn_node(struct p4_node *pn);
+
+#endif /* HP4_LAUNCH_H */
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,8 +13,10 @@
 #include <jansson.h>
 
 #include "debug.h"
+#include "file_node.h"
 #include "parser.h"
 #include "pipe.h"
+#include "record_node.h"
 #include "strutil.h"
 
 int append_edge_to_array(struct p4_edge_array **pea, struct p4_edge *pe) {
@@ -49,6 +52,90 @@ int append_edge_to_array(struct p4_edge_array **pea, struct p4_edge *pe) {
     return 0;
 }
 
+/**
+ * Reads an optional non-negative integer property `key` from json object obj
+ * into *value. *value is left unchanged if the property is absent.
+ *
+ * On error (property is not a non-negative integer): returns -1
+ */
+int parse_size_property(json_t *obj, const char *key, size_t *value, const char *id) {
+    json_t *json_value = json_object_get(obj, key);
+    if (json_value == NULL) {
+        return 0;
+    }
+    if (!json_is_integer(json_value) || json_integer_value(json_value) < 0) {
+        REPORT_ERRORF("`%s` in %s must be a non-negative integer", key, id);
+        return -1;
+    }
+    *value = (size_t)json_integer_value(json_value);
+    return 0;
+}
+
+/**
+ * Reads an optional integer property `key` from json object obj into *value.
+ * *value is left unchanged if the property is absent.
+ *
+ * On error (property is not an integer that fits in an int): returns -1
+ */
+int parse_int_property(json_t *obj, const char *key, int *value, const char *id) {
+    json_t *json_value = json_object_get(obj, key);
+    if (json_value == NULL) {
+        return 0;
+    }
+    if (!json_is_integer(json_value) ||
+            json_integer_value(json_value) < INT_MIN ||
+            json_integer_value(json_value) > INT_MAX) {
+        REPORT_ERRORF("`%s` in %s must be an integer", key, id);
+        return -1;
+    }
+    *value = (int)json_integer_value(json_value);
+    return 0;
+}
+
+/**
+ * Reads an optional boolean property `key` from json object obj into *value.
+ * *value is left unchanged if the property is absent.
+ *
+ * On error (property is not true or false): returns -1
+ */
+int parse_bool_property(json_t *obj, const char *key, bool *value, const char *id) {
+    json_t *json_value = json_object_get(obj, key);
+    if (json_value == NULL) {
+        return 0;
+    }
+    if (!json_is_boolean(json_value)) {
+        REPORT_ERRORF("`%s` in %s must be true or false", key, id);
+        return -1;
+    }
+    *value = json_is_true(json_value);
+    return 0;
+}
+
+/**
+ * Reads an optional string property `key` from json object obj into a
+ * _new_ string *value. *value is set to NULL if the property is absent.
+ *
+ * On error (property is not a string): returns -1
+ */
+int parse_string_property(json_t *obj, const char *key, char **value, const char *id) {
+    *value = NULL;
+    json_t *json_value = json_object_get(obj, key);
+    if (json_value == NULL) {
+        return 0;
+    }
+    if (!json_is_string(json_value)) {
+        REPORT_ERRORF("`%s` in %s must be a string", key, id);
+        return -1;
+    }
+    *value = malloc((json_string_length(json_value) + 1) * sizeof(char));
+    if (*value == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    strcpy(*value, json_string_value(json_value));
+    return 0;
+}
+
 int parse_p4_edge(json_t *edge, struct p4_edge *parsed_edge) {
     json_incref(edge);
     if (!json_is_object(edge)) {
@@ -62,6 +149,20 @@ int parse_p4_edge(json_t *edge, struct p4_edge *parsed_edge) {
     json_t *json_to;
 
     parsed_edge->bytes_spliced = 0l;
+    parsed_edge->buffer_size = 0u;
+    parsed_edge->spill_high_water = 0u;
+    parsed_edge->spill_dir = NULL;
+    parsed_edge->bytes_spilled = 0l;
+    parsed_edge->bytes_spilled_reported = 0l;
+    parsed_edge->spill_peak = 0l;
+    parsed_edge->pipe_size = 0u;
+    parsed_edge->pipe_priority = 0;
+    parsed_edge->chunk_size = 0u;
+    parsed_edge->batch_size = 0u;
+    parsed_edge->batch_time = 0u;
+    parsed_edge->exact_bytes = false;
+    parsed_edge->direct = false;
+    parsed_edge->copy = false;
 
     if ((json_id = json_object_get(edge, "id"))) {
         parsed_edge->id = malloc((json_string_length(json_id) + 1) * sizeof(char));
@@ -120,6 +221,28 @@ int parse_p4_edge(json_t *edge, struct p4_edge *parsed_edge) {
         parsed_edge->to_port = NULL;
     }
 
+    if (parse_size_property(edge, "buffer_size", &parsed_edge->buffer_size,
+                            parsed_edge->id) < 0 ||
+            parse_size_property(edge, "spill_high_water",
+                                &parsed_edge->spill_high_water, parsed_edge->id) < 0 ||
+            parse_string_property(edge, "spill_dir", &parsed_edge->spill_dir,
+                                  parsed_edge->id) < 0 ||
+            parse_size_property(edge, "pipe_size", &parsed_edge->pipe_size,
+                                parsed_edge->id) < 0 ||
+            parse_int_property(edge, "pipe_priority", &parsed_edge->pipe_priority,
+                               parsed_edge->id) < 0 ||
+            parse_size_property(edge, "chunk_size", &parsed_edge->chunk_size,
+                                parsed_edge->id) < 0 ||
+            parse_size_property(edge, "batch_size", &parsed_edge->batch_size,
+                                parsed_edge->id) < 0 ||
+            parse_size_property(edge, "batch_time", &parsed_edge->batch_time,
+                                parsed_edge->id) < 0 ||
+            parse_bool_property(edge, "exact_bytes", &parsed_edge->exact_bytes,
+                                parsed_edge->id) < 0) {
+        json_decref(edge);
+        return -1;
+    }
+
     json_decref(edge);
     return 0;
 }
@@ -131,6 +254,7 @@ void free_p4_edge(struct p4_edge *pe) {
         free(pe->from_port);
         free(pe->to);
         free(pe->to_port);
+        free(pe->spill_dir);
         free(pe);
     }
 }
@@ -190,14 +314,82 @@ struct p4_edge_array *p4_edge_array_new(json_t *edges, size_t length) {
     return edge_arr;
 }
 
+void free_argv(char **argv) {
+    if (argv != NULL) {
+        for (char **arg = argv; *arg != NULL; arg++)
+            free(*arg);
+        free(argv);
+    }
+}
+
+/**
+ * Sets pn->argv to a _new_ copy of json_cmd, an array of strings, and
+ * pn->cmd to the strings joined by spaces.
+ *
+ * On error (json_cmd is empty or holds anything but strings): returns -1
+ */
+int parse_cmd_array(json_t *json_cmd, struct p4_node *pn) {
+    size_t argc = json_array_size(json_cmd);
+    size_t cmd_len = 1u;
+    for (size_t i = 0u; i < argc; i++) {
+        json_t *arg = json_array_get(json_cmd, i);
+        if (!json_is_string(arg)) {
+            REPORT_ERRORF("`cmd` in %s must be a string or an array of strings", pn->id);
+            return -1;
+        }
+        cmd_len += json_string_length(arg) + 1u;
+    }
+    if (argc == 0u) {
+        REPORT_ERRORF("`cmd` in %s is an empty array", pn->id);
+        return -1;
+    }
+
+    pn->argv = calloc(argc + 1u, sizeof(*pn->argv));
+    pn->cmd = malloc(cmd_len * sizeof(*pn->cmd));
+    if (pn->argv == NULL || pn->cmd == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        free(pn->argv);
+        free(pn->cmd);
+        pn->argv = NULL;
+        pn->cmd = NULL;
+        return -1;
+    }
+    *pn->cmd = '\0';
+    for (size_t i = 0u; i < argc; i++) {
+        const char *arg = json_string_value(json_array_get(json_cmd, i));
+        pn->argv[i] = strdup(arg);
+        if (pn->argv[i] == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            free_argv(pn->argv);
+            free(pn->cmd);
+            pn->argv = NULL;
+            pn->cmd = NULL;
+            return -1;
+        }
+        if (i > 0u)
+            strcat(pn->cmd, " ");
+        strcat(pn->cmd, arg);
+    }
+    return 0;
+}
+
 void free_p4_node(struct p4_node *pn) {
     if (pn != NULL) {
         free(pn->id);
         free(pn->type);
         free(pn->subtype);
         free(pn->cmd);
+        free_argv(pn->argv);
+        free_argv(pn->exec_argv);
         free(pn->name);
-
+        free(pn->records);
+        free(pn->policy);
+        free(pn->delimiter);
+        free(pn->compare);
+        free(pn->fan_in);
+
+        file_node_free(pn->file);
+        record_node_free(pn->record);
         pipe_array_free(pn->in_pipes);
         pipe_array_free(pn->out_pipes);
 
@@ -340,7 +532,28 @@ int parse_p4_node(json_t *node, struct p4_node *parsed_node) {
     else {
         parsed_node->subtype = NULL;
     }
-    if ((json_cmd = json_object_get(node, "cmd"))) {
+    parsed_node->argv = NULL;
+    parsed_node->exec_argv = NULL;
+    json_cmd = json_object_get(node, "cmd");
+    if (json_is_array(json_cmd)) {
+        if (parse_cmd_array(json_cmd, parsed_node) < 0) {
+            free(parsed_node->subtype);
+            free(parsed_node->type);
+            free(parsed_node->id);
+            json_decref(node);
+            return -1;
+        }
+    }
+    else if (json_cmd != NULL) {
+        if (!json_is_string(json_cmd)) {
+            REPORT_ERRORF("`cmd` in %s must be a string or an array of strings",
+                          parsed_node->id);
+            free(parsed_node->subtype);
+            free(parsed_node->type);
+            free(parsed_node->id);
+            json_decref(node);
+            return -1;
+        }
         parsed_node->cmd = malloc((json_string_length(json_cmd)+1) * sizeof(char));
         if (parsed_node->cmd == NULL) {
             REPORT_ERRORF("%s", strerror(errno));
@@ -360,6 +573,7 @@ int parse_p4_node(json_t *node, struct p4_node *parsed_node) {
         if (parsed_node->name == NULL) {
             REPORT_ERRORF("%s", strerror(errno));
             free(parsed_node->cmd);
+            free_argv(parsed_node->argv);
             free(parsed_node->subtype);
             free(parsed_node->type);
             free(parsed_node->id);
@@ -372,6 +586,47 @@ int parse_p4_node(json_t *node, struct p4_node *parsed_node) {
         parsed_node->name = NULL;
     }
 
+    parsed_node->offset = 0u;
+    parsed_node->length = 0u;
+    parsed_node->size = 0u;
+    parsed_node->write_behind = 0u;
+    parsed_node->fsync = false;
+    parsed_node->record_size = 0u;
+    parsed_node->max_record = 0u;
+    parsed_node->window = 0u;
+    parsed_node->key_field = 1u;
+    parsed_node->replicas = 0u;
+    parsed_node->ordered = true;
+    parsed_node->file = NULL;
+    parsed_node->record = NULL;
+    parsed_node->exec_us = -1;
+    if (parse_string_property(node, "records", &parsed_node->records, parsed_node->id) < 0 ||
+            parse_size_property(node, "record_size", &parsed_node->record_size,
+                                parsed_node->id) < 0 ||
+            parse_size_property(node, "max_record", &parsed_node->max_record,
+                                parsed_node->id) < 0 ||
+            parse_string_property(node, "policy", &parsed_node->policy, parsed_node->id) < 0 ||
+            parse_size_property(node, "window", &parsed_node->window, parsed_node->id) < 0 ||
+            parse_string_property(node, "delimiter", &parsed_node->delimiter,
+                                  parsed_node->id) < 0 ||
+            parse_size_property(node, "key_field", &parsed_node->key_field,
+                                parsed_node->id) < 0 ||
+            parse_string_property(node, "compare", &parsed_node->compare,
+                                  parsed_node->id) < 0 ||
+            parse_size_property(node, "replicas", &parsed_node->replicas,
+                                parsed_node->id) < 0 ||
+            parse_bool_property(node, "ordered", &parsed_node->ordered, parsed_node->id) < 0 ||
+            parse_string_property(node, "fan_in", &parsed_node->fan_in, parsed_node->id) < 0 ||
+            parse_size_property(node, "offset", &parsed_node->offset, parsed_node->id) < 0 ||
+            parse_size_property(node, "length", &parsed_node->length, parsed_node->id) < 0 ||
+            parse_size_property(node, "size", &parsed_node->size, parsed_node->id) < 0 ||
+            parse_size_property(node, "write_behind", &parsed_node->write_behind,
+                                parsed_node->id) < 0 ||
+            parse_bool_property(node, "fsync", &parsed_node->fsync, parsed_node->id) < 0) {
+        json_decref(node);
+        return -1;
+    }
+
     parsed_node->in_pipes = pipe_array_new();
     parsed_node->out_pipes = pipe_array_new();
     if (parsed_node->in_pipes == NULL || parsed_node->out_pipes == NULL) {
@@ -469,6 +724,9 @@ struct p4_file *p4_file_new(const char *filename) {
 
     pf->nodes = NULL;
     pf->edges = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &pf->stats_time);
+    pf->startup_us = 0;
+    pf->detailed_stats = false;
 
     pf->edges = p4_edge_array_new(edges, json_array_size(edges));
     if (pf->edges == NULL) {
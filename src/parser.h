@@ -3,15 +3,25 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <jansson.h>
 
 #include "event_handlers.h"
 #include "pipe.h"
 
+struct file_node;
+
 struct p4_node {
     char *id;
     char *cmd;
+    /* Set when `cmd` is given as an array: the NULL-terminated argv to exec
+     * as it is, with cmd then holding its arguments joined by spaces, for
+     * messages and port checks */
+    char **argv;
+    /* The argv the node is exec'd with, with its ports filled in; built by
+     * hp4 before forking */
+    char **exec_argv;
     char *type;
     char *subtype;
     char *name;
@@ -23,8 +33,60 @@ struct p4_node {
 
     struct p4_edge_array *listening_edges;
 
+    /* INFILE nodes: offset in the file named by `name` to start reading
+     * from, and how many bytes to read (0 for the rest of the file) */
+    size_t offset;
+    size_t length;
+
+    /* OUTFILE nodes: expected size of the file, which is allocated up front
+     * (0 if unknown); bytes written between each start of writeback, so
+     * that dirty pages do not pile up (0 to leave it to the kernel); and
+     * whether the file is fsync'd once written */
+    size_t size;
+    size_t write_behind;
+    bool fsync;
+
+    /* Record nodes (SCATTER, GATHER, PARTITION and MERGE): how streams are
+     * cut into records (lines, fixed or length_prefixed; lines if NULL),
+     * the size of fixed records, the most bytes a record may hold (0 for
+     * the default), and how records are dealt out
+     * (round_robin or least_full) or gathered in (round_robin, sequence,
+     * unordered, first_come or concatenate), round_robin if NULL; GATHER
+     * and MERGE nodes: the most bytes read ahead from each input, 0 for
+     * the default; PARTITION and MERGE nodes: the character between fields
+     * (a tab if NULL) and the field, counting from 1, which is the key;
+     * MERGE nodes: how keys compare (lexical or numeric; lexical if NULL) */
+    char *records;
+    size_t record_size;
+    size_t max_record;
+    char *policy;
+    size_t window;
+    char *delimiter;
+    size_t key_field;
+    char *compare;
+
+    /* EXEC nodes: how many copies of the command share the records of its
+     * stdin (0 or 1 for just the one), and whether their stdout keeps the
+     * order of those records; records are cut as for record nodes */
+    size_t replicas;
+    bool ordered;
+
+    /* Nodes which read: the `policy` of the GATHER node put in front of
+     * each port which more than one edge goes into, so that their data is
+     * joined in a known way; NULL to leave their chunks to come as they
+     * are relayed */
+    char *fan_in;
+
+    /* Set for nodes which hp4 runs itself rather than as a process */
+    struct file_node *file;
+    struct record_node *record;
+
     pid_t pid;
     bool ended;
+
+    /* Microseconds from asking for the node's process to its exec'ing the
+     * command, or -1 if it was not started */
+    int64_t exec_us;
 };
 
 struct p4_node_array {
@@ -39,8 +101,48 @@ struct p4_edge {
     char *to;
     char *to_port;
 
+    /* Bytes which may be held in memory for this edge when it is one of
+     * several tee'd from the same pipe; 0 means unbuffered */
+    size_t buffer_size;
+
+    /* Once this many bytes are held in memory for a tee'd edge, further data
+     * is spilled to a temporary file in spill_dir (or a memory-backed file if
+     * spill_dir is NULL); 0 means never spill */
+    size_t spill_high_water;
+    char *spill_dir;
+
+    /* Requested size of the kernel buffers of this edge's pipes, 0 for the
+     * default; edges with higher pipe_priority are given memory first */
+    size_t pipe_size;
+    int pipe_priority;
+
+    /* Most bytes moved by one splice(2) or tee(2) on this edge, and most
+     * bytes and microseconds spent relaying it per event loop wakeup;
+     * 0 for the defaults */
+    size_t chunk_size;
+    size_t batch_size;
+    size_t batch_time;
+
+    /* An edge which is the only one out of its node's stdout and into its
+     * node's stdin is wired directly, with no relay by hp4, unless exact byte
+     * counts are wanted. Its count is then sampled from the wchar of
+     * /proc/<pid>/io, which also counts what the node writes to stderr,
+     * files and other ports, so is only an upper bound on the edge's */
+    bool exact_bytes;
+    bool direct;
+
+    /* An edge from an INFILE node whose edges all go to OUTFILE nodes is
+     * copied within the kernel, with no pipe at all */
+    bool copy;
+
     // Potentially splicing multiple GBs; ensure 64-bit counter
     int64_t bytes_spliced;
+
+    int64_t bytes_spilled;
+    /* bytes_spilled when stats were last reported */
+    int64_t bytes_spilled_reported;
+    /* most bytes held in the spill file at once */
+    int64_t spill_peak;
 };
 
 struct p4_edge_array {
@@ -51,10 +153,26 @@ struct p4_edge_array {
 struct p4_file {
     struct p4_edge_array *edges;
     struct p4_node_array *nodes;
+
+    /* when stats were last reported, for calculating rates */
+    struct timespec stats_time;
+
+    /* microseconds taken to start every node */
+    int64_t startup_us;
+
+    /* whether stats nest the edge counts under "edges", beside hp4's own
+     * stats, rather than giving only the edge counts */
+    bool detailed_stats;
 };
 
 int append_edge_to_array(struct p4_edge_array **pea, struct p4_edge *pe);
 
+int parse_p4_edge(json_t *edge, struct p4_edge *parsed_edge);
+
+int parse_p4_node(json_t *node, struct p4_node *parsed_node);
+
+void free_p4_node(struct p4_node *pn);
+
 struct p4_node *find_node_by_id(struct p4_file *pf, const char *id);
 
 struct p4_node *find_node_by_pid(struct p4_file *pf, pid_t pid);
@@ -75,6 +193,8 @@ struct p4_edge *p4_file_get_edge(struct p4_file *pf, int idx);
 
 struct p4_file *p4_file_new(const char *filename);
 
+void free_argv(char **argv);
+
 void free_p4_file(struct p4_file *pf);
 
 #endif /* HP4_PARSER_H */
@@ -1,13 +1,18 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <poll.h>
+#include <sys/ioctl.h>
+
 #include "debug.h"
 #include "pipe.h"
+#include "pipe_budget.h"
 
 struct pipe *get_pipe(struct pipe_array *pa, int idx) {
     if (idx < 0 || (unsigned int)idx >= pa->length) {
@@ -17,7 +22,8 @@ struct pipe *get_pipe(struct pipe_array *pa, int idx) {
 }
 
 int pipe_append_edge_id(struct pipe *p, const char *edge_id) {
-    char **new_edge_ids = realloc(p->edge_ids, p->n_edge_ids + 1);
+    char **new_edge_ids = realloc(p->edge_ids,
+            (p->n_edge_ids + 1) * sizeof(*p->edge_ids));
     if (new_edge_ids == NULL)
         return -1;
     p->edge_ids = new_edge_ids;
@@ -38,8 +44,9 @@ struct pipe *pipe_new(char *port, char *edge_id) {
         return NULL;
     }
 
+    /* nodes are given their ends explicitly, so no pipe leaks into them */
     int fds[2] = {0, 0};
-    if (pipe(fds) < 0) {
+    if (pipe2(fds, O_CLOEXEC) < 0) {
         REPORT_ERRORF("%s", strerror(errno));
         free(new_pipe);
         return NULL;
@@ -60,8 +67,22 @@ struct pipe *pipe_new(char *port, char *edge_id) {
     new_pipe->write_fd = fds[1];
     new_pipe->write_fd_is_open = true;
     new_pipe->port = port;
-    new_pipe->bytes_written = 0u;
-    new_pipe->visited = 0;
+    new_pipe->requested_capacity = 0u;
+    new_pipe->budgeted = 0u;
+    new_pipe->priority = 0;
+    new_pipe->times_full = 0u;
+    new_pipe->relay_thread = 0;
+    new_pipe->direct = false;
+
+    int capacity = fcntl(fds[0], F_GETPIPE_SZ);
+    if (capacity < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        free(new_pipe);
+        return NULL;
+    }
+    new_pipe->capacity = (size_t)capacity;
     return new_pipe;
 }
 
@@ -190,6 +211,62 @@ int close_pipe(struct pipe *pipe_to_close) {
                           strerror(errno));
         result |= close_write;
     }
+    pipe_budget_release(pipe_to_close);
 
     return result;
 }
+
+/**
+ * Returns the number of bytes waiting to be read from a pipe.
+ *
+ * On error: returns -1
+ */
+ssize_t pipe_bytes_available(struct pipe *p) {
+    int available = 0;
+    if (ioctl(p->read_fd, FIONREAD, &available) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    return available;
+}
+
+/**
+ * Returns true if a pipe is empty and its write end has been closed.
+ */
+bool pipe_is_at_eof(struct pipe *p) {
+    struct pollfd pfd = {p->read_fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return false;
+    }
+    return (pfd.revents & POLLHUP) && !(pfd.revents & POLLIN);
+}
+
+/**
+ * Sets the size of a pipe's kernel buffer. The kernel may round it up.
+ */
+int pipe_set_capacity(struct pipe *p, size_t capacity) {
+    if (!p->read_fd_is_open && !p->write_fd_is_open) {
+        REPORT_ERROR("Cannot resize a closed pipe");
+        return -1;
+    }
+    int fd = p->read_fd_is_open ? p->read_fd : p->write_fd;
+    int new_capacity = fcntl(fd, F_SETPIPE_SZ, (int)capacity);
+    if (new_capacity < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    p->capacity = (size_t)new_capacity;
+    return 0;
+}
+
+/**
+ * Records an edge's requested capacity and priority for a pipe it uses.
+ * A pipe shared by several edges takes the largest of each.
+ */
+void pipe_request_capacity(struct pipe *p, size_t capacity, int priority) {
+    if (capacity > p->requested_capacity)
+        p->requested_capacity = capacity;
+    if (p->n_edge_ids == 1 || priority > p->priority)
+        p->priority = priority;
+}
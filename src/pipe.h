@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include <sys/types.h>
+
 struct pipe {
     int read_fd;
     bool read_fd_is_open;
@@ -11,9 +13,20 @@ struct pipe {
     char *port;
     char **edge_ids;
     int n_edge_ids;
-    size_t bytes_written;
-    /* Flag whether writable callback has fired for this pipe */
-    bool visited;
+    /* Size of the kernel buffer, and the size requested for it by edges */
+    size_t capacity;
+    size_t requested_capacity;
+    /* Bytes of capacity charged to the pipe budget */
+    size_t budgeted;
+    /* Highest priority of any edge using this pipe, for sharing out buffer
+     * memory */
+    int priority;
+    /* How many times in a row the pipe has been found full */
+    unsigned int times_full;
+    /* Index of the relay thread which moves this pipe's data */
+    int relay_thread;
+    /* Whether the pipe joins two nodes directly, with no relay by hp4 */
+    bool direct;
 };
 
 struct pipe_array {
@@ -45,4 +58,12 @@ int pipe_array_free(struct pipe_array *pa);
 
 int close_pipe(struct pipe *pipe_to_close);
 
+int pipe_set_capacity(struct pipe *p, size_t capacity);
+
+void pipe_request_capacity(struct pipe *p, size_t capacity, int priority);
+
+ssize_t pipe_bytes_available(struct pipe *p);
+
+bool pipe_is_at_eof(struct pipe *p);
+
 #endif /* HP4_PIPE_H */
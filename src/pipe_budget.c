@@ -0,0 +1,320 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <linux/capability.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "parser.h"
+#include "pipe.h"
+#include "pipe_budget.h"
+
+/* Used when /proc/sys/fs/pipe-max-size cannot be read */
+#define DEFAULT_MAX_PIPE_SIZE 1048576
+
+struct pipe_budget pipe_budget = {SIZE_MAX, 0u, DEFAULT_MAX_PIPE_SIZE, false};
+pthread_mutex_t pipe_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads a single non-negative integer from a file such as those in
+ * /proc/sys/fs.
+ */
+int read_proc_size(const char *path, size_t *value) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    unsigned long long v;
+    int n_read = fscanf(f, "%llu", &v);
+    fclose(f);
+    if (n_read != 1) {
+        return -1;
+    }
+    *value = (size_t)v;
+    return 0;
+}
+
+/**
+ * Returns true if hp4 is not held to the per-user quota of pipe pages: as
+ * the kernel has it, when it has CAP_SYS_RESOURCE or CAP_SYS_ADMIN, as
+ * root usually does, rather than by its uid.
+ */
+bool pipe_quota_exempt(void) {
+    struct __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+    if (syscall(SYS_capget, &header, data) < 0)
+        return false;
+    return (data[0].effective & (1u << CAP_SYS_RESOURCE | 1u << CAP_SYS_ADMIN)) != 0u;
+}
+
+/**
+ * Sets up the global pipe budget. The budget is no larger than limit, nor,
+ * unless hp4 is exempt from it, than the soft per-user quota of pipe
+ * pages; beyond that, the kernel would shrink new pipes to a single page.
+ */
+int pipe_budget_init(size_t limit, bool autogrow) {
+    size_t max_pipe_size;
+    if (read_proc_size("/proc/sys/fs/pipe-max-size", &max_pipe_size) == 0)
+        pipe_budget.max_pipe_size = max_pipe_size;
+
+    size_t user_pages;
+    if (!pipe_quota_exempt() &&
+            read_proc_size("/proc/sys/fs/pipe-user-pages-soft", &user_pages) == 0 &&
+            user_pages > 0u) {
+        size_t user_bytes = user_pages * (size_t)sysconf(_SC_PAGESIZE);
+        if (user_bytes < limit)
+            limit = user_bytes;
+    }
+
+    pipe_budget.limit = limit;
+    pipe_budget.used = 0u;
+    pipe_budget.autogrow = autogrow;
+    PRINT_DEBUG("pipe budget %zu bytes, max pipe size %zu bytes\n",
+                pipe_budget.limit, pipe_budget.max_pipe_size);
+    return 0;
+}
+
+/**
+ * Returns the capacity, no larger than wanted, to which a pipe of capacity
+ * current may be grown within the budget. The kernel rounds capacities up
+ * to a power of two pages, so the result is rounded down to one.
+ */
+size_t pipe_budget_grant(size_t current, size_t wanted) {
+    if (wanted > pipe_budget.max_pipe_size)
+        wanted = pipe_budget.max_pipe_size;
+    if (wanted <= current)
+        return current;
+
+    size_t available = pipe_budget.used < pipe_budget.limit ?
+                       pipe_budget.limit - pipe_budget.used : 0u;
+    if (wanted - current > available)
+        wanted = current + available;
+
+    size_t granted = (size_t)sysconf(_SC_PAGESIZE);
+    while (granted * 2u <= wanted)
+        granted *= 2u;
+    return granted > current ? granted : current;
+}
+
+/**
+ * Resizes a pipe to the capacity granted by the budget for wanted bytes,
+ * and charges the difference to the budget.
+ */
+int pipe_budget_resize(struct pipe *p, size_t wanted) {
+    /* relay threads may grow their pipes at the same time */
+    pthread_mutex_lock(&pipe_budget_lock);
+    size_t granted = pipe_budget_grant(p->capacity, wanted);
+    if (granted == p->capacity) {
+        pthread_mutex_unlock(&pipe_budget_lock);
+        return 0;
+    }
+
+    size_t old_capacity = p->capacity;
+    if (pipe_set_capacity(p, granted) < 0) {
+        pthread_mutex_unlock(&pipe_budget_lock);
+        return -1;
+    }
+    pipe_budget.used += p->capacity - old_capacity;
+    p->budgeted += p->capacity - old_capacity;
+    pthread_mutex_unlock(&pipe_budget_lock);
+    PRINT_DEBUG("pipe for edge %s resized from %zu to %zu bytes\n",
+                p->edge_ids[0], old_capacity, p->capacity);
+    return 0;
+}
+
+/**
+ * Gives a pipe's capacity back to the budget once hp4 has closed both its
+ * ends. A direct pipe joining two processes is closed by hp4 as soon as
+ * they start, so stays charged until it is freed.
+ */
+void pipe_budget_release(struct pipe *p) {
+    if (p->read_fd_is_open || p->write_fd_is_open)
+        return;
+    pthread_mutex_lock(&pipe_budget_lock);
+    pipe_budget.used -= p->budgeted < pipe_budget.used ? p->budgeted : pipe_budget.used;
+    p->budgeted = 0u;
+    pthread_mutex_unlock(&pipe_budget_lock);
+}
+
+int compare_pipe_priority(const void *a, const void *b) {
+    const struct pipe *pa = *(struct pipe * const *)a;
+    const struct pipe *pb = *(struct pipe * const *)b;
+    return (pb->priority > pa->priority) - (pb->priority < pa->priority);
+}
+
+/**
+ * Gives each pipe in the graph the capacity requested by its edges, highest
+ * priority first, for as long as the budget allows.
+ */
+int plan_pipe_capacities(struct p4_file *pf) {
+    size_t n_pipes = 0u;
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        n_pipes += pn->in_pipes->length + pn->out_pipes->length;
+    }
+    if (n_pipes == 0u)
+        return 0;
+
+    struct pipe **pipes = malloc(n_pipes * sizeof(*pipes));
+    if (pipes == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+
+    size_t n = 0u;
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        for (size_t j = 0u; j < pn->out_pipes->length; j++)
+            pipes[n++] = pn->out_pipes->pipes[j];
+        /* a direct pipe is also one of its writer's out_pipes */
+        for (size_t j = 0u; j < pn->in_pipes->length; j++) {
+            if (!pn->in_pipes->pipes[j]->direct)
+                pipes[n++] = pn->in_pipes->pipes[j];
+        }
+    }
+    n_pipes = n;
+
+    pipe_budget.used = 0u;
+    for (size_t k = 0u; k < n_pipes; k++) {
+        pipes[k]->budgeted = pipes[k]->capacity;
+        pipe_budget.used += pipes[k]->capacity;
+    }
+
+    qsort(pipes, n_pipes, sizeof(*pipes), compare_pipe_priority);
+
+    for (size_t k = 0u; k < n_pipes; k++) {
+        struct pipe *p = pipes[k];
+        if (p->requested_capacity > p->capacity &&
+                pipe_budget_resize(p, p->requested_capacity) < 0) {
+            /* the pipe still works at its current size */
+            fprintf(stderr, "Could not resize pipe for edge %s to %zu bytes\n",
+                    p->edge_ids[0], p->requested_capacity);
+        }
+        else if (p->requested_capacity > p->capacity) {
+            fprintf(stderr, "Pipe for edge %s limited to %zu bytes\n",
+                    p->edge_ids[0], p->capacity);
+        }
+    }
+
+    free(pipes);
+    return 0;
+}
+
+/**
+ * Records whether a pipe was full when hp4 tried to write into it or read
+ * from it. A pipe which keeps being full is doubled in size, if autogrow is
+ * enabled and the budget allows.
+ */
+void pipe_note_full(struct pipe *p, bool full) {
+    if (!pipe_budget.autogrow)
+        return;
+    if (!full) {
+        p->times_full = 0u;
+        return;
+    }
+    if (++p->times_full < PIPE_GROW_THRESHOLD)
+        return;
+
+    p->times_full = 0u;
+    if (pipe_budget_resize(p, p->capacity * 2u) < 0)
+        PRINT_DEBUG("Failed to grow pipe for edge %s\n", p->edge_ids[0]);
+}
+
+/**
+ * Returns true if an edge before the i'th in pf uses the same port of the
+ * same node as the i'th, on its from side if output is set or its to side
+ * otherwise, and so shares its pipe.
+ */
+bool shares_earlier_pipe(struct p4_file *pf, int i, bool output) {
+    struct p4_edge *pe = p4_file_get_edge(pf, i);
+    for (int j = 0; j < i; j++) {
+        struct p4_edge *other = p4_file_get_edge(pf, j);
+        if (output && strcmp(other->from, pe->from) == 0 &&
+                strcmp(other->from_port, pe->from_port) == 0)
+            return true;
+        if (!output && strcmp(other->to, pe->to) == 0 &&
+                strcmp(other->to_port, pe->to_port) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Returns the number of pipes a graph may need: one per distinct output
+ * port, and one per distinct input port. Direct and copied edges need
+ * fewer, so this is an upper bound.
+ */
+size_t plan_pipe_count(struct p4_file *pf) {
+    size_t n_pipes = 0u;
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        n_pipes += !shares_earlier_pipe(pf, i, true);
+        n_pipes += !shares_earlier_pipe(pf, i, false);
+    }
+    return n_pipes;
+}
+
+/**
+ * Returns the most fds hp4 may hold at once while running a graph. Every
+ * pipe is created before any node is started, so both ends of each count;
+ * each spilling edge and file node adds a file.
+ */
+size_t plan_fd_count(struct p4_file *pf, size_t n_relay_threads) {
+    size_t n_fds = FD_RESERVE + n_relay_threads * FDS_PER_RELAY_THREAD +
+                   2u * plan_pipe_count(pf);
+    for (int i = 0; i < (int)pf->edges->length; i++)
+        n_fds += p4_file_get_edge(pf, i)->spill_high_water > 0u;
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        n_fds += strcmp(pn->type, "INFILE") == 0 || strcmp(pn->type, "OUTFILE") == 0;
+    }
+    return n_fds;
+}
+
+/**
+ * Makes room for a graph before any of its pipes are created: the soft
+ * RLIMIT_NOFILE is raised to the fds planned for it, as far as the hard
+ * limit allows. Warns if that is not enough, or if the graph's pipes would
+ * go past the per-user quota of pipe pages, beyond which the kernel gives
+ * new pipes the minimum size.
+ */
+int plan_fd_limit(struct p4_file *pf, size_t n_relay_threads) {
+    size_t n_fds = plan_fd_count(pf, n_relay_threads);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < n_fds) {
+        PRINT_DEBUG("fd limit %llu is below the %zu planned\n",
+                    (unsigned long long)rl.rlim_cur, n_fds);
+        rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < n_fds ?
+                      rl.rlim_max : (rlim_t)n_fds;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            REPORT_ERRORF("%s", strerror(errno));
+            return -1;
+        }
+        if (rl.rlim_cur < n_fds)
+            fprintf(stderr, "Graph may need %zu fds, but only %llu may be open; "
+                            "raise the hard limit (ulimit -Hn)\n",
+                    n_fds, (unsigned long long)rl.rlim_cur);
+    }
+
+    size_t user_pages;
+    size_t n_pipes = plan_pipe_count(pf);
+    if (!pipe_quota_exempt() &&
+            read_proc_size("/proc/sys/fs/pipe-user-pages-soft", &user_pages) == 0 &&
+            user_pages > 0u && n_pipes * DEFAULT_PIPE_PAGES > user_pages)
+        fprintf(stderr, "Graph may need %zu pipes; past the %zu pages of "
+                        "fs.pipe-user-pages-soft, the kernel gives them the minimum size\n",
+                n_pipes, user_pages);
+    return 0;
+}
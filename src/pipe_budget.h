@@ -0,0 +1,55 @@
+#ifndef HP4_PIPE_BUDGET_H
+#define HP4_PIPE_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "parser.h"
+#include "pipe.h"
+
+/* Number of times in a row a pipe must be found full before it is grown */
+#ifndef PIPE_GROW_THRESHOLD
+#define PIPE_GROW_THRESHOLD 16
+#endif /* PIPE_GROW_THRESHOLD */
+
+/* fds which hp4 holds besides those of its graph: stdio, the main
+ * event_base and its signal pipe, io_uring, /dev/null and the like */
+#ifndef FD_RESERVE
+#define FD_RESERVE 32
+#endif /* FD_RESERVE */
+
+/* fds held by each relay thread's event_base */
+#define FDS_PER_RELAY_THREAD 3
+
+/* Pages the kernel gives a new pipe */
+#define DEFAULT_PIPE_PAGES 16
+
+/* Kernel buffer memory which hp4 may give to the pipes it creates */
+struct pipe_budget {
+    /* bytes which all pipes together may hold */
+    size_t limit;
+    /* bytes currently allocated to pipes */
+    size_t used;
+    /* largest capacity an unprivileged process may give a pipe */
+    size_t max_pipe_size;
+    /* whether pipes which keep running full are grown at runtime */
+    bool autogrow;
+};
+
+extern struct pipe_budget pipe_budget;
+
+int pipe_budget_init(size_t limit, bool autogrow);
+
+size_t pipe_budget_grant(size_t current, size_t wanted);
+
+int plan_pipe_capacities(struct p4_file *pf);
+
+void pipe_budget_release(struct pipe *p);
+
+void pipe_note_full(struct pipe *p, bool full);
+
+size_t plan_fd_count(struct p4_file *pf, size_t n_relay_threads);
+
+int plan_fd_limit(struct p4_file *pf, size_t n_relay_threads);
+
+#endif /* HP4_PIPE_BUDGET_H */
@@ -0,0 +1,1135 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+#include <event2/event.h>
+
+#include "debug.h"
+#include "event_handlers.h"
+#include "file_node.h"
+#include "parser.h"
+#include "pipe.h"
+#include "pipe_budget.h"
+#include "record_node.h"
+
+bool node_is_record(struct p4_node *pn) {
+    return strcmp(pn->type, "SCATTER") == 0 || strcmp(pn->type, "GATHER") == 0 ||
+           strcmp(pn->type, "PARTITION") == 0 || strcmp(pn->type, "MERGE") == 0;
+}
+
+/**
+ * Returns the length of the whole record at the start of data, which holds
+ * len bytes, or 0 if the record is not all there yet. Lines are found with
+ * memchr(3), which libc scans a vector at a time.
+ */
+size_t record_length(struct record_node *rn, const char *data, size_t len) {
+    switch (rn->format) {
+        case RECORDS_FIXED:
+            return len >= rn->record_size ? rn->record_size : 0u;
+        case RECORDS_PREFIXED: {
+            if (len < RECORD_PREFIX_SIZE)
+                return 0u;
+            const unsigned char *prefix = (const unsigned char *)data;
+            size_t size = 0u;
+            for (int i = 0; i < RECORD_PREFIX_SIZE; i++)
+                size = size << 8 | prefix[i];
+            size += RECORD_PREFIX_SIZE;
+            return len >= size ? size : 0u;
+        }
+        default: {
+            const char *end = memchr(data, '\n', len);
+            return end ? (size_t)(end - data) + 1u : 0u;
+        }
+    }
+}
+
+/**
+ * Returns true if the record at the start of data, which holds len bytes,
+ * is known to be longer than the node's max_record: a length-prefixed
+ * record as soon as its prefix is there, or any other once max_record
+ * bytes have come with no end to it.
+ */
+bool record_too_long(struct record_node *rn, const char *data, size_t len) {
+    switch (rn->format) {
+        case RECORDS_FIXED:
+            return false;
+        case RECORDS_PREFIXED: {
+            if (len < RECORD_PREFIX_SIZE)
+                return false;
+            const unsigned char *prefix = (const unsigned char *)data;
+            uint64_t size = 0u;
+            for (int i = 0; i < RECORD_PREFIX_SIZE; i++)
+                size = size << 8 | prefix[i];
+            return size + RECORD_PREFIX_SIZE > (uint64_t)rn->max_record;
+        }
+        default:
+            return len >= rn->max_record && record_length(rn, data, len) == 0u;
+    }
+}
+
+/**
+ * Returns the sequence number a record is tagged with: the decimal digits
+ * it starts with, after any length prefix, or 0 if it starts with none.
+ */
+uint64_t record_sequence(struct record_node *rn, const char *data, size_t size) {
+    size_t i = rn->format == RECORDS_PREFIXED ? RECORD_PREFIX_SIZE : 0u;
+    uint64_t seq = 0u;
+    for (; i < size && data[i] >= '0' && data[i] <= '9'; i++)
+        seq = seq * 10u + (uint64_t)(data[i] - '0');
+    return seq;
+}
+
+/**
+ * Hashes a key a word at a time: each eight bytes are folded in with a
+ * multiply and a rotate, with no branch per byte, and the result is mixed
+ * as in MurmurHash3's finalizer so that every byte of the key reaches the
+ * low bits which pick a bucket.
+ */
+uint64_t key_hash(const char *key, size_t len) {
+    const uint64_t mul = UINT64_C(0x9e3779b97f4a7c15);
+    uint64_t h = (uint64_t)len * mul;
+    size_t i = 0u;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        h = (h ^ word) * mul;
+        h = h << 31 | h >> 33;
+    }
+    if (i < len) {
+        uint64_t word = 0u;
+        memcpy(&word, key + i, len - i);
+        h = (h ^ word) * mul;
+    }
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Returns where the key field of a record of size bytes starts, and sets
+ * *len to its length. A record with too few fields has an empty key.
+ */
+const char *record_key(struct record_node *rn, const char *data, size_t size, size_t *len) {
+    const char *field = data;
+    const char *end = data + size;
+    if (rn->format == RECORDS_PREFIXED)
+        field += size < RECORD_PREFIX_SIZE ? size : RECORD_PREFIX_SIZE;
+    else if (rn->format == RECORDS_LINES && size > 0u && end[-1] == '\n')
+        --end;
+    for (size_t i = 1u; i < rn->key_field && field < end; i++) {
+        const char *next = memchr(field, rn->delimiter, (size_t)(end - field));
+        field = next ? next + 1 : end;
+    }
+    const char *stop = memchr(field, rn->delimiter, (size_t)(end - field));
+    *len = (size_t)((stop ? stop : end) - field);
+    return field;
+}
+
+/**
+ * Returns the index of the output a PARTITION node sends a record to, from
+ * the hash of its key field.
+ */
+size_t record_bucket(struct record_node *rn, const char *data, size_t size) {
+    size_t len;
+    const char *key = record_key(rn, data, size, &len);
+    return (size_t)(key_hash(key, len) % rn->n_outputs);
+}
+
+/**
+ * Returns the number a key starts with, after any blanks, as sort(1) -n
+ * reads it: an optional minus sign, digits and an optional fraction. A key
+ * which does not start with a number is 0.
+ */
+double key_number(const char *key, size_t len) {
+    size_t i = 0u;
+    while (i < len && (key[i] == ' ' || key[i] == '\t'))
+        i++;
+    bool negative = i < len && key[i] == '-';
+    if (negative)
+        i++;
+    double value = 0.0;
+    for (; i < len && key[i] >= '0' && key[i] <= '9'; i++)
+        value = value * 10.0 + (key[i] - '0');
+    if (i < len && key[i] == '.') {
+        double scale = 0.1;
+        for (i++; i < len && key[i] >= '0' && key[i] <= '9'; i++) {
+            value += (key[i] - '0') * scale;
+            scale /= 10.0;
+        }
+    }
+    return negative ? -value : value;
+}
+
+/**
+ * Returns the length of the whole record at the head of an input, or 0 if
+ * there is none yet. Once the input is at EOF, whatever is left is its
+ * last record, whole or not.
+ */
+size_t head_length(struct record_node *rn, struct record_port *in) {
+    size_t size = record_length(rn, in->buf + in->start, in->len - in->start);
+    if (size == 0u && in->closed)
+        size = in->len - in->start;
+    return size;
+}
+
+/**
+ * Returns the length of what a GATHER node passes on next from an input:
+ * its head record, or, for a node which moves chunks rather than records,
+ * as much as it has read, up to a chunk.
+ */
+size_t gather_length(struct record_node *rn, struct record_port *in) {
+    if (!rn->by_chunk)
+        return head_length(rn, in);
+    size_t len = in->len - in->start;
+    return len < rn->chunk_size ? len : rn->chunk_size;
+}
+
+/**
+ * Sets how a record node cuts its streams into records, and how it deals
+ * them out or gathers them in, from its node's `records`, `record_size`,
+ * `max_record`, `policy`, `window`, `delimiter` and `key_field`.
+ */
+int record_node_config(struct record_node *rn) {
+    struct p4_node *pn = rn->node;
+    rn->format = RECORDS_LINES;
+    rn->record_size = pn->record_size;
+    rn->max_record = pn->max_record > 0u ? pn->max_record : DEFAULT_MAX_RECORD;
+    rn->least_full = false;
+    rn->sequenced = false;
+    rn->unordered = false;
+    rn->concatenate = false;
+    rn->by_chunk = false;
+    rn->window = pn->window > 0u ? pn->window : DEFAULT_REORDER_WINDOW;
+    rn->delimiter = pn->delimiter ? pn->delimiter[0] : '\t';
+    rn->key_field = pn->key_field;
+    rn->numeric = false;
+
+    if (pn->records == NULL || strcmp(pn->records, "lines") == 0) {
+        rn->format = RECORDS_LINES;
+    }
+    else if (strcmp(pn->records, "fixed") == 0) {
+        if (pn->record_size == 0u) {
+            REPORT_ERRORF("Node %s has fixed records, but no record_size", pn->id);
+            return -1;
+        }
+        if (pn->record_size > rn->max_record) {
+            REPORT_ERRORF("Node %s has a record_size larger than its max_record (%zu)",
+                          pn->id, rn->max_record);
+            return -1;
+        }
+        rn->format = RECORDS_FIXED;
+    }
+    else if (strcmp(pn->records, "length_prefixed") == 0) {
+        rn->format = RECORDS_PREFIXED;
+    }
+    else {
+        REPORT_ERRORF("`records` in %s must be lines, fixed or length_prefixed, not %s",
+                      pn->id, pn->records);
+        return -1;
+    }
+
+    if (rn->kind == RECORD_PARTITION || rn->kind == RECORD_MERGE) {
+        if (pn->policy != NULL) {
+            REPORT_ERRORF("%s node %s places records by key, and takes no `policy`",
+                          pn->type, pn->id);
+            return -1;
+        }
+        if (pn->delimiter != NULL && strlen(pn->delimiter) != 1u) {
+            REPORT_ERRORF("`delimiter` in %s must be one character", pn->id);
+            return -1;
+        }
+        if (pn->key_field == 0u) {
+            REPORT_ERRORF("`key_field` in %s counts from 1", pn->id);
+            return -1;
+        }
+        if (pn->compare == NULL || strcmp(pn->compare, "lexical") == 0) {
+            rn->numeric = false;
+        }
+        else if (strcmp(pn->compare, "numeric") == 0) {
+            rn->numeric = true;
+        }
+        else {
+            REPORT_ERRORF("`compare` in %s must be lexical or numeric, not %s",
+                          pn->id, pn->compare);
+            return -1;
+        }
+        return 0;
+    }
+
+    const char *other = rn->kind == RECORD_SCATTER ? "least_full" : "sequence";
+    if (pn->policy == NULL || strcmp(pn->policy, "round_robin") == 0) {
+        rn->least_full = false;
+    }
+    else if (strcmp(pn->policy, other) == 0) {
+        rn->least_full = rn->kind == RECORD_SCATTER;
+        rn->sequenced = rn->kind == RECORD_GATHER;
+    }
+    else if (rn->kind == RECORD_GATHER && strcmp(pn->policy, "unordered") == 0) {
+        rn->unordered = true;
+    }
+    else if (rn->kind == RECORD_GATHER && strcmp(pn->policy, "first_come") == 0) {
+        rn->unordered = true;
+        rn->by_chunk = true;
+    }
+    else if (rn->kind == RECORD_GATHER && strcmp(pn->policy, "concatenate") == 0) {
+        rn->concatenate = true;
+        rn->by_chunk = true;
+    }
+    else {
+        REPORT_ERRORF("`policy` in %s must be round_robin or %s, not %s", pn->id,
+                      rn->kind == RECORD_SCATTER ? other :
+                      "sequence, unordered, first_come or concatenate",
+                      pn->policy);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Takes the node's chunk_size, batch_size and batch_time from the largest
+ * of those of the edges into and out of it, each edge giving the defaults
+ * for any it leaves unset.
+ */
+void record_node_limits(struct p4_file *pf, struct record_node *rn) {
+    bool found = false;
+    rn->chunk_size = rn->batch_size = rn->batch_time = 0u;
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (strcmp(pe->from, rn->node->id) != 0 && strcmp(pe->to, rn->node->id) != 0)
+            continue;
+        raise_edge_limits(pe, &rn->chunk_size, &rn->batch_size, &rn->batch_time);
+        found = true;
+    }
+    if (!found)
+        raise_edge_limits(NULL, &rn->chunk_size, &rn->batch_size, &rn->batch_time);
+}
+
+/**
+ * Frees the events of a record node's ports.
+ */
+void free_port_events(struct record_node *rn) {
+    for (size_t i = 0u; i < rn->n_inputs; i++) {
+        if (rn->inputs[i].event) {
+            event_free(rn->inputs[i].event);
+            rn->inputs[i].event = NULL;
+        }
+    }
+    for (size_t i = 0u; i < rn->n_outputs; i++) {
+        if (rn->outputs[i].event) {
+            event_free(rn->outputs[i].event);
+            rn->outputs[i].event = NULL;
+        }
+    }
+}
+
+/**
+ * Stops moving records for a node once its inputs are done with, or none
+ * of its outputs is read any more, and closes the node's pipes as if its
+ * process had exited.
+ */
+void finish_record_node(struct record_node *rn) {
+    PRINT_DEBUG("Record node %s finished\n", rn->node->id);
+    free_port_events(rn);
+    /* the read end of an input is hp4's own, even if direct */
+    for (size_t i = 0u; i < rn->n_inputs; i++) {
+        struct pipe *p = rn->inputs[i].pipe;
+        if (p->read_fd_is_open && close(p->read_fd) == 0)
+            p->read_fd_is_open = false;
+        pipe_budget_release(p);
+    }
+    end_node(rn->node, rn->sa);
+}
+
+/**
+ * Stops writing to an output which has no reader; what was waiting for it
+ * is dropped.
+ */
+void close_output(struct record_port *out) {
+    out->closed = true;
+    out->ready = false;
+    out->start = out->len = 0u;
+    if (out->event)
+        event_del(out->event);
+}
+
+/**
+ * Writes what is waiting in an output's buffer to its pipe, until the pipe
+ * would block.
+ *
+ * Returns 0 once the buffer is empty, 1 if the pipe is full, or -1 if the
+ * output is closed.
+ */
+int flush_output(struct record_port *out) {
+    while (out->start < out->len) {
+        if (out->closed)
+            return -1;
+        if (!out->ready)
+            return 1;
+        ssize_t bytes = write(out->pipe->write_fd, out->buf + out->start,
+                              out->len - out->start);
+        if (bytes < 0) {
+            if (errno == EAGAIN) {
+                out->ready = false;
+                return 1;
+            }
+            /* EPIPE: the output's readers have all gone */
+            if (errno != EPIPE)
+                REPORT_ERRORF("Node %s: %s", out->rn->node->id, strerror(errno));
+            close_output(out);
+            return -1;
+        }
+        out->start += (size_t)bytes;
+        if (out->bytes_spliced)
+            __atomic_fetch_add(out->bytes_spliced, (int64_t)bytes, __ATOMIC_RELAXED);
+    }
+    out->start = out->len = 0u;
+    return out->closed ? -1 : 0;
+}
+
+/**
+ * Writes out what is waiting for each output, as far as each pipe allows.
+ *
+ * Returns the number of outputs which still have data waiting.
+ */
+size_t flush_outputs(struct record_node *rn) {
+    size_t n_waiting = 0u;
+    for (size_t i = 0u; i < rn->n_outputs; i++) {
+        if (flush_output(&rn->outputs[i]) > 0)
+            ++n_waiting;
+    }
+    return n_waiting;
+}
+
+/**
+ * Copies a record into an output's buffer, writing out what is already
+ * waiting there first if the record does not fit. A record larger than the
+ * buffer has the buffer grown to hold it.
+ *
+ * Returns 0 once the record is in the buffer, 1 if the output must drain
+ * first, or -1 if it is closed.
+ */
+int deal_record(struct record_port *out, const char *data, size_t size) {
+    if (out->closed)
+        return -1;
+    if (out->len + size > out->cap && out->start > 0u) {
+        memmove(out->buf, out->buf + out->start, out->len - out->start);
+        out->len -= out->start;
+        out->start = 0u;
+    }
+    if (out->len + size > out->cap && out->len > 0u) {
+        int res = flush_output(out);
+        if (res != 0)
+            return res;
+    }
+    if (size > out->cap) {
+        char *buf = realloc(out->buf, size);
+        if (buf == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            close_output(out);
+            return -1;
+        }
+        out->buf = buf;
+        out->cap = size;
+    }
+
+    memcpy(out->buf + out->len, data, size);
+    out->len += size;
+    __atomic_fetch_add(&out->bytes, (int64_t)size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&out->records, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Returns the bytes an output's pipe holds, or 0 if that cannot be told.
+ */
+size_t output_backlog(struct record_port *out) {
+    int held = 0;
+    if (ioctl(out->pipe->write_fd, FIONREAD, &held) < 0)
+        return 0u;
+    return (size_t)held;
+}
+
+/**
+ * Points the node at whichever open output has least data waiting, in its
+ * pipe and its buffer; outputs which cannot take any more are passed over
+ * unless every output is in that state.
+ */
+void pick_least_full(struct record_node *rn) {
+    size_t least = SIZE_MAX;
+    bool least_ready = false;
+    for (size_t i = 0u; i < rn->n_outputs; i++) {
+        struct record_port *out = &rn->outputs[i];
+        if (out->closed)
+            continue;
+        bool ready = out->ready || out->start == out->len;
+        size_t waiting = out->len - out->start + output_backlog(out);
+        if ((ready && !least_ready) || (ready == least_ready && waiting < least)) {
+            least = waiting;
+            least_ready = ready;
+            rn->next = i;
+        }
+    }
+}
+
+/**
+ * Returns the output due the record in data, or NULL if every output is
+ * closed. Only a PARTITION node returns a closed output, that of the
+ * record's bucket, as its records may go nowhere else.
+ */
+struct record_port *next_output(struct record_node *rn, const char *data, size_t size) {
+    if (rn->kind == RECORD_PARTITION) {
+        rn->next = record_bucket(rn, data, size);
+        for (size_t i = 0u; i < rn->n_outputs; i++) {
+            if (!rn->outputs[i].closed)
+                return &rn->outputs[rn->next];
+        }
+        return NULL;
+    }
+    for (size_t i = 0u; i < rn->n_outputs; i++) {
+        struct record_port *out = &rn->outputs[rn->next];
+        if (!out->closed)
+            return out;
+        rn->next = (rn->next + 1u) % rn->n_outputs;
+    }
+    return NULL;
+}
+
+/**
+ * Moves on from the output which has just been dealt a record: to the next
+ * output in turn, or, with least_full, to the least full output once a
+ * chunk is waiting for this one. A PARTITION node picks the output for
+ * each record as it comes.
+ */
+void advance_output(struct record_node *rn, struct record_port *out) {
+    if (rn->kind == RECORD_PARTITION)
+        return;
+    if (!rn->least_full) {
+        rn->next = (rn->next + 1u) % rn->n_outputs;
+        return;
+    }
+    if (out->len - out->start < rn->chunk_size)
+        return;
+    flush_output(out);
+    pick_least_full(rn);
+}
+
+/**
+ * Reads what the input's pipe holds into its buffer, after the data
+ * already there, which is first moved to the front if it leaves less than
+ * half the buffer free. The buffer is grown if a record does not fit in it.
+ * A record longer than the node's max_record, most likely from a corrupt
+ * stream, fails the input: the error is reported, what it holds is
+ * dropped, and it reads as being at EOF.
+ *
+ * Returns as for read(2).
+ */
+ssize_t fill_input(struct record_port *in) {
+    struct record_node *rn = in->rn;
+    if (!rn->by_chunk && record_too_long(rn, in->buf + in->start, in->len - in->start)) {
+        REPORT_ERRORF("Node %s: a record on port %s is longer than max_record (%zu bytes)",
+                      rn->node->id, in->pipe->port, rn->max_record);
+        in->start = in->len = 0u;
+        return 0;
+    }
+    if (in->start > 0u && in->cap - in->len < in->cap / 2u) {
+        memmove(in->buf, in->buf + in->start, in->len - in->start);
+        in->len -= in->start;
+        in->start = 0u;
+    }
+    if (in->len == in->cap) {
+        char *buf = realloc(in->buf, in->cap * 2u);
+        if (buf == NULL)
+            return -1;
+        in->buf = buf;
+        in->cap *= 2u;
+    }
+
+    ssize_t bytes = read(in->pipe->read_fd, in->buf + in->len, in->cap - in->len);
+    if (bytes > 0) {
+        in->len += (size_t)bytes;
+        __atomic_fetch_add(&in->bytes, (int64_t)bytes, __ATOMIC_RELAXED);
+        if (in->bytes_spliced)
+            __atomic_fetch_add(in->bytes_spliced, (int64_t)bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+/**
+ * Deals whole records from a SCATTER or PARTITION node's input out between
+ * its outputs until the input, or the output due the next record, would
+ * block, or the node's batch_size or batch_time is spent; in the last case
+ * the event loop is asked to come straight back. Records wait in each
+ * output's buffer until it fills or the input runs dry, so that each
+ * write(2) carries many of them. A PARTITION node drops the records of a
+ * bucket whose output has no reader.
+ */
+void scatter_records(struct record_node *rn) {
+    struct record_port *in = &rn->inputs[0];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (true) {
+        size_t size = head_length(rn, in);
+        if (size > 0u) {
+            struct record_port *out = next_output(rn, in->buf + in->start, size);
+            if (out == NULL) {
+                finish_record_node(rn);
+                return;
+            }
+            int res = deal_record(out, in->buf + in->start, size);
+            if (res < 0 && rn->kind != RECORD_PARTITION)
+                continue;
+            if (res > 0) {
+                /* a least_full node may go around a full output */
+                size_t blocked = rn->next;
+                if (rn->least_full)
+                    pick_least_full(rn);
+                if (rn->next != blocked)
+                    continue;
+                /* the consumers of other outputs must not wait on this one */
+                flush_outputs(rn);
+                return;
+            }
+
+            in->start += size;
+            __atomic_fetch_add(&in->records, 1, __ATOMIC_RELAXED);
+            advance_output(rn, out);
+            moved += size;
+            if (moved >= rn->batch_size || batch_expired(&start, rn->batch_time)) {
+                event_active(in->event, EV_READ, 0);
+                return;
+            }
+            continue;
+        }
+
+        if (!in->closed && in->ready) {
+            ssize_t bytes = fill_input(in);
+            if (bytes > 0)
+                continue;
+            if (bytes < 0 && errno == EAGAIN) {
+                in->ready = false;
+            }
+            else {
+                if (bytes < 0)
+                    REPORT_ERRORF("Node %s: %s", rn->node->id, strerror(errno));
+                in->closed = true;
+                continue;
+            }
+        }
+
+        /* the input has run dry for now */
+        if (flush_outputs(rn) == 0u && in->closed)
+            finish_record_node(rn);
+        return;
+    }
+}
+
+/**
+ * Reads more from each input which has not yet a whole record at its head,
+ * or has less than the node's window waiting; an input which is further
+ * ahead of the others is left to fill its pipe, which holds back its
+ * producer.
+ *
+ * Returns true if any input gave data or reached EOF.
+ */
+bool fill_inputs(struct record_node *rn) {
+    bool progress = false;
+    for (size_t i = 0u; i < rn->n_inputs; i++) {
+        struct record_port *in = &rn->inputs[i];
+        if (in->closed || !in->ready)
+            continue;
+        if (in->len - in->start >= rn->window && gather_length(rn, in) > 0u)
+            continue;
+        ssize_t bytes = fill_input(in);
+        if (bytes < 0 && errno == EAGAIN) {
+            in->ready = false;
+            continue;
+        }
+        if (bytes < 0)
+            REPORT_ERRORF("Node %s: %s", rn->node->id, strerror(errno));
+        if (bytes <= 0)
+            in->closed = true;
+        progress = true;
+    }
+    return progress;
+}
+
+/**
+ * Returns the input whose head record, or chunk, goes out next, or NULL if
+ * that is not yet known; *done is set once every input is drained. In
+ * round_robin order, the inputs take turns, and one which is drained drops
+ * out of turn; unordered or first_come, it is the next input in turn which
+ * has a whole record, or any data, at its head; concatenated, it is the
+ * first input which is not drained; in sequence order, it is the input
+ * whose head record has the lowest sequence number, once every input has a
+ * record at its head or is drained.
+ */
+struct record_port *next_input(struct record_node *rn, bool *done) {
+    *done = false;
+    if (rn->concatenate) {
+        for (; rn->next < rn->n_inputs; rn->next++) {
+            struct record_port *in = &rn->inputs[rn->next];
+            if (in->start < in->len)
+                return in;
+            if (!in->closed)
+                return NULL;
+        }
+        *done = true;
+        return NULL;
+    }
+    if (rn->unordered) {
+        *done = true;
+        for (size_t i = 0u; i < rn->n_inputs; i++) {
+            size_t idx = (rn->next + i) % rn->n_inputs;
+            struct record_port *in = &rn->inputs[idx];
+            if (in->closed && in->start == in->len)
+                continue;
+            *done = false;
+            if (gather_length(rn, in) > 0u) {
+                rn->next = idx;
+                return in;
+            }
+        }
+        return NULL;
+    }
+    if (!rn->sequenced) {
+        for (size_t i = 0u; i < rn->n_inputs; i++) {
+            struct record_port *in = &rn->inputs[rn->next];
+            if (!in->closed || in->start < in->len)
+                return head_length(rn, in) > 0u ? in : NULL;
+            rn->next = (rn->next + 1u) % rn->n_inputs;
+        }
+        *done = true;
+        return NULL;
+    }
+
+    struct record_port *lowest = NULL;
+    uint64_t lowest_seq = 0u;
+    *done = true;
+    for (size_t i = 0u; i < rn->n_inputs; i++) {
+        struct record_port *in = &rn->inputs[i];
+        if (in->closed && in->start == in->len)
+            continue;
+        *done = false;
+        size_t size = head_length(rn, in);
+        if (size == 0u)
+            return NULL;
+        uint64_t seq = record_sequence(rn, in->buf + in->start, size);
+        if (lowest == NULL || seq < lowest_seq) {
+            lowest = in;
+            lowest_seq = seq;
+        }
+    }
+    return lowest;
+}
+
+/**
+ * Passes whole records, or chunks, from a GATHER node's inputs to its
+ * output, in the order of its policy, until the input due the next record,
+ * or the output, would block, or the node's batch_size or batch_time is spent;
+ * in the last case the event loop is asked to come straight back.
+ * Records which arrive ahead of their turn wait in their input's buffer,
+ * up to the node's window.
+ */
+void gather_records(struct record_node *rn) {
+    struct record_port *out = &rn->outputs[0];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (true) {
+        bool done;
+        struct record_port *in = next_input(rn, &done);
+        if (in != NULL) {
+            size_t size = gather_length(rn, in);
+            int res = deal_record(out, in->buf + in->start, size);
+            if (res < 0) {
+                /* no one reads the output any more */
+                finish_record_node(rn);
+                return;
+            }
+            if (res > 0)
+                return;
+
+            in->start += size;
+            __atomic_fetch_add(&in->records, 1, __ATOMIC_RELAXED);
+            if (!rn->sequenced && !rn->concatenate)
+                rn->next = (rn->next + 1u) % rn->n_inputs;
+            moved += size;
+            if (moved >= rn->batch_size || batch_expired(&start, rn->batch_time)) {
+                event_active(out->event, EV_WRITE, 0);
+                return;
+            }
+            continue;
+        }
+
+        if (done) {
+            if (flush_output(out) <= 0)
+                finish_record_node(rn);
+            return;
+        }
+        if (!fill_inputs(rn)) {
+            flush_output(out);
+            return;
+        }
+    }
+}
+
+/**
+ * Returns true if the head record of input a goes out before that of
+ * input b: its key is lower, or the keys are equal and a comes first, so
+ * that records with equal keys keep the order of the node's edges. A
+ * drained input loses to any other.
+ */
+bool merge_before(struct record_node *rn, size_t a, size_t b) {
+    struct record_port *in_a = &rn->inputs[a];
+    struct record_port *in_b = &rn->inputs[b];
+    if (in_a->head_size == 0u)
+        return in_b->head_size == 0u && a < b;
+    if (in_b->head_size == 0u)
+        return true;
+
+    if (rn->numeric) {
+        if (in_a->key_value != in_b->key_value)
+            return in_a->key_value < in_b->key_value;
+    }
+    else {
+        /* most keys differ in their first bytes, which compare as one word */
+        if (in_a->key_prefix != in_b->key_prefix)
+            return in_a->key_prefix < in_b->key_prefix;
+        size_t len = in_a->key_len < in_b->key_len ? in_a->key_len : in_b->key_len;
+        if (len > sizeof(in_a->key_prefix)) {
+            size_t skip = sizeof(in_a->key_prefix);
+            int cmp = memcmp(in_a->buf + in_a->start + in_a->key_offset + skip,
+                             in_b->buf + in_b->start + in_b->key_offset + skip, len - skip);
+            if (cmp != 0)
+                return cmp < 0;
+        }
+        if (in_a->key_len != in_b->key_len)
+            return in_a->key_len < in_b->key_len;
+    }
+    return a < b;
+}
+
+/**
+ * Plays off the inputs under node n of a MERGE node's tournament tree,
+ * whose leaves n_inputs to 2 * n_inputs - 1 are the inputs themselves,
+ * leaving the loser of each match at its node, and returns the winner.
+ */
+size_t tree_build(struct record_node *rn, size_t n) {
+    if (n >= rn->n_inputs)
+        return n - rn->n_inputs;
+    size_t a = tree_build(rn, 2u * n);
+    size_t b = tree_build(rn, 2u * n + 1u);
+    bool a_wins = merge_before(rn, a, b);
+    rn->tree[n] = a_wins ? b : a;
+    return a_wins ? a : b;
+}
+
+/**
+ * Plays the last winner of a MERGE node's tournament tree, which has a new
+ * head record, against the losers on the way from its leaf to the top: one
+ * comparison a level.
+ */
+void tree_replay(struct record_node *rn) {
+    size_t winner = rn->tree[0];
+    for (size_t n = (winner + rn->n_inputs) / 2u; n > 0u; n /= 2u) {
+        if (merge_before(rn, rn->tree[n], winner)) {
+            size_t loser = winner;
+            winner = rn->tree[n];
+            rn->tree[n] = loser;
+        }
+    }
+    rn->tree[0] = winner;
+}
+
+/**
+ * Reads an input of a MERGE node until it has a whole record at its head,
+ * and notes where the record's key is, as offsets into the input's buffer
+ * so that nothing is copied or allocated for it.
+ *
+ * Returns 1 once the input has a head record, 0 if it is drained, or -1 if
+ * it would block.
+ */
+int load_head(struct record_node *rn, struct record_port *in) {
+    while (true) {
+        size_t size = head_length(rn, in);
+        if (size > 0u) {
+            const char *head = in->buf + in->start;
+            size_t len;
+            const char *key = record_key(rn, head, size, &len);
+            in->head_size = size;
+            in->key_offset = (size_t)(key - head);
+            in->key_len = len;
+            if (rn->numeric) {
+                in->key_value = key_number(key, len);
+            }
+            else {
+                uint64_t prefix = 0u;
+                for (size_t i = 0u; i < sizeof(prefix); i++)
+                    prefix = prefix << 8 | (i < len ? (unsigned char)key[i] : 0u);
+                in->key_prefix = prefix;
+            }
+            return 1;
+        }
+        if (in->closed) {
+            in->head_size = 0u;
+            return 0;
+        }
+        if (!in->ready)
+            return -1;
+        ssize_t bytes = fill_input(in);
+        if (bytes > 0)
+            continue;
+        if (bytes < 0 && errno == EAGAIN) {
+            in->ready = false;
+            return -1;
+        }
+        if (bytes < 0)
+            REPORT_ERRORF("Node %s: %s", rn->node->id, strerror(errno));
+        in->closed = true;
+    }
+}
+
+/**
+ * Brings the tournament tree of a MERGE node up to date: it is first built
+ * once every input has a head record or is drained, then replayed each
+ * time the winner's head record has gone out, with the winner's next one.
+ *
+ * Returns false if an input which is needed would block.
+ */
+bool merge_heads(struct record_node *rn) {
+    while (rn->n_loaded < rn->n_inputs) {
+        if (load_head(rn, &rn->inputs[rn->n_loaded]) < 0)
+            return false;
+        if (++rn->n_loaded == rn->n_inputs)
+            rn->tree[0] = tree_build(rn, 1u);
+    }
+    if (rn->top_taken) {
+        if (load_head(rn, &rn->inputs[rn->tree[0]]) < 0)
+            return false;
+        rn->top_taken = false;
+        tree_replay(rn);
+    }
+    return true;
+}
+
+/**
+ * Passes the records of a MERGE node's sorted inputs to its output in
+ * order of their keys, until an input which holds the next record, or
+ * the output, would block, or the node's batch_size or batch_time is
+ * spent; in the last case the event loop is asked to come straight back.
+ * Each record is compared where it lies in its input's buffer, and only
+ * copied to the output's buffer, which is written a chunk at a time.
+ */
+void merge_records(struct record_node *rn) {
+    struct record_port *out = &rn->outputs[0];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t moved = 0u;
+    while (true) {
+        if (!merge_heads(rn)) {
+            flush_output(out);
+            return;
+        }
+        struct record_port *in = &rn->inputs[rn->tree[0]];
+        if (in->head_size == 0u) {
+            /* the winner is drained, and so is every other input */
+            if (flush_output(out) <= 0)
+                finish_record_node(rn);
+            return;
+        }
+
+        int res = deal_record(out, in->buf + in->start, in->head_size);
+        if (res < 0) {
+            /* no one reads the output any more */
+            finish_record_node(rn);
+            return;
+        }
+        if (res > 0)
+            return;
+
+        in->start += in->head_size;
+        __atomic_fetch_add(&in->records, 1, __ATOMIC_RELAXED);
+        rn->top_taken = true;
+        moved += in->head_size;
+        if (moved >= rn->batch_size || batch_expired(&start, rn->batch_time)) {
+            event_active(out->event, EV_WRITE, 0);
+            return;
+        }
+    }
+}
+
+void record_port_handler(evutil_socket_t fd, short what, void *arg) {
+    struct record_port *port = arg;
+    if (port->rn->node->ended)
+        return;
+    port->ready = true;
+    if (port->rn->kind == RECORD_GATHER)
+        gather_records(port->rn);
+    else if (port->rn->kind == RECORD_MERGE)
+        merge_records(port->rn);
+    else
+        scatter_records(port->rn);
+}
+
+/**
+ * Sets up one of a record node's ports on pipe p: a buffer of cap bytes,
+ * and an event on the end of the pipe which hp4 keeps.
+ */
+int record_port_init(struct p4_file *pf, struct record_port *port, struct pipe *p,
+                     bool output, size_t cap, struct event_base *eb) {
+    port->pipe = p;
+    port->start = port->len = 0u;
+    port->cap = cap;
+    port->bytes = 0;
+    port->records = 0;
+    port->bytes_spliced = NULL;
+    port->event = NULL;
+    port->ready = output;
+    port->closed = false;
+    port->buf = malloc(port->cap);
+    if (port->buf == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+
+    /* a direct pipe is not relayed, so its edge is counted here, unless by
+     * a file node at its other end, or by the record node writing to it */
+    if (p->direct) {
+        struct p4_edge *pe = find_edge_by_id(pf, p->edge_ids[0]);
+        struct p4_node *other = pe ? find_node_by_id(pf, output ? pe->to : pe->from) : NULL;
+        if (other && !node_is_file(other) && (output || !node_is_record(other)))
+            port->bytes_spliced = &pe->bytes_spliced;
+    }
+
+    int fd = output ? p->write_fd : p->read_fd;
+    int current_flags = fcntl(fd, F_GETFL, NULL);
+    if (current_flags < 0 || fcntl(fd, F_SETFL, current_flags | O_NONBLOCK) < 0) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+
+    port->event = event_new(eb, fd, (output ? EV_WRITE : EV_READ)|EV_PERSIST|EV_ET,
+                            record_port_handler, port);
+    if (port->event == NULL) {
+        REPORT_ERROR("Failed to create new record node event");
+        return -1;
+    }
+    if (event_add(port->event, NULL) < 0) {
+        REPORT_ERROR("Failed to add record node event");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets up a record node to move records between its pipes from eb's event
+ * loop: a SCATTER or PARTITION node deals out the records of its input
+ * between its outputs, and a GATHER or MERGE node gathers those of its
+ * inputs into its output.
+ */
+struct record_node *record_node_new(struct p4_file *pf, struct p4_node *pn,
+                                    struct event_base *eb, struct sigchld_args *sa) {
+    enum record_kind kind = RECORD_SCATTER;
+    if (strcmp(pn->type, "GATHER") == 0)
+        kind = RECORD_GATHER;
+    else if (strcmp(pn->type, "PARTITION") == 0)
+        kind = RECORD_PARTITION;
+    else if (strcmp(pn->type, "MERGE") == 0)
+        kind = RECORD_MERGE;
+    bool gathers = kind == RECORD_GATHER || kind == RECORD_MERGE;
+    struct pipe_array *one = gathers ? pn->out_pipes : pn->in_pipes;
+    struct pipe_array *many = gathers ? pn->in_pipes : pn->out_pipes;
+    if (one->length != 1u || many->length == 0u) {
+        REPORT_ERRORF("%s node %s must have one %s and at least one %s", pn->type, pn->id,
+                      gathers ? "output" : "input", gathers ? "input" : "output");
+        return NULL;
+    }
+
+    struct record_node *rn = malloc(sizeof(*rn));
+    if (rn == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+    rn->node = pn;
+    rn->kind = kind;
+    rn->next = 0u;
+    rn->tree = NULL;
+    rn->n_loaded = 0u;
+    rn->top_taken = false;
+    rn->sa = sa;
+    rn->n_inputs = pn->in_pipes->length;
+    rn->n_outputs = pn->out_pipes->length;
+    rn->inputs = calloc(rn->n_inputs, sizeof(*rn->inputs));
+    rn->outputs = calloc(rn->n_outputs, sizeof(*rn->outputs));
+    if (rn->inputs == NULL || rn->outputs == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        record_node_free(rn);
+        return NULL;
+    }
+    if (kind == RECORD_MERGE) {
+        rn->tree = calloc(rn->n_inputs, sizeof(*rn->tree));
+        if (rn->tree == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            record_node_free(rn);
+            return NULL;
+        }
+    }
+    rn->shards = gathers ? rn->inputs : rn->outputs;
+    rn->n_shards = many->length;
+    record_node_limits(pf, rn);
+    if (record_node_config(rn) < 0) {
+        record_node_free(rn);
+        return NULL;
+    }
+
+    /* a GATHER or MERGE node's inputs each hold up to a window of records */
+    size_t in_cap = gathers ? rn->window : rn->chunk_size;
+    int res = 0;
+    for (size_t i = 0u; i < rn->n_inputs && res == 0; i++) {
+        rn->inputs[i].rn = rn;
+        res = record_port_init(pf, &rn->inputs[i], get_pipe(pn->in_pipes, (int)i),
+                               false, in_cap, eb);
+    }
+    for (size_t i = 0u; i < rn->n_outputs && res == 0; i++) {
+        rn->outputs[i].rn = rn;
+        res = record_port_init(pf, &rn->outputs[i], get_pipe(pn->out_pipes, (int)i),
+                               true, rn->chunk_size, eb);
+    }
+    if (res < 0) {
+        free_port_events(rn);
+        record_node_free(rn);
+        return NULL;
+    }
+    return rn;
+}
+
+/**
+ * Frees a record node. Its events are freed once the node finishes; those
+ * of one which has not finished are left to their event_base, which may
+ * already be gone.
+ */
+void record_node_free(struct record_node *rn) {
+    if (rn != NULL) {
+        for (size_t i = 0u; rn->inputs && i < rn->n_inputs; i++)
+            free(rn->inputs[i].buf);
+        for (size_t i = 0u; rn->outputs && i < rn->n_outputs; i++)
+            free(rn->outputs[i].buf);
+        free(rn->inputs);
+        free(rn->outputs);
+        free(rn->tree);
+        free(rn);
+    }
+}
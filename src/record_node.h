@@ -0,0 +1,184 @@
+#ifndef HP4_RECORD_NODE_H
+#define HP4_RECORD_NODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "event_handlers.h"
+#include "parser.h"
+#include "pipe.h"
+
+/* Bytes of the big-endian length which comes before each record of a
+ * length-prefixed stream, not counting itself */
+#define RECORD_PREFIX_SIZE 4
+
+/* Bytes of records a GATHER or MERGE node holds for each input by default
+ * while they wait their turn */
+#ifndef DEFAULT_REORDER_WINDOW
+#define DEFAULT_REORDER_WINDOW (1024 * 1024)
+#endif /* DEFAULT_REORDER_WINDOW */
+
+/* Largest record a record node takes by default; a longer one, such as
+ * one whose length prefix is corrupt, fails its input */
+#ifndef DEFAULT_MAX_RECORD
+#define DEFAULT_MAX_RECORD (64 * 1024 * 1024)
+#endif /* DEFAULT_MAX_RECORD */
+
+enum record_kind {
+    RECORD_SCATTER,
+    RECORD_GATHER,
+    RECORD_PARTITION,
+    RECORD_MERGE
+};
+
+/* How a record node's streams are cut into records */
+enum record_format {
+    /* Lines, each ending in a newline */
+    RECORDS_LINES,
+    /* Blocks of the node's record_size bytes */
+    RECORDS_FIXED,
+    /* Each preceded by its length, in RECORD_PREFIX_SIZE bytes */
+    RECORDS_PREFIXED
+};
+
+struct record_node;
+
+/* One of a record node's pipes, and the data it has read from the pipe or
+ * has still to write to it */
+struct record_port {
+    struct record_node *rn;
+    struct pipe *pipe;
+
+    /* Data in bytes start to len of buf, which holds cap bytes */
+    char *buf;
+    size_t start;
+    size_t len;
+    size_t cap;
+
+    /* Bytes and records moved through the port so far */
+    int64_t bytes;
+    int64_t records;
+
+    /* Count of the port's edge when its pipe is direct, and so not counted
+     * by a relay; NULL otherwise */
+    int64_t *bytes_spliced;
+
+    /* Persistent, edge-triggered event, and whether the pipe may be ready,
+     * as for a relayed edge */
+    struct event *event;
+    bool ready;
+
+    /* Set once an input is at EOF, or an output has no reader */
+    bool closed;
+
+    /* MERGE nodes: the size of the record at the head of an input, 0 once
+     * it is drained; where its key starts, from start, and how long it is;
+     * and the key's first bytes as a big-endian number, or its value if
+     * numeric */
+    size_t head_size;
+    size_t key_offset;
+    size_t key_len;
+    uint64_t key_prefix;
+    double key_value;
+};
+
+/* A node which hp4 runs itself to move whole records between pipes, rather
+ * than forking a process to do so. A SCATTER node deals the records of its
+ * one input out between its outputs, in turn or to whichever has least
+ * data waiting; a PARTITION node sends each to the output its key hashes
+ * to; a GATHER node puts those of its inputs back into one stream, in turn,
+ * as they come or in order of the sequence numbers they start with, or
+ * joins its inputs' data one after another or a chunk at a time; a
+ * MERGE node puts those of its sorted inputs into one sorted stream. */
+struct record_node {
+    struct p4_node *node;
+    enum record_kind kind;
+
+    enum record_format format;
+    size_t record_size;
+
+    /* Most bytes a record may hold, so that an input's buffer is not grown
+     * without limit for one which never ends */
+    size_t max_record;
+
+    /* SCATTER nodes: whether each run of records goes to the output with
+     * least data waiting, rather than each record to the next output */
+    bool least_full;
+
+    /* GATHER nodes: whether records are put in order of their sequence
+     * numbers, or taken from whichever input has one, rather than from
+     * each input in turn; whether each input is drained before the next
+     * is read; and whether chunks of whatever has been read move rather
+     * than whole records; GATHER and MERGE nodes: the most bytes read ahead
+     * from an input while it waits its turn */
+    bool sequenced;
+    bool unordered;
+    bool concatenate;
+    bool by_chunk;
+    size_t window;
+
+    /* PARTITION and MERGE nodes: the character between the fields of a
+     * record, and which field, counting from 1, is its key; MERGE nodes:
+     * whether keys are compared as numbers rather than bytes */
+    char delimiter;
+    size_t key_field;
+    bool numeric;
+
+    /* MERGE nodes: a tournament tree of the inputs, by the keys of their
+     * head records, which holds the index of the winner at 0 and that of
+     * the loser of each match below it; how many inputs have a head record
+     * to play with so far; and whether the winner's head has just gone
+     * out */
+    size_t *tree;
+    size_t n_loaded;
+    bool top_taken;
+
+    struct record_port *inputs;
+    size_t n_inputs;
+    struct record_port *outputs;
+    size_t n_outputs;
+
+    /* The outputs of a SCATTER or PARTITION node, or the inputs of a GATHER
+     * or MERGE node */
+    struct record_port *shards;
+    size_t n_shards;
+
+    /* Index of the output the next record goes to, or of the input it
+     * comes from */
+    size_t next;
+
+    /* Largest of the chunk_size, batch_size and batch_time of the node's
+     * edges */
+    size_t chunk_size;
+    size_t batch_size;
+    size_t batch_time;
+
+    struct sigchld_args *sa;
+};
+
+bool node_is_record(struct p4_node *pn);
+
+size_t record_length(struct record_node *rn, const char *data, size_t len);
+
+bool record_too_long(struct record_node *rn, const char *data, size_t len);
+
+uint64_t record_sequence(struct record_node *rn, const char *data, size_t size);
+
+uint64_t key_hash(const char *key, size_t len);
+
+size_t record_bucket(struct record_node *rn, const char *data, size_t size);
+
+const char *record_key(struct record_node *rn, const char *data, size_t size, size_t *len);
+
+double key_number(const char *key, size_t len);
+
+struct record_node *record_node_new(struct p4_file *pf, struct p4_node *pn,
+                                    struct event_base *eb, struct sigchld_args *sa);
+
+void record_node_free(struct record_node *rn);
+
+#endif /* HP4_RECORD_NODE_H */
@@ -0,0 +1,290 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <event2/event.h>
+#include <event2/thread.h>
+
+#include "debug.h"
+#include "event_handlers.h"
+#include "parser.h"
+#include "pipe.h"
+#include "relay_threads.h"
+
+/* Edges which share a pipe, and so must be relayed by the same thread */
+struct relay_group {
+    size_t root;
+    size_t n_edges;
+};
+
+/**
+ * Returns a new event_base for relaying data. The relay relies on
+ * edge-triggered events, which epoll provides.
+ */
+struct event_base *relay_base_new(void) {
+    struct event_config *ec = event_config_new();
+    if (ec == NULL) {
+        REPORT_ERROR("Failed to create a new event_config");
+        return NULL;
+    }
+    event_config_require_features(ec, EV_FEATURE_ET);
+    struct event_base *eb = event_base_new_with_config(ec);
+    event_config_free(ec);
+    if (eb == NULL)
+        REPORT_ERROR("Failed to create a new event_base");
+    return eb;
+}
+
+void keepalive_handler(evutil_socket_t fd, short what, void *arg) {
+    return;
+}
+
+/**
+ * Creates a pool of n_threads relay threads, each with its own event_base.
+ * libevent's locking is switched on first, so this must be called before
+ * any other event_base is created.
+ */
+struct relay_pool *relay_pool_new(size_t n_threads, bool io_uring) {
+    if (evthread_use_pthreads() < 0) {
+        REPORT_ERROR("Failed to enable threading in libevent");
+        return NULL;
+    }
+
+    struct relay_pool *rp = malloc(sizeof(*rp));
+    if (rp == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+    rp->n_threads = 0u;
+    rp->threads = calloc(n_threads, sizeof(*rp->threads));
+    if (rp->threads == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        free(rp);
+        return NULL;
+    }
+
+    struct timeval hour = {3600, 0};
+    for (size_t i = 0u; i < n_threads; i++) {
+        struct relay_thread *rt = &rp->threads[i];
+        rt->index = (int)i;
+        rt->io_uring = io_uring;
+        rt->started = false;
+        rt->n_edges = 0u;
+        rt->eb = relay_base_new();
+        if (rt->eb == NULL) {
+            relay_pool_free(rp);
+            return NULL;
+        }
+        ++rp->n_threads;
+
+        rt->keepalive = event_new(rt->eb, -1, EV_PERSIST, keepalive_handler, NULL);
+        if (rt->keepalive == NULL || event_add(rt->keepalive, &hour) < 0) {
+            REPORT_ERROR("Failed to add keepalive event");
+            relay_pool_free(rp);
+            return NULL;
+        }
+    }
+    return rp;
+}
+
+/**
+ * Returns the index in pf->edges of the edge with the given id, or -1.
+ */
+int edge_index(struct p4_file *pf, const char *edge_id) {
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        if (strcmp(p4_file_get_edge(pf, i)->id, edge_id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+size_t find_group(size_t *parent, size_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/**
+ * Puts every edge using a pipe into the same group.
+ */
+int join_pipe_edges(struct p4_file *pf, struct pipe *p, size_t *parent) {
+    int first = edge_index(pf, p->edge_ids[0]);
+    for (int k = 0; k < p->n_edge_ids; k++) {
+        int other = edge_index(pf, p->edge_ids[k]);
+        if (first < 0 || other < 0) {
+            REPORT_ERRORF("No edge found with id %s", p->edge_ids[k]);
+            return -1;
+        }
+        size_t a = find_group(parent, (size_t)first);
+        size_t b = find_group(parent, (size_t)other);
+        if (a != b)
+            parent[b] = a;
+    }
+    return 0;
+}
+
+int compare_group_size(const void *a, const void *b) {
+    const struct relay_group *ga = a;
+    const struct relay_group *gb = b;
+    if (ga->n_edges != gb->n_edges)
+        return (gb->n_edges > ga->n_edges) - (gb->n_edges < ga->n_edges);
+    return (ga->root > gb->root) - (ga->root < gb->root);
+}
+
+/**
+ * Gives each pipe in the graph a relay thread. Edges tee'd from the same
+ * pipe, or merged into the same pipe, share state and must be relayed by
+ * one thread, so they are grouped first; groups then go to the least loaded
+ * thread, largest first.
+ */
+int plan_relay_threads(struct p4_file *pf, struct relay_pool *rp) {
+    size_t n_edges = pf->edges->length;
+    if (n_edges == 0u)
+        return 0;
+
+    size_t *parent = malloc(n_edges * sizeof(*parent));
+    int *group_thread = malloc(n_edges * sizeof(*group_thread));
+    struct relay_group *groups = malloc(n_edges * sizeof(*groups));
+    if (parent == NULL || group_thread == NULL || groups == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        free(parent);
+        free(group_thread);
+        free(groups);
+        return -1;
+    }
+    for (size_t i = 0u; i < n_edges; i++) {
+        parent[i] = i;
+        groups[i].root = i;
+        groups[i].n_edges = 0u;
+    }
+
+    int res = 0;
+    for (int i = 0; i < (int)pf->nodes->length && res == 0; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        for (size_t j = 0u; j < pn->out_pipes->length && res == 0; j++)
+            res = join_pipe_edges(pf, pn->out_pipes->pipes[j], parent);
+        for (size_t j = 0u; j < pn->in_pipes->length && res == 0; j++)
+            res = join_pipe_edges(pf, pn->in_pipes->pipes[j], parent);
+    }
+
+    if (res == 0) {
+        /* direct and copied edges are not relayed, so they add no load */
+        for (size_t i = 0u; i < n_edges; i++) {
+            struct p4_edge *pe = p4_file_get_edge(pf, (int)i);
+            group_thread[i] = 0;
+            if (!pe->direct && !pe->copy)
+                ++groups[find_group(parent, i)].n_edges;
+        }
+        qsort(groups, n_edges, sizeof(*groups), compare_group_size);
+
+        for (size_t g = 0u; g < n_edges && groups[g].n_edges > 0u; g++) {
+            struct relay_thread *least = &rp->threads[0];
+            for (size_t t = 1u; t < rp->n_threads; t++) {
+                if (rp->threads[t].n_edges < least->n_edges)
+                    least = &rp->threads[t];
+            }
+            least->n_edges += groups[g].n_edges;
+            group_thread[groups[g].root] = least->index;
+        }
+
+        for (int i = 0; i < (int)pf->nodes->length; i++) {
+            struct p4_node *pn = p4_file_get_node(pf, i);
+            for (size_t j = 0u; j < pn->out_pipes->length; j++) {
+                struct pipe *p = pn->out_pipes->pipes[j];
+                size_t root = find_group(parent, (size_t)edge_index(pf, p->edge_ids[0]));
+                p->relay_thread = group_thread[root];
+            }
+            for (size_t j = 0u; j < pn->in_pipes->length; j++) {
+                struct pipe *p = pn->in_pipes->pipes[j];
+                size_t root = find_group(parent, (size_t)edge_index(pf, p->edge_ids[0]));
+                p->relay_thread = group_thread[root];
+            }
+        }
+    }
+
+    free(parent);
+    free(group_thread);
+    free(groups);
+    return res;
+}
+
+/**
+ * Returns the event_base of the thread which relays a pipe's data.
+ */
+struct event_base *relay_pool_base(struct relay_pool *rp, struct pipe *from_pipe) {
+    return rp->threads[from_pipe->relay_thread].eb;
+}
+
+void *relay_thread_main(void *arg) {
+    struct relay_thread *rt = arg;
+    /* io_uring state is per thread; only the first says if it is missing */
+    if (rt->io_uring && use_io_uring(rt->eb) < 0 && rt->index == 0)
+        fprintf(stderr, "io_uring is unavailable (%s); "
+                        "using splice(2) and tee(2)\n", strerror(errno));
+    if (event_base_dispatch(rt->eb) < 0)
+        REPORT_ERRORF("Relay thread %d's event loop failed", rt->index);
+    stop_io_uring();
+    return NULL;
+}
+
+/**
+ * Starts each thread's event loop. Signals are left to the main thread,
+ * which reaps nodes and reports stats, so the relay threads block them all.
+ */
+int relay_pool_start(struct relay_pool *rp) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    int res = 0;
+    for (size_t i = 0u; i < rp->n_threads; i++) {
+        struct relay_thread *rt = &rp->threads[i];
+        int err = pthread_create(&rt->thread, NULL, relay_thread_main, rt);
+        if (err != 0) {
+            REPORT_ERRORF("%s", strerror(err));
+            res = -1;
+            break;
+        }
+        rt->started = true;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return res;
+}
+
+/**
+ * Has each thread leave its event loop, and waits for it to do so.
+ */
+void relay_pool_stop(struct relay_pool *rp) {
+    for (size_t i = 0u; i < rp->n_threads; i++) {
+        struct relay_thread *rt = &rp->threads[i];
+        if (!rt->started)
+            continue;
+        event_base_loopexit(rt->eb, NULL);
+        pthread_join(rt->thread, NULL);
+        rt->started = false;
+    }
+}
+
+void relay_pool_free(struct relay_pool *rp) {
+    if (rp == NULL)
+        return;
+    relay_pool_stop(rp);
+    for (size_t i = 0u; i < rp->n_threads; i++) {
+        struct relay_thread *rt = &rp->threads[i];
+        if (rt->keepalive)
+            event_free(rt->keepalive);
+        event_base_free(rt->eb);
+    }
+    free(rp->threads);
+    free(rp);
+}
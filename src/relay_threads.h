@@ -0,0 +1,50 @@
+#ifndef HP4_RELAY_THREADS_H
+#define HP4_RELAY_THREADS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include <event2/event.h>
+
+#include "parser.h"
+#include "pipe.h"
+
+/* Most threads which may relay data */
+#ifndef MAX_RELAY_THREADS
+#define MAX_RELAY_THREADS 256
+#endif /* MAX_RELAY_THREADS */
+
+/* A thread running its own event loop, which relays the edges given to it */
+struct relay_thread {
+    pthread_t thread;
+    struct event_base *eb;
+    /* keeps the loop running while the thread has no events of its own */
+    struct event *keepalive;
+    size_t n_edges;
+    bool started;
+    bool io_uring;
+    int index;
+};
+
+struct relay_pool {
+    struct relay_thread *threads;
+    size_t n_threads;
+};
+
+struct event_base *relay_base_new(void);
+
+struct relay_pool *relay_pool_new(size_t n_threads, bool io_uring);
+
+int plan_relay_threads(struct p4_file *pf, struct relay_pool *rp);
+
+struct event_base *relay_pool_base(struct relay_pool *rp, struct pipe *from_pipe);
+
+int relay_pool_start(struct relay_pool *rp);
+
+void relay_pool_stop(struct relay_pool *rp);
+
+void relay_pool_free(struct relay_pool *rp);
+
+#endif /* HP4_RELAY_THREADS_H */
@@ -0,0 +1,432 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "debug.h"
+#include "parser.h"
+#include "replicas.h"
+
+/**
+ * Returns a _new_ string of a, sep and b run together, or NULL on error.
+ */
+char *join_strings(const char *a, const char *sep, const char *b) {
+    size_t len = strlen(a) + strlen(sep) + strlen(b) + 1u;
+    char *s = malloc(len);
+    if (s == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+    snprintf(s, len, "%s%s%s", a, sep, b);
+    return s;
+}
+
+/**
+ * Returns a new node parsed from json object obj, as if it had been in the
+ * graph's file, and releases obj; NULL on error.
+ */
+struct p4_node *node_from_json(json_t *obj) {
+    if (obj == NULL)
+        return NULL;
+    struct p4_node *pn = calloc(1u, sizeof(*pn));
+    if (pn == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        json_decref(obj);
+        return NULL;
+    }
+    if (parse_p4_node(obj, pn) < 0) {
+        free(pn);
+        pn = NULL;
+    }
+    json_decref(obj);
+    return pn;
+}
+
+/**
+ * Returns a json object for a copy of replicated node pn, with the given
+ * id and the node's cmd, or NULL on error.
+ */
+json_t *replica_json(struct p4_node *pn, const char *id) {
+    json_t *json_cmd;
+    if (pn->argv != NULL) {
+        json_cmd = json_array();
+        for (char **arg = pn->argv; json_cmd != NULL && *arg != NULL; arg++) {
+            if (json_array_append_new(json_cmd, json_string(*arg)) < 0) {
+                json_decref(json_cmd);
+                json_cmd = NULL;
+            }
+        }
+    }
+    else {
+        json_cmd = json_string(pn->cmd);
+    }
+
+    json_t *obj = json_object();
+    if (obj == NULL || json_cmd == NULL ||
+            json_object_set_new(obj, "id", json_string(id)) < 0 ||
+            json_object_set_new(obj, "type", json_string("EXEC")) < 0 ||
+            json_object_set(obj, "cmd", json_cmd) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_cmd);
+        json_decref(obj);
+        return NULL;
+    }
+    json_decref(json_cmd);
+    return obj;
+}
+
+/**
+ * Returns a json object for the record node of the given id, type and
+ * policy in front of or behind the replicas of pn, which cuts records as
+ * pn's `records`, `record_size` and `max_record` say; NULL on error.
+ */
+json_t *record_json(struct p4_node *pn, const char *id, const char *type, const char *policy) {
+    json_t *obj = json_object();
+    if (obj == NULL ||
+            json_object_set_new(obj, "id", json_string(id)) < 0 ||
+            json_object_set_new(obj, "type", json_string(type)) < 0 ||
+            json_object_set_new(obj, "policy", json_string(policy)) < 0 ||
+            (pn->records != NULL &&
+                json_object_set_new(obj, "records", json_string(pn->records)) < 0) ||
+            (pn->record_size > 0u &&
+                json_object_set_new(obj, "record_size",
+                                    json_integer((json_int_t)pn->record_size)) < 0) ||
+            (pn->max_record > 0u &&
+                json_object_set_new(obj, "max_record",
+                                    json_integer((json_int_t)pn->max_record)) < 0)) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+/**
+ * Adds an edge from `from` to `to`, each a node id with an optional port,
+ * to the graph, with its id made from theirs.
+ */
+int add_derived_edge(struct p4_file *pf, const char *from, const char *from_port,
+                     const char *to, const char *to_port) {
+    char *from_spec = from_port ? join_strings(from, ":", from_port) : strdup(from);
+    char *to_spec = to_port ? join_strings(to, ":", to_port) : strdup(to);
+    char *id = join_strings(from, "-to-", to);
+    json_t *obj = json_object();
+    int res = 0;
+    if (from_spec == NULL || to_spec == NULL || id == NULL || obj == NULL ||
+            json_object_set_new(obj, "id", json_string(id)) < 0 ||
+            json_object_set_new(obj, "from", json_string(from_spec)) < 0 ||
+            json_object_set_new(obj, "to", json_string(to_spec)) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        res = -1;
+    }
+
+    struct p4_edge *pe = NULL;
+    if (res == 0) {
+        pe = calloc(1u, sizeof(*pe));
+        if (pe == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            res = -1;
+        }
+    }
+    if (res == 0 && (parse_p4_edge(obj, pe) < 0 ||
+                     append_edge_to_array(&pf->edges, pe) < 0)) {
+        free(pe);
+        res = -1;
+    }
+    json_decref(obj);
+    free(id);
+    free(to_spec);
+    free(from_spec);
+    return res;
+}
+
+/**
+ * Returns the number of edges into the given port of node pn which come
+ * before edge `before` of the graph, or all of them if it is -1.
+ */
+size_t count_fan_in(struct p4_file *pf, struct p4_node *pn, const char *port, int before) {
+    size_t n = 0u;
+    int end = before < 0 ? (int)pf->edges->length : before;
+    for (int i = 0; i < end; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (strcmp(pe->to, pn->id) == 0 && strcmp(pe->to_port, port) == 0)
+            n++;
+    }
+    return n;
+}
+
+/**
+ * Puts a GATHER node, with pn's `fan_in` as its policy, between the edges
+ * into the given port of pn and the port, each edge going to the GATHER
+ * node's port numbered for its place among them, and adds an edge from the
+ * GATHER node to the port.
+ */
+int add_fan_in(struct p4_file *pf, struct p4_node *pn, const char *port) {
+    bool on_stdin = strcmp(port, STDIO_PORT) == 0;
+    char *base = on_stdin ? strdup(pn->id) : join_strings(pn->id, ".", port);
+    char *id = base ? join_strings(base, "", FAN_IN_SUFFIX) : NULL;
+    char *to_port = strdup(port);
+    free(base);
+    if (id == NULL || to_port == NULL) {
+        REPORT_ERROR("Failed to name fan-in node");
+        free(to_port);
+        free(id);
+        return -1;
+    }
+    int res = 0;
+    if (find_node_by_id(pf, id) != NULL) {
+        REPORT_ERRORF("Node %s has fan-in, but %s is already in the graph", pn->id, id);
+        res = -1;
+    }
+
+    struct p4_node *gather = NULL;
+    struct p4_node **nodes = NULL;
+    if (res == 0) {
+        gather = node_from_json(record_json(pn, id, "GATHER", pn->fan_in));
+        nodes = gather ? realloc(pf->nodes->nodes,
+                                 (pf->nodes->length + 1u) * sizeof(*nodes)) : NULL;
+        if (gather != NULL && nodes == NULL)
+            REPORT_ERRORF("%s", strerror(errno));
+        res = nodes ? 0 : -1;
+    }
+    if (res < 0) {
+        free_p4_node(gather);
+        free(to_port);
+        free(id);
+        return -1;
+    }
+    nodes[pf->nodes->length++] = gather;
+    pf->nodes->nodes = nodes;
+
+    char num[24];
+    size_t n = 0u;
+    for (int i = 0; i < (int)pf->edges->length && res == 0; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (strcmp(pe->to, pn->id) != 0 || strcmp(pe->to_port, to_port) != 0)
+            continue;
+        snprintf(num, sizeof(num), "%zu", ++n);
+        char *moved = strdup(id);
+        char *moved_port = strdup(num);
+        if (moved == NULL || moved_port == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            free(moved_port);
+            free(moved);
+            res = -1;
+            break;
+        }
+        free(pe->to);
+        free(pe->to_port);
+        pe->to = moved;
+        pe->to_port = moved_port;
+    }
+    if (res == 0)
+        res = add_derived_edge(pf, id, NULL, pn->id, on_stdin ? NULL : to_port);
+    if (res == 0)
+        PRINT_DEBUG("Edges into port %s of node %s joined by %s\n", to_port, pn->id, id);
+    free(to_port);
+    free(id);
+    return res;
+}
+
+/**
+ * Joins the data of the edges into each port of a node with `fan_in`
+ * which more than one edge goes into by a GATHER node with the node's id,
+ * the port if not stdin, and ".fan_in", whose policy is the node's
+ * `fan_in`: concatenate to pass each edge's data whole in the order of the
+ * edges, unordered or round_robin to pass whole records, and first_come to
+ * pass chunks as they come. The edges keep their ids, and so their stats,
+ * but go to the GATHER node.
+ */
+int expand_fan_in(struct p4_file *pf) {
+    size_t n_nodes = pf->nodes->length;
+    for (size_t i = 0u; i < n_nodes; i++) {
+        struct p4_node *pn = get_node(pf->nodes, (int)i);
+        if (pn->fan_in == NULL)
+            continue;
+        for (int j = 0; j < (int)pf->edges->length; j++) {
+            struct p4_edge *pe = p4_file_get_edge(pf, j);
+            if (strcmp(pe->to, pn->id) != 0 || count_fan_in(pf, pn, pe->to_port, j) > 0u ||
+                    count_fan_in(pf, pn, pe->to_port, -1) < 2u)
+                continue;
+            if (add_fan_in(pf, pn, pe->to_port) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks that a replicated node is an EXEC node which reads its input on
+ * stdin, and writes any output on stdout, so that its records can be
+ * shared between its replicas, and that the ids of the nodes standing in
+ * for it are free.
+ *
+ * Sets *has_output if any edge comes from the node.
+ */
+int check_replicated(struct p4_file *pf, struct p4_node *pn, bool *has_output) {
+    if (strcmp(pn->type, "EXEC") != 0) {
+        REPORT_ERRORF("Node %s is type %s, but only EXEC nodes have replicas",
+                      pn->id, pn->type);
+        return -1;
+    }
+
+    bool has_input = false;
+    *has_output = false;
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (strcmp(pe->to, pn->id) == 0) {
+            if (strcmp(pe->to_port, STDIO_PORT) != 0) {
+                REPORT_ERRORF("Edge %s goes to port %s of node %s, but replicas only "
+                              "share records read on stdin", pe->id, pe->to_port, pn->id);
+                return -1;
+            }
+            has_input = true;
+        }
+        if (strcmp(pe->from, pn->id) == 0) {
+            if (strcmp(pe->from_port, STDIO_PORT) != 0) {
+                REPORT_ERRORF("Edge %s comes from port %s of node %s, but replicas only "
+                              "gather records written on stdout",
+                              pe->id, pe->from_port, pn->id);
+                return -1;
+            }
+            *has_output = true;
+        }
+    }
+    if (!has_input) {
+        REPORT_ERRORF("Node %s has replicas, but no input for them to share", pn->id);
+        return -1;
+    }
+
+    char num[24];
+    for (size_t i = 0u; i <= pn->replicas + 1u; i++) {
+        snprintf(num, sizeof(num), "%zu", i);
+        char *id = i == 0u ? join_strings(pn->id, "", SPLIT_SUFFIX) :
+                   i > pn->replicas ? join_strings(pn->id, "", JOIN_SUFFIX) :
+                   join_strings(pn->id, ".", num);
+        if (id == NULL)
+            return -1;
+        bool taken = find_node_by_id(pf, id) != NULL;
+        if (taken)
+            REPORT_ERRORF("Node %s has replicas, but %s is already in the graph", pn->id, id);
+        free(id);
+        if (taken)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replaces node idx of the graph, which has replicas, with a SCATTER node
+ * which takes its input, its replicas, each fed from one port of the
+ * SCATTER node and, if the node has output, a GATHER node which puts
+ * theirs back together. The edges into and out of the node are moved to
+ * the SCATTER and GATHER nodes.
+ *
+ * Returns the number of nodes which now stand in its place, or -1 on error.
+ */
+int expand_node(struct p4_file *pf, size_t idx) {
+    struct p4_node *pn = get_node(pf->nodes, (int)idx);
+    bool has_output;
+    if (check_replicated(pf, pn, &has_output) < 0)
+        return -1;
+
+    size_t n_new = 1u + pn->replicas + (has_output ? 1u : 0u);
+    size_t n_after = pf->nodes->length - idx - 1u;
+    struct p4_node **nodes = realloc(pf->nodes->nodes,
+                                     (pf->nodes->length + n_new - 1u) * sizeof(*nodes));
+    if (nodes == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return -1;
+    }
+    /* the nodes standing in for pn go in its place, with the slots of
+     * those not yet made left empty for free_p4_file */
+    memmove(&nodes[idx + n_new], &nodes[idx + 1u], n_after * sizeof(*nodes));
+    memset(&nodes[idx + 1u], 0, (n_new - 1u) * sizeof(*nodes));
+    pf->nodes->nodes = nodes;
+    pf->nodes->length += n_new - 1u;
+
+    char *split_id = join_strings(pn->id, "", SPLIT_SUFFIX);
+    char *join_id = join_strings(pn->id, "", JOIN_SUFFIX);
+    struct p4_node *split = NULL;
+    int res = split_id && join_id ? 0 : -1;
+    if (res == 0) {
+        split = node_from_json(record_json(pn, split_id, "SCATTER",
+                                           pn->ordered ? "round_robin" : "least_full"));
+        res = split ? 0 : -1;
+    }
+
+    char num[24];
+    for (size_t i = 1u; i <= pn->replicas && res == 0; i++) {
+        snprintf(num, sizeof(num), "%zu", i);
+        char *id = join_strings(pn->id, ".", num);
+        if (id == NULL) {
+            res = -1;
+            break;
+        }
+        nodes[idx + i] = node_from_json(replica_json(pn, id));
+        if (nodes[idx + i] == NULL ||
+                add_derived_edge(pf, split_id, num, id, NULL) < 0 ||
+                (has_output && add_derived_edge(pf, id, NULL, join_id, num) < 0))
+            res = -1;
+        free(id);
+    }
+    if (res == 0 && has_output) {
+        nodes[idx + n_new - 1u] = node_from_json(record_json(pn, join_id, "GATHER",
+                                                 pn->ordered ? "round_robin" : "unordered"));
+        if (nodes[idx + n_new - 1u] == NULL)
+            res = -1;
+    }
+
+    for (int i = 0; i < (int)pf->edges->length && res == 0; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        char **end = strcmp(pe->to, pn->id) == 0 ? &pe->to :
+                     strcmp(pe->from, pn->id) == 0 ? &pe->from : NULL;
+        if (end == NULL)
+            continue;
+        char *moved = strdup(end == &pe->to ? split_id : join_id);
+        if (moved == NULL) {
+            REPORT_ERRORF("%s", strerror(errno));
+            res = -1;
+            break;
+        }
+        free(*end);
+        *end = moved;
+    }
+    free(join_id);
+    free(split_id);
+    if (res < 0) {
+        free_p4_node(split);
+        return -1;
+    }
+
+    PRINT_DEBUG("Node %s expanded into %zu replicas\n", pn->id, pn->replicas);
+    nodes[idx] = split;
+    free_p4_node(pn);
+    return (int)n_new;
+}
+
+/**
+ * Expands each node with `replicas` of more than 1 into that many copies
+ * of its command, fed in turn, or whichever has least waiting if the node
+ * is not `ordered`, by a SCATTER node with its id and ".split", and
+ * gathered in the same order, or as they come, by a GATHER node with its
+ * id and ".join". The copies have the node's id and ".1", ".2" and so on,
+ * and are joined by edges named for the nodes at their ends, whose stats
+ * are those of each replica.
+ */
+int expand_replicas(struct p4_file *pf) {
+    for (size_t i = 0u; i < pf->nodes->length; i++) {
+        struct p4_node *pn = get_node(pf->nodes, (int)i);
+        if (pn->replicas <= 1u)
+            continue;
+        int n_new = expand_node(pf, i);
+        if (n_new < 0)
+            return -1;
+        i += (size_t)n_new - 1u;
+    }
+    return 0;
+}
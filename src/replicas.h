@@ -0,0 +1,21 @@
+#ifndef HP4_REPLICAS_H
+#define HP4_REPLICAS_H
+
+#include "parser.h"
+
+/* Appended to the id of a replicated node for those of the SCATTER node
+ * in front of its copies and the GATHER node behind them */
+#define SPLIT_SUFFIX ".split"
+#define JOIN_SUFFIX ".join"
+
+/* Appended to the id of a node, and the port if not stdin, for that of
+ * the GATHER node which joins the edges into the port */
+#define FAN_IN_SUFFIX ".fan_in"
+
+char *join_strings(const char *a, const char *sep, const char *b);
+
+int expand_fan_in(struct p4_file *pf);
+
+int expand_replicas(struct p4_file *pf);
+
+#endif /* HP4_REPLICAS_H */
@@ -0,0 +1,140 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "spill.h"
+
+/* Disk space already drained from a spill file is released in steps of
+ * this many bytes */
+#define SPILL_PUNCH_SIZE (64 * 1024 * 1024)
+
+/**
+ * Opens an unnamed file in dir, falling back to a named file which is
+ * unlinked immediately if the filesystem does not support O_TMPFILE.
+ */
+int open_tmpfile_in_dir(const char *dir) {
+    int fd = open(dir, O_TMPFILE|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+        return fd;
+
+    size_t path_len = strlen(dir) + sizeof("/hp4_spill_XXXXXX");
+    char *path = malloc(path_len);
+    if (path == NULL)
+        return -1;
+    snprintf(path, path_len, "%s/hp4_spill_XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(path);
+    free(path);
+    return fd;
+}
+
+/**
+ * Creates a spill file in dir. If dir is NULL, the file is backed by
+ * memory (or by P_tmpdir where memfd_create(2) is unavailable).
+ */
+struct spill_file *spill_file_new(const char *dir) {
+    struct spill_file *sf = malloc(sizeof(*sf));
+    if (sf == NULL) {
+        REPORT_ERRORF("%s", strerror(errno));
+        return NULL;
+    }
+
+    if (dir != NULL)
+        sf->fd = open_tmpfile_in_dir(dir);
+    else
+#ifdef HAVE_MEMFD_CREATE
+        sf->fd = memfd_create("hp4_spill", MFD_CLOEXEC);
+#else
+        sf->fd = open_tmpfile_in_dir(P_tmpdir);
+#endif /* HAVE_MEMFD_CREATE */
+
+    if (sf->fd < 0) {
+        REPORT_ERRORF("Failed to create spill file in %s: %s",
+                      dir ? dir : "memory", strerror(errno));
+        free(sf);
+        return NULL;
+    }
+    sf->read_offset = 0;
+    sf->write_offset = 0;
+    sf->punched_offset = 0;
+    return sf;
+}
+
+void spill_file_free(struct spill_file *sf) {
+    if (sf != NULL) {
+        close(sf->fd);
+        free(sf);
+    }
+}
+
+size_t spill_file_pending(struct spill_file *sf) {
+    return (size_t)(sf->write_offset - sf->read_offset);
+}
+
+/**
+ * Appends len bytes from src to the end of the spill file.
+ */
+int spill_file_append(struct spill_file *sf, const char *src, size_t len) {
+    while (len > 0u) {
+        ssize_t bytes = pwrite(sf->fd, src, len, sf->write_offset);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            REPORT_ERRORF("Failed to write to spill file: %s", strerror(errno));
+            return -1;
+        }
+        sf->write_offset += bytes;
+        src += bytes;
+        len -= (size_t)bytes;
+    }
+    return 0;
+}
+
+/**
+ * Splices up to len of the oldest bytes in the spill file into fd without
+ * blocking. Once the file has been drained it is truncated, so that it does
+ * not keep growing; while it is still being drained, space behind
+ * read_offset is released in SPILL_PUNCH_SIZE steps.
+ *
+ * Returns the number of bytes spliced, or -1 with errno set as by splice(2).
+ */
+ssize_t spill_file_splice_to_fd(struct spill_file *sf, int fd, size_t len) {
+    size_t pending = spill_file_pending(sf);
+    if (len > pending)
+        len = pending;
+    if (len == 0u)
+        return 0;
+
+    ssize_t bytes = splice(sf->fd, &sf->read_offset, fd, NULL, len,
+                           SPLICE_F_NONBLOCK);
+    if (bytes <= 0)
+        return bytes;
+
+    if (sf->read_offset == sf->write_offset) {
+        if (ftruncate(sf->fd, 0) < 0)
+            PRINT_DEBUG("Failed to truncate spill file: %s\n", strerror(errno));
+        sf->read_offset = 0;
+        sf->write_offset = 0;
+        sf->punched_offset = 0;
+    }
+    else if (sf->read_offset - sf->punched_offset >= SPILL_PUNCH_SIZE) {
+        /* not all filesystems can punch holes; the space is then only
+         * released when the file has been drained */
+        if (fallocate(sf->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                      sf->punched_offset,
+                      sf->read_offset - sf->punched_offset) < 0)
+            PRINT_DEBUG("Failed to release spill file space: %s\n", strerror(errno));
+        sf->punched_offset = sf->read_offset;
+    }
+    return bytes;
+}
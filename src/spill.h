@@ -0,0 +1,27 @@
+#ifndef HP4_SPILL_H
+#define HP4_SPILL_H
+
+#include <sys/types.h>
+
+/* Unnamed temporary file holding data for a tee'd edge which has fallen
+ * further behind than its memory buffer allows. Data is appended at
+ * write_offset and spliced back out from read_offset. */
+struct spill_file {
+    int fd;
+    off_t read_offset;
+    off_t write_offset;
+    /* read_offset up to which disk space has been released */
+    off_t punched_offset;
+};
+
+struct spill_file *spill_file_new(const char *dir);
+
+void spill_file_free(struct spill_file *sf);
+
+size_t spill_file_pending(struct spill_file *sf);
+
+int spill_file_append(struct spill_file *sf, const char *src, size_t len);
+
+ssize_t spill_file_splice_to_fd(struct spill_file *sf, int fd, size_t len);
+
+#endif /* HP4_SPILL_H */
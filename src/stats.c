@@ -3,13 +3,265 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <jansson.h>
 
 #include "debug.h"
+#include "file_node.h"
 #include "parser.h"
+#include "record_node.h"
 
+/**
+ * Returns a new json object describing an edge's spill file; its rate is
+ * the bytes per second spilled since stats were last reported.
+ */
+json_t *spill_stats(struct p4_edge *pe, double elapsed) {
+    /* counters may be updated by relay threads as they are read */
+    int64_t spilled = __atomic_load_n(&pe->bytes_spilled, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&pe->spill_peak, __ATOMIC_RELAXED);
+    json_int_t rate = 0;
+    if (elapsed > 0.0)
+        rate = (json_int_t)((spilled - pe->bytes_spilled_reported) / elapsed);
+    pe->bytes_spilled_reported = spilled;
+
+    json_t *json_spill = json_object();
+    if (json_spill == NULL) {
+        REPORT_ERROR("Failed to create new json object");
+        return NULL;
+    }
+    if (json_object_set_new(json_spill, "bytes", json_integer((json_int_t)spilled)) < 0 ||
+            json_object_set_new(json_spill, "rate", json_integer(rate)) < 0 ||
+            json_object_set_new(json_spill, "peak", json_integer((json_int_t)peak)) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_spill);
+        return NULL;
+    }
+    return json_spill;
+}
+
+/**
+ * Returns a new json object describing a file node: the bytes it has moved
+ * between its file and its pipe, and for an OUTFILE node, the microseconds
+ * it has spent waiting for them to reach the disk.
+ */
+json_t *file_stats(struct file_node *fn) {
+    int64_t bytes = __atomic_load_n(&fn->bytes, __ATOMIC_RELAXED);
+    int64_t flush_us = __atomic_load_n(&fn->flush_us, __ATOMIC_RELAXED);
+    json_t *json_file = json_object();
+    if (json_file == NULL) {
+        REPORT_ERROR("Failed to create new json object");
+        return NULL;
+    }
+    if (json_object_set_new(json_file, "bytes", json_integer((json_int_t)bytes)) < 0 ||
+            (fn->output && json_object_set_new(json_file, "flush_us",
+                                               json_integer((json_int_t)flush_us)) < 0)) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_file);
+        return NULL;
+    }
+    return json_file;
+}
+
+/**
+ * Returns the bytes and records which have gone through each of a record
+ * node's shards, by port: those dealt to a SCATTER or PARTITION node's
+ * outputs, or read from and passed on from a GATHER or MERGE node's
+ * inputs.
+ */
+json_t *record_stats(struct record_node *rn) {
+    json_t *json_record = json_object();
+    if (json_record == NULL) {
+        REPORT_ERROR("Failed to create new json object");
+        return NULL;
+    }
+    for (size_t i = 0u; i < rn->n_shards; i++) {
+        struct record_port *shard = &rn->shards[i];
+        int64_t bytes = __atomic_load_n(&shard->bytes, __ATOMIC_RELAXED);
+        int64_t records = __atomic_load_n(&shard->records, __ATOMIC_RELAXED);
+        json_t *json_port = json_object();
+        if (json_port == NULL) {
+            REPORT_ERROR("Failed to create new json object");
+            json_decref(json_record);
+            return NULL;
+        }
+        if (json_object_set_new(json_port, "bytes", json_integer((json_int_t)bytes)) < 0 ||
+                json_object_set_new(json_port, "records",
+                                    json_integer((json_int_t)records)) < 0 ||
+                json_object_set_new(json_record, shard->pipe->port, json_port) < 0) {
+            REPORT_ERROR("Failed to set property on json object");
+            json_decref(json_port);
+            json_decref(json_record);
+            return NULL;
+        }
+    }
+    return json_record;
+}
+
+/**
+ * Returns the bytes a process has written, from the wchar line of
+ * /proc/<pid>/io, or -1 if it cannot be read.
+ */
+int64_t read_process_wchar(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    int64_t wchar = -1;
+    char line[128];
+    long long value;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "wchar: %lld", &value) == 1) {
+            wchar = (int64_t)value;
+            break;
+        }
+    }
+    fclose(f);
+    return wchar;
+}
+
+/**
+ * Updates the counts of direct edges, which hp4 does not relay, from the
+ * bytes written by the node at their source. That is everything the node
+ * has written, to stderr and any other files as well as the edge, so the
+ * count is an upper bound; edges with exact_bytes are relayed instead. Only
+ * edges from the node with the given pid are sampled, or those from every
+ * running node if pid is 0.
+ */
+void sample_direct_edges(struct p4_file *pf, pid_t pid) {
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (!pe->direct)
+            continue;
+        struct p4_node *from = find_node_by_id(pf, pe->from);
+        struct p4_node *to = find_node_by_id(pf, pe->to);
+        if (from == NULL || from->pid <= 0 || from->ended)
+            continue;
+        /* hp4 counts data into the file and record nodes it runs itself */
+        if (to && (to->file || to->record))
+            continue;
+        if (pid != 0 && from->pid != pid)
+            continue;
+        int64_t wchar = read_process_wchar(from->pid);
+        if (wchar >= 0)
+            __atomic_store_n(&pe->bytes_spliced, wchar, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Adds a section to the detailed stats, listing whichever of the graph's
+ * nodes stat_fn gives stats for; the section is left out if none does.
+ */
+int add_node_stats(json_t *json_stats, const char *section, struct p4_file *pf,
+                   json_t *(*stat_fn)(struct p4_node *)) {
+    json_t *json_section = NULL;
+    for (int i = 0; i < (int)pf->nodes->length; i++) {
+        struct p4_node *pn = p4_file_get_node(pf, i);
+        json_t *json_node = stat_fn(pn);
+        if (json_node == NULL)
+            continue;
+        if (json_section == NULL && (json_section = json_object()) == NULL) {
+            REPORT_ERROR("Failed to create new json object");
+            json_decref(json_node);
+            return -1;
+        }
+        if (json_object_set_new(json_section, pn->id, json_node) < 0) {
+            REPORT_ERROR("Failed to set property on json object");
+            json_decref(json_section);
+            return -1;
+        }
+    }
+    if (json_section && json_object_set_new(json_stats, section, json_section) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        return -1;
+    }
+    return 0;
+}
+
+json_t *node_file_stats(struct p4_node *pn) {
+    return pn->file ? file_stats(pn->file) : NULL;
+}
+
+json_t *node_record_stats(struct p4_node *pn) {
+    return pn->record ? record_stats(pn->record) : NULL;
+}
+
+json_t *node_launch_stats(struct p4_node *pn) {
+    return pn->exec_us >= 0 ? json_integer((json_int_t)pn->exec_us) : NULL;
+}
+
+/**
+ * Returns the detailed stats: the edge counts under "edges", so that no
+ * edge id can be mistaken for one of hp4's own sections, which sit beside
+ * them. Sections which would be empty are left out. Takes the reference to
+ * json_edges.
+ */
+json_t *detailed_stats(struct p4_file *pf, json_t *json_edges, double elapsed) {
+    json_t *json_stats = json_object();
+    if (json_stats == NULL) {
+        REPORT_ERROR("Failed to create new json object");
+        json_decref(json_edges);
+        return NULL;
+    }
+    if (json_object_set_new(json_stats, "edges", json_edges) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_stats);
+        return NULL;
+    }
+
+    /* only present if an edge may spill */
+    json_t *json_spills = NULL;
+
+    for (int i = 0; i < (int)pf->edges->length; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        if (pe->spill_high_water == 0u)
+            continue;
+        if (json_spills == NULL && (json_spills = json_object()) == NULL) {
+            REPORT_ERROR("Failed to create new json object");
+            json_decref(json_stats);
+            return NULL;
+        }
+        if (json_object_set_new(json_spills, pe->id, spill_stats(pe, elapsed)) < 0) {
+            REPORT_ERROR("Failed to set property on json object");
+            json_decref(json_spills);
+            json_decref(json_stats);
+            return NULL;
+        }
+    }
+
+    if (json_spills && json_object_set_new(json_stats, "spill", json_spills) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_stats);
+        return NULL;
+    }
+
+    /* bytes moved by file nodes, records by record nodes, and microseconds
+     * each started node took to exec */
+    if (add_node_stats(json_stats, "files", pf, node_file_stats) < 0 ||
+            add_node_stats(json_stats, "records", pf, node_record_stats) < 0 ||
+            add_node_stats(json_stats, "launch", pf, node_launch_stats) < 0) {
+        json_decref(json_stats);
+        return NULL;
+    }
+
+    if (json_object_set_new(json_stats, "startup_us",
+                            json_integer((json_int_t)pf->startup_us)) < 0) {
+        REPORT_ERROR("Failed to set property on json object");
+        json_decref(json_stats);
+        return NULL;
+    }
+    return json_stats;
+}
+
+/**
+ * Writes a line of stats to stdout: a map of each edge's id to the bytes
+ * it has carried, or, if pf asks for detailed stats, that map and the rest
+ * of hp4's stats.
+ */
 int create_stats_file(struct p4_file *pf) {
     json_t *json_byte_counters = json_object();
     if (json_byte_counters == NULL) {
@@ -17,10 +269,17 @@ int create_stats_file(struct p4_file *pf) {
         return -1;
     }
 
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - pf->stats_time.tv_sec) +
+                     (now.tv_nsec - pf->stats_time.tv_nsec) / 1e9;
+    pf->stats_time = now;
+
     for (int i = 0; i < (int)pf->edges->length; i++) {
         struct p4_edge *pe = p4_file_get_edge(pf, i);
 
-        json_t *json_bytes = json_integer((json_int_t)pe->bytes_spliced);
+        int64_t spliced = __atomic_load_n(&pe->bytes_spliced, __ATOMIC_RELAXED);
+        json_t *json_bytes = json_integer((json_int_t)spliced);
         if (json_bytes == NULL) {
             REPORT_ERROR("Failed to create new json int");
             json_decref(json_byte_counters);
@@ -35,18 +294,23 @@ int create_stats_file(struct p4_file *pf) {
         }
     }
 
-    if (json_dumpf(json_byte_counters, stdout, 0) < 0) {
+    json_t *json_stats = json_byte_counters;
+    if (pf->detailed_stats &&
+            (json_stats = detailed_stats(pf, json_byte_counters, elapsed)) == NULL)
+        return -1;
+
+    if (json_dumpf(json_stats, stdout, 0) < 0) {
         REPORT_ERROR("Failed to dump json object to stdout");
-        json_decref(json_byte_counters);
+        json_decref(json_stats);
         return -1;
     }
 
     if (fputc('\n', stdout) < 0) {
         REPORT_ERROR("Failed to write trailing newline to stdout");
-        json_decref(json_byte_counters);
+        json_decref(json_stats);
         return -1;
     }
 
-    json_decref(json_byte_counters);
+    json_decref(json_stats);
     return 0;
 }
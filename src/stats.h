@@ -1,8 +1,15 @@
 #ifndef HP4_STATS_H
 #define HP4_STATS_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "parser.h"
 
+int64_t read_process_wchar(pid_t pid);
+
+void sample_direct_edges(struct p4_file *pf, pid_t pid);
+
 int create_stats_file(struct p4_file *pf);
 
 #endif /* HP4_STATS_H */
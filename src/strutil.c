@@ -1,5 +1,6 @@
 #include "config.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -120,9 +121,94 @@ int parse_argstring(struct argstruct *pa, const char *input) {
 
     pa->argc = argc;
     pa->argv = argv;
+    pa->words = input_cpy;
     return 0;
 }
 
+/**
+ * Frees the strings parsed by parse_argstring.
+ */
+void free_argstring(struct argstruct *pa) {
+    free(pa->words);
+    free(pa->argv);
+    pa->words = NULL;
+    pa->argv = NULL;
+    pa->argc = 0;
+}
+
+/* Shell keywords, and builtins with no program of the same name, which only
+ * mean something to a shell */
+const char *const shell_words[] = {
+    ".", ":", "alias", "bg", "bind", "break", "builtin", "caller", "case",
+    "cd", "command", "compgen", "complete", "continue", "coproc", "declare",
+    "dirs", "disown", "do", "done", "elif", "else", "enable", "esac", "eval",
+    "exec", "exit", "export", "fc", "fg", "fi", "for", "function", "getopts",
+    "hash", "help", "if", "jobs", "let", "local", "logout", "mapfile", "popd",
+    "pushd", "read", "readarray", "readonly", "return", "select", "set",
+    "shift", "shopt", "source", "suspend", "then", "time", "times", "trap",
+    "type", "typeset", "ulimit", "umask", "unalias", "unset", "until", "wait",
+    "while", NULL
+};
+
+/**
+ * Returns whether a shell would split cmd into the same words as
+ * parse_argstring, leaving nothing to expand, redirect or run as a
+ * pipeline: each word is plain, or wholly quoted.
+ */
+bool is_shell_free(const char *cmd) {
+    for (const char *c = cmd; *c != '\0'; c++) {
+        if (*c == '\'' || *c == '"') {
+            char quote = *c;
+            /* a quote must open and close a whole, non-empty word */
+            if ((c != cmd && c[-1] != ' ') || c[1] == quote)
+                return false;
+            for (++c; *c != quote; c++) {
+                if (*c == '\0' || (quote == '"' && strchr("$`\\!", *c) != NULL))
+                    return false;
+            }
+            if (c[1] != ' ' && c[1] != '\0')
+                return false;
+        }
+        else if (!isalnum((unsigned char)*c) && strchr(" _-./,:+=@%^", *c) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * If pa runs `sh -c`, `bash -c` or `dash -c` on a single command which needs
+ * no shell, fills direct with that command's own argv, so that it can be
+ * exec'd without starting a shell first.
+ *
+ * Returns 1 if so, 0 if pa must be run as it is, or -1 on error.
+ */
+int unwrap_shell(const struct argstruct *pa, struct argstruct *direct) {
+    if (pa->argc != 3 || strcmp(pa->argv[1], "-c") != 0)
+        return 0;
+    const char *shell = strrchr(pa->argv[0], '/');
+    shell = shell == NULL ? pa->argv[0] : shell + 1;
+    if (strcmp(shell, "sh") != 0 && strcmp(shell, "bash") != 0 &&
+            strcmp(shell, "dash") != 0)
+        return 0;
+
+    if (!is_shell_free(pa->argv[2]))
+        return 0;
+
+    if (parse_argstring(direct, pa->argv[2]) < 0)
+        return -1;
+    /* nothing to run, a variable assignment or a shell word needs the shell
+     * after all */
+    bool needs_shell = direct->argc == 0 || strchr(direct->argv[0], '=') != NULL;
+    for (int i = 0; shell_words[i] != NULL && !needs_shell; i++)
+        needs_shell = strcmp(direct->argv[0], shell_words[i]) == 0;
+    if (needs_shell) {
+        free_argstring(direct);
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * Returns an array of 2 _new_ strings, splitting edge_ro on PORT_DELIMITER.
  * If there is no PORT_DELIMITER, set return[1] to STDIO_PORT.
@@ -1,13 +1,23 @@
 #ifndef HP4_STRUTIL_H
 #define HP4_STRUTIL_H
 
+#include <stdbool.h>
+
 struct argstruct {
     int argc;
     char **argv;
+    /* Copy of the parsed string, which argv points into */
+    char *words;
 };
 
 int parse_argstring(struct argstruct *pa, const char *args);
 
+void free_argstring(struct argstruct *pa);
+
+bool is_shell_free(const char *cmd);
+
+int unwrap_shell(const struct argstruct *pa, struct argstruct *direct);
+
 char **parse_edge_string(const char *edge_ro);
 
 char *strrep(const char *original, const char *replace, const char *with);
@@ -0,0 +1,227 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* HAVE_IO_URING */
+
+#include "debug.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+bool uring_supported(void) {
+    return true;
+}
+
+int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+/**
+ * Maps the submission and completion rings of a newly set up io_uring.
+ */
+int uring_map(struct uring *r, struct io_uring_params *p) {
+    r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    }
+    else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p->sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p->sq_off.array);
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p->cq_off.ring_mask);
+    r->cqes = cq + p->cq_off.cqes;
+    return 0;
+}
+
+/**
+ * Sets up an io_uring with room for the given number of operations.
+ *
+ * On error (e.g. the kernel lacks io_uring, or it is disabled): returns NULL
+ * with errno set, so that the caller can fall back to system calls.
+ */
+struct uring *uring_new(unsigned int entries) {
+    struct uring *r = calloc(1u, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        int saved_errno = errno;
+        free(r);
+        errno = saved_errno;
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+
+    if (uring_map(r, &p) < 0) {
+        int saved_errno = errno;
+        uring_free(r);
+        errno = saved_errno;
+        return NULL;
+    }
+    return r;
+}
+
+void uring_free(struct uring *r) {
+    if (r == NULL)
+        return;
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * Fills the next submission queue entry with op, tagged with its index.
+ */
+void uring_prep(struct uring *r, struct uring_op *op, unsigned int index) {
+    unsigned int tail = *r->sq_tail;
+    unsigned int slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)r->sqes + slot;
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = op->opcode == URING_TEE ? IORING_OP_TEE : IORING_OP_SPLICE;
+    sqe->fd = op->fd_out;
+    sqe->splice_fd_in = op->fd_in;
+    sqe->len = (unsigned int)op->len;
+    sqe->splice_flags = op->flags;
+    if (op->opcode == URING_SPLICE) {
+        /* neither end is seekable; use the file positions */
+        sqe->off = (__u64)-1;
+        sqe->splice_off_in = (__u64)-1;
+    }
+    sqe->user_data = index;
+
+    r->sq_array[slot] = slot;
+    __atomic_store_n(r->sq_tail, tail + 1u, __ATOMIC_RELEASE);
+}
+
+/**
+ * Runs n operations, submitting as many at once as the ring holds, and
+ * waits for them all to complete. Each op's res is set to its result.
+ *
+ * The operations in one submission run concurrently, so they must not
+ * depend on each other.
+ *
+ * On error (the ring itself failed): returns -1; ops not known to have
+ * completed are left with res -EINPROGRESS.
+ */
+int uring_run(struct uring *r, struct uring_op *ops, size_t n) {
+    for (size_t i = 0u; i < n; i++)
+        ops[i].res = -EINPROGRESS;
+    size_t done = 0u;
+    while (done < n) {
+        unsigned int batch = n - done < r->entries ?
+                             (unsigned int)(n - done) : r->entries;
+        for (unsigned int i = 0u; i < batch; i++)
+            uring_prep(r, &ops[done + i], (unsigned int)(done + i));
+
+        unsigned int to_submit = batch;
+        unsigned int completed = 0u;
+        while (completed < batch) {
+            int ret = sys_io_uring_enter(r->fd, to_submit, batch - completed,
+                                         IORING_ENTER_GETEVENTS);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                REPORT_ERRORF("%s", strerror(errno));
+                return -1;
+            }
+            to_submit -= (unsigned int)ret < to_submit ? (unsigned int)ret : to_submit;
+
+            unsigned int head = *r->cq_head;
+            unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            while (head != tail) {
+                struct io_uring_cqe *cqe = (struct io_uring_cqe *)r->cqes +
+                                           (head & *r->cq_mask);
+                if (cqe->user_data < n)
+                    ops[cqe->user_data].res = cqe->res;
+                head++;
+                completed++;
+            }
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+        done += batch;
+    }
+    return 0;
+}
+
+#else /* HAVE_IO_URING */
+
+bool uring_supported(void) {
+    return false;
+}
+
+struct uring *uring_new(unsigned int entries) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_free(struct uring *r) {
+    return;
+}
+
+int uring_run(struct uring *r, struct uring_op *ops, size_t n) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_IO_URING */
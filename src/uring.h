@@ -0,0 +1,63 @@
+#ifndef HP4_URING_H
+#define HP4_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/* Number of operations submitted to the kernel at once */
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256
+#endif /* URING_ENTRIES */
+
+enum uring_opcode {
+    URING_SPLICE,
+    URING_TEE
+};
+
+/* A splice(2) or tee(2) to run through io_uring */
+struct uring_op {
+    enum uring_opcode opcode;
+    int fd_in;
+    int fd_out;
+    size_t len;
+    unsigned int flags;
+
+    /* Set once run: bytes moved, or -errno (-EINPROGRESS if the ring
+     * failed before it completed) */
+    ssize_t res;
+};
+
+/* An io_uring instance, set up with raw system calls so that hp4 does not
+ * depend on liburing */
+struct uring {
+    int fd;
+    unsigned int entries;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+};
+
+bool uring_supported(void);
+
+struct uring *uring_new(unsigned int entries);
+
+void uring_free(struct uring *r);
+
+int uring_run(struct uring *r, struct uring_op *ops, size_t n);
+
+#endif /* HP4_URING_H */
@@ -5,7 +5,9 @@
 #include <string.h>
 
 #include "debug.h"
+#include "file_node.h"
 #include "parser.h"
+#include "record_node.h"
 
 bool validate_p4_file(struct p4_file *pf) {
     /* There is at least 1 node and edge. */
@@ -47,6 +49,21 @@ bool validate_p4_file(struct p4_file *pf) {
             return false;
         }
 
+        /* Node with type INFILE or OUTFILE has the name of its file */
+        if ((strcmp(node->type, "INFILE") == 0 || strcmp(node->type, "OUTFILE") == 0) &&
+                node->name == NULL) {
+            REPORT_ERRORF("Node %s is type %s but does not have a name.",
+                          node->id, node->type);
+            return false;
+        }
+
+        /* Only a regular file can be read from an offset */
+        if (strcmp(node->type, "INFILE") == 0 && node->name != NULL &&
+                node->offset > 0u && !file_is_regular(node->name, true)) {
+            REPORT_ERRORF("Node %s has an offset, but %s is not a regular file.",
+                          node->id, node->name);
+            return false;
+        }
     }
 
     for (int j = 0; j < (int)pf->edges->length; j++) {
@@ -109,8 +126,23 @@ bool validate_p4_file(struct p4_file *pf) {
             struct p4_node *node = p4_file_get_node(pf, k);
             if (strcmp(edge->from, node->id) == 0) {
                 found_from = true;
+                /* OUTFILE nodes only have input */
+                if (strcmp(node->type, "OUTFILE") == 0) {
+                    REPORT_ERRORF("Edge %s comes from node %s, but it is type OUTFILE.",
+                           edge->id, edge->from);
+                    return false;
+                }
+                /* file nodes have no cmd, so only their stdio port; a
+                 * record node's ports are named by its edges alone */
+                if (node->cmd == NULL && !node_is_record(node) &&
+                        strcmp(edge->from_port, STDIO_PORT) != 0) {
+                    REPORT_ERRORF("Edge %s has port named %s from node %s,"
+                           " but the node has no cmd for it to be in.",
+                           edge->id, edge->from_port, edge->from);
+                    return false;
+                }
                 /* if port is not "-", port exists at least once in node->cmd */
-                if (strcmp(edge->from_port, STDIO_PORT) != 0) {
+                if (!node_is_record(node) && strcmp(edge->from_port, STDIO_PORT) != 0) {
                     char *port_loc = strstr(node->cmd, edge->from_port);
                     if (port_loc == NULL) {
                         REPORT_ERRORF("Edge %s has port named %s from node %s,"
@@ -129,8 +161,21 @@ bool validate_p4_file(struct p4_file *pf) {
 
             if (strcmp(edge->to, node->id) == 0) {
                 found_to = true;
+                /* INFILE nodes only have output */
+                if (strcmp(node->type, "INFILE") == 0) {
+                    REPORT_ERRORF("Edge %s goes to node %s, but it is type INFILE.",
+                           edge->id, edge->to);
+                    return false;
+                }
+                if (node->cmd == NULL && !node_is_record(node) &&
+                        strcmp(edge->to_port, STDIO_PORT) != 0) {
+                    REPORT_ERRORF("Edge %s has port named %s to node %s,"
+                           " but the node has no cmd for it to be in.",
+                           edge->id, edge->to_port, edge->to);
+                    return false;
+                }
                 /* if port is not "-", port exists at least once in node->cmd */
-                if (strcmp(edge->to_port, STDIO_PORT) != 0) {
+                if (!node_is_record(node) && strcmp(edge->to_port, STDIO_PORT) != 0) {
                     char *port_loc = strstr(node->cmd, edge->to_port);
                     if (port_loc == NULL) {
                         REPORT_ERRORF("Edge %s has port named %s to node %s,"
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+"""
+Times hp4 relaying a file to 2, 4 and 8 branches tee'd from one pipe.
+
+Each branch's node discards its input, so that the time is spent in hp4.
+Run from the test directory after building, e.g.
+
+    ./bench_tee.py --size 1073741824 --runs 5
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import file_gen
+
+script_path = os.path.realpath(__file__)
+script_dir = os.path.dirname(script_path)
+
+
+def tee_graph(n, infile):
+    nodes = [{"id": "src", "type": "EXEC", "cmd": "cat " + infile}]
+    edges = []
+    for i in range(n):
+        nodes.append({"id": "sink%d" % i, "type": "EXEC",
+                      "cmd": "bash -c 'cat > /dev/null'"})
+        edges.append({"id": "edge%d" % i, "from": "src", "to": "sink%d" % i})
+    return {"nodes": nodes, "edges": edges}
+
+
+def run(hp4, graph_file, size, n):
+    start = time.monotonic()
+    out = subprocess.run([hp4, "-i", "1000000", "-f", graph_file],
+                         stdout=subprocess.PIPE, check=True).stdout
+    elapsed = time.monotonic() - start
+    stats = json.loads(out.decode().strip().splitlines()[-1])
+    for i in range(n):
+        if stats["edge%d" % i] != size:
+            sys.exit("edge%d moved %d of %d bytes" %
+                     (i, stats["edge%d" % i], size))
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--hp4", default=script_dir + "/../src/hp4")
+    parser.add_argument("--size", type=int, default=file_gen.LENGTH)
+    parser.add_argument("--runs", type=int, default=3)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        infile = os.path.join(tmp, "input.txt")
+        file_gen.generate_testfile(infile, args.size)
+        size = os.path.getsize(infile)
+
+        print("branches  best(s)  MB/s in  MB/s out")
+        for n in [2, 4, 8]:
+            graph_file = os.path.join(tmp, "tee%d.json" % n)
+            with open(graph_file, "w") as f:
+                json.dump(tee_graph(n, infile), f)
+            best = min(run(args.hp4, graph_file, size, n)
+                       for _ in range(args.runs))
+            print("%8d  %7.3f  %7.0f  %8.0f" %
+                  (n, best, size / best / 1e6, n * size / best / 1e6))
+
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,8 @@
 import json
 import os
 import sys
+import threading
+import time
 
 import pexpect
 import pytest
@@ -31,6 +33,24 @@ def test_smallfile():
     os.remove(script_dir + "/data/smallfile_A.txt")
 
 
+def test_detailed_stats():
+    """
+    Tests that --detailed-stats nests the edge counts under "edges", beside
+    hp4's own stats, rather than listing only the edge counts.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/smallfile.json")
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    assert out[-1]["edges"] == {"cat-to-sed": 50, "sed-to-save": 50}
+    assert out[-1]["startup_us"] > 0
+    assert sorted(out[-1]["launch"]) == ["cat", "save", "sed"]
+
+    os.remove(script_dir + "/data/smallfile_A.txt")
+
+
 def test_largefile():
     child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
                           script_dir + "/data/largefile.json")
@@ -104,6 +124,572 @@ def test_join_with_ports():
     os.remove(script_dir + "/data/diff_output.txt")
 
 
+
+def test_launch_rate():
+    """
+    Tests that nodes are started no faster than --launch-rate allows, and
+    that each one's time to exec is reported.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -r 20 -f " +
+                          script_dir + "/data/join_with_ports.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    assert out[-1]["edges"]["diff-to-save"] == 112
+    assert sorted(out[-1]["launch"]) == ["cat", "diff", "save", "sed"]
+    assert all(us > 0 for us in out[-1]["launch"].values())
+    # four nodes at 20 a second: the last starts 150ms after the first
+    assert out[-1]["startup_us"] >= 150000
+
+    os.remove(script_dir + "/data/diff_output.txt")
+
+def test_argv():
+    """
+    Tests nodes whose cmd is an argv array, and a `bash -c` cmd which is
+    run without the shell.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
+                          script_dir + "/data/argv.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    assert out[-1]["cat-to-sed"] == 50
+    assert out[-1]["sed-to-save"] == 50
+
+    with open(script_dir + "/data/smallfile.txt", 'r') as f:
+        expected = f.read().replace('a', 'A')
+    with open(script_dir + "/data/argv_output.txt", 'r') as f:
+        assert f.read() == expected
+
+    os.remove(script_dir + "/data/argv_output.txt")
+
+
+
+def test_scatter():
+    """
+    Tests that a SCATTER node deals whole lines out between two workers in
+    turn.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/scatter.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        lines = f.readlines()
+    shards = out[-1]["records"]["split"]
+    assert shards["a"]["records"] == (len(lines) + 1) // 2
+    assert shards["b"]["records"] == len(lines) // 2
+    assert shards["a"]["bytes"] + shards["b"]["bytes"] == size
+    assert out[-1]["edges"]["split-to-upa"] == shards["a"]["bytes"]
+
+    for shard in ["a", "b"]:
+        fname = script_dir + "/data/scatter_" + shard + ".txt"
+        with open(fname, 'r') as f:
+            got = f.readlines()
+        assert len(got) == shards[shard]["records"]
+        assert all(line == lines[0].replace('a', 'A') for line in got)
+        os.remove(fname)
+
+def test_scatter_gather():
+    """
+    Tests that a GATHER node puts the lines which a SCATTER node dealt out
+    between three workers back into their original order.
+    """
+    fname = script_dir + "/data/numbered.txt"
+    with open(fname, 'w') as f:
+        for i in range(100000):
+            f.write(str(i) + "\n")
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/scatter_gather.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    shards = out[-1]["records"]["join"]
+    assert sum(shards[s]["records"] for s in ["a", "b", "c"]) == 100000
+    assert out[-1]["records"]["split"]["a"]["records"] == 33334
+
+    oname = script_dir + "/data/scatter_gather_output.txt"
+    with open(oname, 'r') as f:
+        got = f.read().splitlines()
+    assert got == [str(i) + " done" for i in range(100000)]
+    os.remove(oname)
+    os.remove(fname)
+
+def test_partition():
+    """
+    Tests that a PARTITION node sends all of the lines with the same key to
+    the same output, in their original order.
+    """
+    fname = script_dir + "/data/keyed.txt"
+    with open(fname, 'w') as f:
+        for i in range(200000):
+            f.write(str(i) + "\tchr" + str(i % 25) + "\tACGT\n")
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/partition.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    buckets = out[-1]["records"]["part"]
+    assert sum(buckets[b]["records"] for b in ["a", "b", "c"]) == 200000
+    assert (sum(buckets[b]["bytes"] for b in ["a", "b", "c"]) ==
+            os.path.getsize(fname))
+
+    seen = {}
+    for b in ["a", "b", "c"]:
+        oname = script_dir + "/data/partition_" + b + ".txt"
+        with open(oname, 'r') as f:
+            lines = f.read().splitlines()
+        assert len(lines) == buckets[b]["records"]
+        numbers = [int(line.split("\t")[0]) for line in lines]
+        assert numbers == sorted(numbers)
+        for line in lines:
+            key = line.split("\t")[1]
+            assert seen.setdefault(key, b) == b
+        os.remove(oname)
+    assert len(seen) == 25
+    os.remove(fname)
+
+def test_merge():
+    """
+    Tests that a MERGE node merges four files, each sorted by a numeric
+    field, into one sorted stream.
+    """
+    values = list(range(0, 400000, 3))
+    shards = [[v for v in values if (v * 2654435761 >> 16) % 4 == i]
+              for i in range(4)]
+    for i in range(4):
+        with open(script_dir + "/data/merge_" + str(i) + ".txt", 'w') as f:
+            for v in shards[i]:
+                f.write("r" + str(v) + "\t" + str(v) + "\n")
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/merge.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    inputs = out[-1]["records"]["merge"]
+    for i, port in enumerate(["a", "b", "c", "d"]):
+        assert inputs[port]["records"] == len(shards[i])
+        os.remove(script_dir + "/data/merge_" + str(i) + ".txt")
+
+    oname = script_dir + "/data/merge_output.txt"
+    with open(oname, 'r') as f:
+        got = f.read().splitlines()
+    assert got == ["r" + str(v) + "\t" + str(v) for v in sorted(values)]
+    os.remove(oname)
+
+def test_replicas():
+    """
+    Tests that a node with replicas runs that many copies of its command,
+    each on a share of the lines, which are put back in order.
+    """
+    fname = script_dir + "/data/replicas_input.txt"
+    with open(fname, 'w') as f:
+        for i in range(50000):
+            f.write(str(i) + "\n")
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/replicas.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(fname)
+    assert out[-1]["edges"]["read-to-work"] == size
+    for i in range(1, 5):
+        assert out[-1]["edges"]["work.split-to-work." + str(i)] > 0
+        assert out[-1]["edges"]["work." + str(i) + "-to-work.join"] > 0
+    assert out[-1]["records"]["work.split"]["1"]["records"] == 12500
+    assert out[-1]["records"]["work.join"]["4"]["records"] == 12500
+
+    oname = script_dir + "/data/replicas_output.txt"
+    with open(oname, 'r') as f:
+        got = f.read().splitlines()
+    assert got == [str(i) + " done" for i in range(50000)]
+    os.remove(oname)
+    os.remove(fname)
+
+def test_fan_in():
+    """
+    Tests that the edges into a port with concatenating fan-in have their
+    data passed on whole, one after another, in the order of the edges.
+    """
+    fnames = [script_dir + "/data/fan_in_" + str(i) + ".txt" for i in range(3)]
+    expected = ""
+    for i, fname in enumerate(fnames):
+        data = "".join(str(i) + " " + str(j) + "\n" for j in range(100000))
+        with open(fname, 'w') as f:
+            f.write(data)
+        expected += data
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
+                          script_dir + "/data/fan_in.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    for i, fname in enumerate(fnames):
+        assert out[-1]["read" + str(i) + "-to-cat"] == os.path.getsize(fname)
+    assert out[-1]["cat.fan_in-to-cat"] == len(expected)
+
+    oname = script_dir + "/data/fan_in_output.txt"
+    with open(oname, 'r') as f:
+        assert f.read() == expected
+    os.remove(oname)
+    for fname in fnames:
+        os.remove(fname)
+
+def test_buffered_tee():
+    """
+    Tests that a buffered edge lets its sibling in a tee run ahead.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -i 100 -f " +
+                          script_dir + "/data/buffered_tee.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    # fast branch finished while slow branch was still sleeping
+    assert any(o["cat-to-fast"] == size and o["cat-to-slow"] < size
+               for o in out)
+    assert out[-1]["cat-to-fast"] == size
+    assert out[-1]["cat-to-slow"] == size
+
+    for branch in ["fast", "slow"]:
+        fname = script_dir + "/data/buffered_tee_" + branch + ".txt"
+        assert os.path.getsize(fname) == size
+        os.remove(fname)
+
+
+def test_spill_tee():
+    """
+    Tests that an edge which falls behind spills to disk rather than
+    holding back its sibling in a tee.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -i 100 -f " +
+                          script_dir + "/data/spill_tee.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert any(o["edges"]["cat-to-fast"] == size and
+               o["edges"]["cat-to-slow"] < size for o in out)
+    assert out[-1]["edges"]["cat-to-fast"] == size
+    assert out[-1]["edges"]["cat-to-slow"] == size
+    # everything beyond what fit in the slow edge's pipe and its 64KiB
+    # high-water mark was spilled
+    assert out[-1]["spill"]["cat-to-slow"]["bytes"] > 0
+    assert out[-1]["spill"]["cat-to-slow"]["peak"] > 0
+    assert any(o["spill"]["cat-to-slow"]["rate"] > 0 for o in out)
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["fast", "slow"]:
+        fname = script_dir + "/data/spill_tee_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+
+
+def test_pipe_size():
+    """
+    Tests that an edge with a pipe_size, run under a pipe memory budget,
+    still delivers all of its data.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -m 1048576 -f " +
+                          script_dir + "/data/pipe_size.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert out[-1]["cat-to-save"] == size
+
+    fname = script_dir + "/data/pipe_size_out.txt"
+    assert os.path.getsize(fname) == size
+    os.remove(fname)
+
+
+def test_chunked():
+    """
+    Tests that edges with their own chunk and batch sizes, both single and
+    tee'd, deliver all of their data.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
+                          script_dir + "/data/chunked.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    for edge in ["cat-to-copy", "copy-to-savea", "copy-to-saveb"]:
+        assert out[-1][edge] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["a", "b"]:
+        fname = script_dir + "/data/chunked_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+
+
+def test_io_uring():
+    """
+    Tests that relaying through io_uring, or falling back to system calls
+    where io_uring is unavailable, delivers all of the data.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -u -f " +
+                          script_dir + "/data/chunked.json")
+
+    out = []
+    for line in child:
+        line = line.decode()
+        if line.startswith("{"):
+            out.append(json.loads(line))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    for edge in ["cat-to-copy", "copy-to-savea", "copy-to-saveb"]:
+        assert out[-1][edge] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["a", "b"]:
+        fname = script_dir + "/data/chunked_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+
+
+def test_relay_threads():
+    """
+    Tests that sharing edges out between relay threads delivers all of the
+    data, with a tee'd pipe's edges kept together on one thread.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -t 2 -f " +
+                          script_dir + "/data/chunked.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    for edge in ["cat-to-copy", "copy-to-savea", "copy-to-saveb"]:
+        assert out[-1][edge] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["a", "b"]:
+        fname = script_dir + "/data/chunked_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+
+
+def test_direct():
+    """
+    Tests that a 1:1 edge wired directly between nodes, and so counted from
+    its producer, reports the same count as an edge relayed for exact counts.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
+                          script_dir + "/data/direct.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert out[-1]["cat-to-copy"] == size
+    assert out[-1]["copy-to-save"] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    with open(script_dir + "/data/direct.txt", 'r') as f:
+        assert f.read() == expected
+    os.remove(script_dir + "/data/direct.txt")
+
+
+def test_infile():
+    """
+    Tests that INFILE nodes, run by hp4 itself, deliver a whole file to
+    tee'd edges and a byte range of it to a direct edge.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/infile.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert out[-1]["edges"]["read-to-savea"] == size
+    assert out[-1]["edges"]["read-to-saveb"] == size
+    assert out[-1]["edges"]["range-to-saverange"] == 1000
+    assert out[-1]["files"]["read"]["bytes"] == size
+    assert out[-1]["files"]["range"]["bytes"] == 1000
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["a", "b"]:
+        fname = script_dir + "/data/infile_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+    fname = script_dir + "/data/infile_range.txt"
+    with open(fname, 'r') as f:
+        assert f.read() == expected[100:1100]
+    os.remove(fname)
+
+
+def test_infile_fifo():
+    """
+    Tests that an INFILE node reads all of a FIFO, which has no offsets,
+    from a writer which pauses part way through.
+    """
+    fname = script_dir + "/data/infile_fifo"
+    if os.path.exists(fname):
+        os.remove(fname)
+    os.mkfifo(fname)
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+
+    def feed():
+        with open(fname, 'w') as f:
+            f.write(expected[:len(expected) // 2])
+            f.flush()
+            time.sleep(0.5)
+            f.write(expected[len(expected) // 2:])
+    writer = threading.Thread(target=feed)
+    writer.start()
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/infile_fifo.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+    writer.join()
+    os.remove(fname)
+
+    assert out[-1]["edges"]["read-to-save"] == len(expected)
+    assert out[-1]["files"]["read"]["bytes"] == len(expected)
+    oname = script_dir + "/data/infile_fifo.txt"
+    with open(oname, 'r') as f:
+        assert f.read() == expected
+    os.remove(oname)
+
+
+def test_infile_fifo_node():
+    """
+    Tests that an INFILE node reads a FIFO written by another node of the
+    same graph, which is only started after the FIFO is opened.
+    """
+    fname = script_dir + "/data/infile_fifo_node"
+    if os.path.exists(fname):
+        os.remove(fname)
+    os.mkfifo(fname)
+
+    child = pexpect.spawn(script_dir + "/../src/hp4 -f " +
+                          script_dir + "/data/infile_fifo_node.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+    os.remove(fname)
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert out[-1]["src-to-feed"] == size
+    assert out[-1]["read-to-save"] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    oname = script_dir + "/data/infile_fifo_node.txt"
+    with open(oname, 'r') as f:
+        assert f.read() == expected
+    os.remove(oname)
+
+
+def test_outfile():
+    """
+    Tests that OUTFILE nodes, run by hp4 itself, write out all of the data
+    from a process and from an INFILE node.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/outfile.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    for edge in ["cat-to-sed", "sed-to-save", "read-to-copy"]:
+        assert out[-1]["edges"][edge] == size
+    assert out[-1]["files"]["save"]["bytes"] == size
+    assert out[-1]["files"]["save"]["flush_us"] >= 0
+    assert out[-1]["files"]["copy"]["bytes"] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    fname = script_dir + "/data/outfile_A.txt"
+    with open(fname, 'r') as f:
+        assert f.read() == expected.replace("a", "A")
+    os.remove(fname)
+    fname = script_dir + "/data/outfile_copy.txt"
+    with open(fname, 'r') as f:
+        assert f.read() == expected
+    os.remove(fname)
+
+
+def test_copy():
+    """
+    Tests that edges from an INFILE node to OUTFILE nodes, which are copied
+    within the kernel, copy all of the file.
+    """
+    child = pexpect.spawn(script_dir + "/../src/hp4 -s -f " +
+                          script_dir + "/data/copy.json")
+
+    out = []
+    for line in child:
+        out.append(json.loads(line.decode()))
+
+    size = os.path.getsize(script_dir + "/data/mediumfile.txt")
+    assert out[-1]["edges"]["read-to-savea"] == size
+    assert out[-1]["edges"]["read-to-saveb"] == size
+    assert out[-1]["files"]["read"]["bytes"] == size
+
+    with open(script_dir + "/data/mediumfile.txt", 'r') as f:
+        expected = f.read()
+    for branch in ["a", "b"]:
+        fname = script_dir + "/data/copy_" + branch + ".txt"
+        with open(fname, 'r') as f:
+            assert f.read() == expected
+        os.remove(fname)
+
+
 def test_head():
     """
     Tests that hp4 correctly closes a node's output when its
@@ -128,10 +714,12 @@ def test_head():
 if __name__ == "__main__":
     file_gen.generate_largefile(script_dir + "/data/")
     file_gen.generate_testfile(script_dir + "/data/smallfile.txt", 51)
+    file_gen.generate_testfile(script_dir + "/data/mediumfile.txt", 1048576)
 
     i = pytest.main(["-v", script_path])
 
     os.remove(script_dir + "/data/largefile.txt")
     os.remove(script_dir + "/data/smallfile.txt")
+    os.remove(script_dir + "/data/mediumfile.txt")
 
     sys.exit(i)
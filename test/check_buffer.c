@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "../src/buffer.h"
+
+START_TEST(test_ring_buffer_append) {
+    int success;
+
+    struct ring_buffer *rb = ring_buffer_new(8u);
+    ck_assert(rb != NULL);
+    ck_assert(ring_buffer_is_empty(rb));
+    ck_assert_uint_eq(ring_buffer_space(rb), 8u);
+
+    success = ring_buffer_append(rb, "abcde", 5u);
+    ck_assert_int_eq(success, 0);
+    ck_assert(!ring_buffer_is_empty(rb));
+    ck_assert_uint_eq(ring_buffer_space(rb), 3u);
+
+    /* does not fit; buffer is unchanged */
+    success = ring_buffer_append(rb, "fghij", 5u);
+    ck_assert_int_eq(success, -1);
+    ck_assert_uint_eq(ring_buffer_space(rb), 3u);
+
+    success = ring_buffer_append(rb, "fgh", 3u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_uint_eq(ring_buffer_space(rb), 0u);
+
+    ring_buffer_free(rb);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_wraparound) {
+    int success;
+    ssize_t bytes;
+    char buf[16] = {'\0'};
+
+    int pipe_fds[2] = {0, 0};
+    success = pipe(pipe_fds);
+    ck_assert_int_eq(success, 0);
+
+    struct ring_buffer *rb = ring_buffer_new(8u);
+    ck_assert(rb != NULL);
+
+    success = ring_buffer_append(rb, "abcdef", 6u);
+    ck_assert_int_eq(success, 0);
+    bytes = ring_buffer_write_to_fd(rb, pipe_fds[1]);
+    ck_assert_int_eq(bytes, 6);
+    ck_assert(ring_buffer_is_empty(rb));
+    bytes = read(pipe_fds[0], buf, sizeof(buf));
+    ck_assert_int_eq(bytes, 6);
+
+    /* data now starts at the front of the buffer again; fill it, drain part
+     * of it, then append across the end of the underlying array */
+    success = ring_buffer_append(rb, "01234567", 8u);
+    ck_assert_int_eq(success, 0);
+    rb->head = 5u;
+    rb->length = 3u;
+    success = ring_buffer_append(rb, "89ab", 4u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_uint_eq(ring_buffer_space(rb), 1u);
+
+    bytes = ring_buffer_write_to_fd(rb, pipe_fds[1]);
+    ck_assert_int_eq(bytes, 7);
+    ck_assert(ring_buffer_is_empty(rb));
+
+    memset(buf, 0, sizeof(buf));
+    bytes = read(pipe_fds[0], buf, sizeof(buf));
+    ck_assert_int_eq(bytes, 7);
+    ck_assert_str_eq(buf, "56789ab");
+
+    ring_buffer_free(rb);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+END_TEST
+
+Suite *buffer_suite(void) {
+    Suite *s = suite_create("buffer");
+
+    TCase *tc_ring_buffer = tcase_create("ring buffer");
+    tcase_add_test(tc_ring_buffer, test_ring_buffer_append);
+    tcase_add_test(tc_ring_buffer, test_ring_buffer_wraparound);
+    suite_add_tcase(s, tc_ring_buffer);
+
+    return s;
+}
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <event2/event.h>
+
+#include "../src/event_handlers.h"
+#include "../src/file_node.h"
+#include "../src/parser.h"
+#include "../src/pipe.h"
+
+START_TEST(test_infile_range) {
+    struct p4_file *pf = p4_file_new("data/infile.json");
+    ck_assert(pf != NULL);
+    struct p4_node *range = find_node_by_id(pf, "range");
+    ck_assert(range != NULL);
+    ck_assert_uint_eq(range->offset, 100u);
+    ck_assert_uint_eq(range->length, 1000u);
+
+    /* read only a few bytes of a file which is in the tree */
+    free(range->name);
+    range->name = strdup("data/basic.json");
+    range->offset = 2u;
+    range->length = 24u;
+
+    ck_assert_int_eq(pipe_array_append_new(range->out_pipes, "-", "range-to-saverange"), 0);
+    struct pipe *p = get_pipe(range->out_pipes, 0);
+    p->direct = true;
+    /* an edge may lower the default, not just raise it */
+    find_edge_by_id(pf, "range-to-saverange")->chunk_size = 4096u;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+
+    range->file = file_node_new(pf, range, eb, &sa);
+    ck_assert(range->file != NULL);
+    ck_assert_uint_eq(range->file->chunk_size, 4096u);
+    ck_assert_uint_eq(range->file->batch_size, DEFAULT_BATCH_SIZE);
+    while (!range->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa.n_children_exited, 1);
+    ck_assert(!p->write_fd_is_open);
+    ck_assert_int_eq(range->file->bytes, 24);
+    /* the edge is direct, so counted by the node */
+    ck_assert_int_eq(find_edge_by_id(pf, "range-to-saverange")->bytes_spliced, 24);
+
+    char expected[25] = {'\0'};
+    FILE *f = fopen("data/basic.json", "r");
+    ck_assert(f != NULL);
+    ck_assert_int_eq(fseek(f, 2L, SEEK_SET), 0);
+    ck_assert_uint_eq(fread(expected, 1u, 24u, f), 24u);
+    fclose(f);
+
+    char buf[64] = {'\0'};
+    ck_assert_int_eq(read(p->read_fd, buf, sizeof(buf)), 24);
+    ck_assert_str_eq(buf, expected);
+    ck_assert_int_eq(read(p->read_fd, buf, sizeof(buf)), 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_infile_missing) {
+    struct p4_file *pf = p4_file_new("data/infile.json");
+    ck_assert(pf != NULL);
+    struct p4_node *read = find_node_by_id(pf, "read");
+    ck_assert(read != NULL);
+    free(read->name);
+    read->name = strdup("data/no_such_file.txt");
+    ck_assert_int_eq(pipe_array_append_new(read->out_pipes, "-", "read-to-savea"), 0);
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+    ck_assert(file_node_new(pf, read, eb, &sa) == NULL);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_outfile) {
+    struct p4_file *pf = p4_file_new("data/outfile.json");
+    ck_assert(pf != NULL);
+    struct p4_node *save = find_node_by_id(pf, "save");
+    ck_assert(save != NULL);
+    ck_assert_uint_eq(save->size, 1048576u);
+    ck_assert_uint_eq(save->write_behind, 262144u);
+    ck_assert(save->fsync);
+    free(save->name);
+    save->name = strdup("data/outfile_unit.txt");
+    save->write_behind = 4u;
+
+    ck_assert_int_eq(pipe_array_append_new(save->in_pipes, "-", "sed-to-save"), 0);
+    struct pipe *p = get_pipe(save->in_pipes, 0);
+    p->direct = true;
+    const char *data = "written by an OUTFILE node\n";
+    ck_assert_int_eq(write(p->write_fd, data, strlen(data)), (int)strlen(data));
+    ck_assert_int_eq(close(p->write_fd), 0);
+    p->write_fd_is_open = false;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+
+    save->file = file_node_new(pf, save, eb, &sa);
+    ck_assert(save->file != NULL);
+    while (!save->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa.n_children_exited, 1);
+    ck_assert(!p->read_fd_is_open);
+    ck_assert_int_eq(save->file->bytes, (int)strlen(data));
+    ck_assert_int_ge(save->file->flush_us, 0);
+    ck_assert_int_eq(find_edge_by_id(pf, "sed-to-save")->bytes_spliced, (int)strlen(data));
+
+    /* space allocated up front does not count towards the file's size */
+    char buf[64] = {'\0'};
+    FILE *f = fopen("data/outfile_unit.txt", "r");
+    ck_assert(f != NULL);
+    ck_assert_uint_eq(fread(buf, 1u, sizeof(buf) - 1u, f), strlen(data));
+    fclose(f);
+    ck_assert_str_eq(buf, data);
+    ck_assert_int_eq(remove("data/outfile_unit.txt"), 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+/**
+ * Reads all of a small file into buf, which must have room for a
+ * terminating NUL, returning its length.
+ */
+size_t read_small_file(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    ck_assert(f != NULL);
+    size_t len = fread(buf, 1u, size - 1u, f);
+    buf[len] = '\0';
+    fclose(f);
+    return len;
+}
+
+START_TEST(test_copy) {
+    struct p4_file *pf = p4_file_new("data/copy.json");
+    ck_assert(pf != NULL);
+    struct p4_node *read = find_node_by_id(pf, "read");
+    struct p4_node *savea = find_node_by_id(pf, "savea");
+    struct p4_node *saveb = find_node_by_id(pf, "saveb");
+    ck_assert(read != NULL && savea != NULL && saveb != NULL);
+    free(read->name);
+    read->name = strdup("data/basic.json");
+    read->offset = 2u;
+    read->length = 24u;
+    free(savea->name);
+    savea->name = strdup("data/copy_unit_a.txt");
+    free(saveb->name);
+    saveb->name = strdup("data/copy_unit_b.txt");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+
+    /* with no pipes, the nodes' edges are copied */
+    read->file = file_node_new(pf, read, eb, &sa);
+    savea->file = file_node_new(pf, savea, eb, &sa);
+    saveb->file = file_node_new(pf, saveb, eb, &sa);
+    ck_assert(read->file != NULL && savea->file != NULL && saveb->file != NULL);
+    /* as if copy_file_range(2) did not work between the files */
+    saveb->file->use_sendfile = true;
+    ck_assert_int_eq(file_node_add_copy(read->file, savea->file,
+                                        find_edge_by_id(pf, "read-to-savea")), 0);
+    ck_assert_int_eq(file_node_add_copy(read->file, saveb->file,
+                                        find_edge_by_id(pf, "read-to-saveb")), 0);
+    /* copy a few bytes per call, over several turns of the loop */
+    read->file->chunk_size = 5u;
+    read->file->batch_size = 10u;
+
+    while (!read->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa.n_children_exited, 3);
+    ck_assert_int_eq(read->file->bytes, 24);
+    ck_assert_int_eq(find_edge_by_id(pf, "read-to-savea")->bytes_spliced, 24);
+    ck_assert_int_eq(find_edge_by_id(pf, "read-to-saveb")->bytes_spliced, 24);
+
+    char expected[64];
+    char buf[64];
+    ck_assert_uint_gt(read_small_file("data/basic.json", expected, sizeof(expected)), 26u);
+    expected[26] = '\0';
+    ck_assert_uint_eq(read_small_file("data/copy_unit_a.txt", buf, sizeof(buf)), 24u);
+    ck_assert_str_eq(buf, expected + 2);
+    ck_assert_uint_eq(read_small_file("data/copy_unit_b.txt", buf, sizeof(buf)), 24u);
+    ck_assert_str_eq(buf, expected + 2);
+    ck_assert_int_eq(remove("data/copy_unit_a.txt"), 0);
+    ck_assert_int_eq(remove("data/copy_unit_b.txt"), 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *file_node_suite(void) {
+    Suite *s = suite_create("file node");
+
+    TCase *tc_infile = tcase_create("infile");
+    tcase_add_test(tc_infile, test_infile_range);
+    tcase_add_test(tc_infile, test_infile_missing);
+    suite_add_tcase(s, tc_infile);
+
+    TCase *tc_outfile = tcase_create("outfile");
+    tcase_add_test(tc_outfile, test_outfile);
+    suite_add_tcase(s, tc_outfile);
+
+    TCase *tc_copy = tcase_create("copy");
+    tcase_add_test(tc_copy, test_copy);
+    suite_add_tcase(s, tc_copy);
+
+    return s;
+}
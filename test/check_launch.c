@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include <check.h>
+
+#include "../src/launch.h"
+#include "../src/parser.h"
+#include "../src/pipe.h"
+
+START_TEST(test_argv_ports) {
+    struct p4_file *pf = p4_file_new("data/join_with_ports.json");
+    ck_assert(pf != NULL);
+    struct p4_node *diff = find_node_by_id(pf, "diff");
+    ck_assert_int_eq(pipe_array_append_new(diff->out_pipes, "-", "diff-to-save"), 0);
+    ck_assert_int_eq(pipe_array_append_new(diff->in_pipes, "INPUT_UNMOD", "cat-to-diff"), 0);
+    ck_assert_int_eq(pipe_array_append_new(diff->in_pipes, "INPUT_CAP_A", "sed-to-diff"), 0);
+
+    /* ports are numbered on from stderr, in the order of the node's pipes */
+    ck_assert_int_eq(node_pipe_fd(diff, get_pipe(diff->out_pipes, 0)), STDOUT_FILENO);
+    ck_assert_int_eq(node_pipe_fd(diff, get_pipe(diff->in_pipes, 0)), 3);
+    ck_assert_int_eq(node_pipe_fd(diff, get_pipe(diff->in_pipes, 1)), 4);
+    ck_assert_int_eq(node_fd_count(diff), 5);
+
+    ck_assert_int_eq(node_argv_compile(diff), 0);
+    ck_assert_str_eq(diff->exec_argv[0], "diff");
+    ck_assert_str_eq(diff->exec_argv[1], "/dev/fd/3");
+    ck_assert_str_eq(diff->exec_argv[2], "/dev/fd/4");
+    ck_assert(diff->exec_argv[3] == NULL);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_argv_forms) {
+    struct p4_file *pf = p4_file_new("data/argv.json");
+    ck_assert(pf != NULL);
+
+    /* a cmd array keeps its words, with ports filled in within them */
+    struct p4_node *save = find_node_by_id(pf, "save");
+    ck_assert_int_eq(pipe_array_append_new(save->in_pipes, "_SAVE_IN_", "sed-to-save"), 0);
+    ck_assert_int_eq(node_argv_compile(save), 0);
+    ck_assert_str_eq(save->exec_argv[0], "dd");
+    ck_assert_str_eq(save->exec_argv[1], "if=/dev/fd/3");
+    ck_assert_str_eq(save->argv[1], "if=_SAVE_IN_");
+
+    /* a `bash -c` cmd which needs no shell is run without one */
+    struct p4_node *sed = find_node_by_id(pf, "sed");
+    ck_assert_int_eq(node_argv_compile(sed), 0);
+    ck_assert_str_eq(sed->exec_argv[0], "sed");
+    ck_assert_str_eq(sed->exec_argv[1], "-e");
+    ck_assert_str_eq(sed->exec_argv[2], "s/a/A/g");
+    ck_assert(sed->exec_argv[3] == NULL);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_spawn_node) {
+    struct p4_file *pf = p4_file_new("data/basic.json");
+    ck_assert(pf != NULL);
+    struct p4_node *pn = find_node_by_id(pf, "cat");
+    ck_assert(pn != NULL);
+    ck_assert_int_eq(pipe_array_append_new(pn->out_pipes, "-", "cat-to-save"), 0);
+    struct pipe *p = get_pipe(pn->out_pipes, 0);
+
+    /* the node's only fds above stderr are those it opens itself */
+    free(pn->cmd);
+    pn->cmd = strdup("ls /proc/self/fd");
+    ck_assert_int_eq(node_argv_compile(pn), 0);
+    pid_t pid = spawn_node(pn);
+    ck_assert_int_gt(pid, 0);
+    close(p->write_fd);
+    p->write_fd_is_open = false;
+
+    char buf[256];
+    size_t len = 0u;
+    ssize_t n;
+    while ((n = read(p->read_fd, buf + len, sizeof(buf) - 1u - len)) > 0)
+        len += (size_t)n;
+    buf[len] = '\0';
+    int status;
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (char *fd = strtok(buf, "\n"); fd != NULL; fd = strtok(NULL, "\n"))
+        ck_assert_int_le(atoi(fd), STDERR_FILENO + 1);
+
+    /* a port is opened through the node's own fd */
+    struct p4_node *save = find_node_by_id(pf, "save");
+    ck_assert_int_eq(pipe_array_append_new(save->out_pipes, "_OUT_", "cat-to-save"), 0);
+    struct pipe *port = get_pipe(save->out_pipes, 0);
+    free(save->cmd);
+    save->cmd = strdup("dd if=/dev/zero of=_OUT_ bs=10 count=1 status=none");
+    ck_assert_int_eq(node_argv_compile(save), 0);
+    pid = spawn_node(save);
+    ck_assert_int_gt(pid, 0);
+    close(port->write_fd);
+    port->write_fd_is_open = false;
+    len = 0u;
+    while ((n = read(port->read_fd, buf + len, sizeof(buf) - len)) > 0)
+        len += (size_t)n;
+    ck_assert_uint_eq(len, 10u);
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    free(pn->cmd);
+    pn->cmd = strdup("no_such_program_for_hp4");
+    ck_assert_int_eq(node_argv_compile(pn), 0);
+    ck_assert_int_eq(spawn_node(pn), -1);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_launch_order) {
+    struct p4_file *pf = p4_file_new("data/basic.json");
+    ck_assert(pf != NULL);
+    struct p4_node **order;
+    ck_assert_int_eq(plan_launch_order(pf, &order), 2);
+    ck_assert_str_eq(order[0]->id, "save");
+    ck_assert_str_eq(order[1]->id, "cat");
+    free(order);
+    free_p4_file(pf);
+
+    /* diff waits on both of its inputs being started before it */
+    pf = p4_file_new("data/join_with_ports.json");
+    ck_assert(pf != NULL);
+    ck_assert_int_eq(plan_launch_order(pf, &order), 4);
+    ck_assert_str_eq(order[0]->id, "save");
+    ck_assert_str_eq(order[1]->id, "diff");
+    ck_assert_str_eq(order[2]->id, "sed");
+    ck_assert_str_eq(order[3]->id, "cat");
+    free(order);
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *launch_suite(void) {
+    Suite *s = suite_create("launch");
+
+    TCase *tc_argv = tcase_create("argv");
+    tcase_add_test(tc_argv, test_argv_ports);
+    tcase_add_test(tc_argv, test_argv_forms);
+    suite_add_tcase(s, tc_argv);
+
+    TCase *tc_spawn = tcase_create("spawn");
+    tcase_add_test(tc_spawn, test_spawn_node);
+    tcase_add_test(tc_spawn, test_launch_order);
+    suite_add_tcase(s, tc_spawn);
+
+    return s;
+}
@@ -2,10 +2,19 @@
 
 #include <check.h>
 
+Suite *buffer_suite(void);
+Suite *file_node_suite(void);
+Suite *launch_suite(void);
 Suite *parser_suite(void);
 Suite *pipe_suite(void);
+Suite *pipe_budget_suite(void);
+Suite *record_node_suite(void);
+Suite *relay_threads_suite(void);
+Suite *replicas_suite(void);
+Suite *spill_suite(void);
 Suite *stats_suite(void);
 Suite *strutil_suite(void);
+Suite *uring_suite(void);
 Suite *validate_suite(void);
 
 int main(void) {
@@ -14,15 +23,42 @@ int main(void) {
     Suite *s_parser = parser_suite();
     SRunner *sr = srunner_create(s_parser);
 
+    Suite *s_buffer = buffer_suite();
+    srunner_add_suite(sr, s_buffer);
+
+    Suite *s_file_node = file_node_suite();
+    srunner_add_suite(sr, s_file_node);
+
+    Suite *s_launch = launch_suite();
+    srunner_add_suite(sr, s_launch);
+
     Suite *s_pipe = pipe_suite();
     srunner_add_suite(sr, s_pipe);
 
+    Suite *s_pipe_budget = pipe_budget_suite();
+    srunner_add_suite(sr, s_pipe_budget);
+
+    Suite *s_record_node = record_node_suite();
+    srunner_add_suite(sr, s_record_node);
+
+    Suite *s_relay_threads = relay_threads_suite();
+    srunner_add_suite(sr, s_relay_threads);
+
+    Suite *s_replicas = replicas_suite();
+    srunner_add_suite(sr, s_replicas);
+
+    Suite *s_spill = spill_suite();
+    srunner_add_suite(sr, s_spill);
+
     Suite *s_stats = stats_suite();
     srunner_add_suite(sr, s_stats);
 
     Suite *s_strutil = strutil_suite();
     srunner_add_suite(sr, s_strutil);
 
+    Suite *s_uring = uring_suite();
+    srunner_add_suite(sr, s_uring);
+
     Suite *s_validate = validate_suite();
     srunner_add_suite(sr, s_validate);
 
@@ -86,6 +86,97 @@ START_TEST(parse_ports_file) {
 }
 END_TEST
 
+START_TEST(parse_buffered_edge) {
+    struct p4_file *pf = p4_file_new("data/buffered_tee.json");
+    ck_assert(pf != NULL);
+    ck_assert_uint_eq(pf->edges->length, 2);
+
+    struct p4_edge *pe_fast = find_edge_by_id(pf, "cat-to-fast");
+    ck_assert(pe_fast != NULL);
+    ck_assert_uint_eq(pe_fast->buffer_size, 0u);
+
+    struct p4_edge *pe_slow = find_edge_by_id(pf, "cat-to-slow");
+    ck_assert(pe_slow != NULL);
+    ck_assert_uint_eq(pe_slow->buffer_size, 2097152u);
+    ck_assert_uint_eq(pe_slow->spill_high_water, 0u);
+    ck_assert(pe_slow->spill_dir == NULL);
+
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/spill_tee.json");
+    ck_assert(pf != NULL);
+    pe_slow = find_edge_by_id(pf, "cat-to-slow");
+    ck_assert(pe_slow != NULL);
+    ck_assert_uint_eq(pe_slow->buffer_size, 131072u);
+    ck_assert_uint_eq(pe_slow->spill_high_water, 65536u);
+    ck_assert_str_eq(pe_slow->spill_dir, "data");
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/bad_buffer_size.json");
+    ck_assert(pf == NULL);
+
+    pf = p4_file_new("data/pipe_size.json");
+    ck_assert(pf != NULL);
+    struct p4_edge *pe = find_edge_by_id(pf, "cat-to-save");
+    ck_assert(pe != NULL);
+    ck_assert_uint_eq(pe->pipe_size, 262144u);
+    ck_assert_int_eq(pe->pipe_priority, -1);
+    ck_assert_uint_eq(pe->chunk_size, 0u);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/chunked.json");
+    ck_assert(pf != NULL);
+    pe = find_edge_by_id(pf, "cat-to-copy");
+    ck_assert(pe != NULL);
+    ck_assert_uint_eq(pe->chunk_size, 4096u);
+    ck_assert_uint_eq(pe->batch_size, 16384u);
+    ck_assert_uint_eq(pe->batch_time, 500u);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(parse_exact_bytes) {
+    struct p4_file *pf = p4_file_new("data/direct.json");
+    ck_assert(pf != NULL);
+
+    struct p4_edge *pe = find_edge_by_id(pf, "cat-to-copy");
+    ck_assert(pe != NULL);
+    ck_assert(!pe->exact_bytes);
+    ck_assert(!pe->direct);
+
+    pe = find_edge_by_id(pf, "copy-to-save");
+    ck_assert(pe != NULL);
+    ck_assert(pe->exact_bytes);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/bad_exact_bytes.json");
+    ck_assert(pf == NULL);
+}
+END_TEST
+
+START_TEST(parse_cmd_array) {
+    struct p4_file *pf = p4_file_new("data/argv.json");
+    ck_assert(pf != NULL);
+
+    struct p4_node *pn = find_node_by_id(pf, "save");
+    ck_assert(pn != NULL);
+    ck_assert(pn->argv != NULL);
+    ck_assert_str_eq(pn->argv[0], "dd");
+    ck_assert_str_eq(pn->argv[1], "if=_SAVE_IN_");
+    ck_assert_str_eq(pn->argv[3], "status=none");
+    ck_assert(pn->argv[4] == NULL);
+    ck_assert_str_eq(pn->cmd, "dd if=_SAVE_IN_ of=data/argv_output.txt status=none");
+
+    pn = find_node_by_id(pf, "sed");
+    ck_assert(pn != NULL);
+    ck_assert(pn->argv == NULL);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/bad_cmd.json");
+    ck_assert(pf == NULL);
+}
+END_TEST
+
 START_TEST(test_get_node) {
     struct p4_file *pf = p4_file_new("data/basic.json");
     struct p4_node_array *pna = pf->nodes;
@@ -247,6 +338,9 @@ Suite *parser_suite(void) {
     tcase_add_test(tc_parse, fail_parse_broken_json);
     tcase_add_test(tc_parse, parse_basic_file);
     tcase_add_test(tc_parse, parse_ports_file);
+    tcase_add_test(tc_parse, parse_buffered_edge);
+    tcase_add_test(tc_parse, parse_exact_bytes);
+    tcase_add_test(tc_parse, parse_cmd_array);
     suite_add_tcase(s, tc_parse);
 
     TCase *tc_find_node = tcase_create("find nodes");
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <check.h>
 
@@ -100,6 +101,67 @@ START_TEST(test_pipe_open_and_close) {
 }
 END_TEST
 
+START_TEST(test_pipe_set_capacity) {
+    int success;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    struct pipe_array *pa = pipe_array_new();
+    ck_assert(pa != NULL);
+
+    success = pipe_array_append_new(pa, "-", "edge");
+    ck_assert_int_eq(success, 0);
+    struct pipe *p = get_pipe(pa, 0);
+    ck_assert_uint_gt(p->capacity, 0u);
+
+    /* the kernel rounds up to a power of two pages */
+    success = pipe_set_capacity(p, 3u * page);
+    ck_assert_int_eq(success, 0);
+    ck_assert_uint_eq(p->capacity, 4u * page);
+
+    /* the largest request and the highest priority win */
+    pipe_request_capacity(p, 8u * page, -2);
+    success = pipe_append_edge_id(p, "other-edge");
+    ck_assert_int_eq(success, 0);
+    pipe_request_capacity(p, 2u * page, -5);
+    ck_assert_uint_eq(p->requested_capacity, 8u * page);
+    ck_assert_int_eq(p->priority, -2);
+
+    pipe_array_free(pa);
+}
+END_TEST
+
+START_TEST(test_pipe_bytes_available) {
+    int success;
+
+    struct pipe_array *pa = pipe_array_new();
+    ck_assert(pa != NULL);
+
+    success = pipe_array_append_new(pa, "-", "edge");
+    ck_assert_int_eq(success, 0);
+    struct pipe *p = get_pipe(pa, 0);
+
+    ck_assert_int_eq(pipe_bytes_available(p), 0);
+    ck_assert(!pipe_is_at_eof(p));
+
+    ssize_t bytes = write(p->write_fd, "hp4", 3u);
+    ck_assert_int_eq(bytes, 3);
+    ck_assert_int_eq(pipe_bytes_available(p), 3);
+
+    success = close(p->write_fd);
+    ck_assert_int_eq(success, 0);
+    p->write_fd_is_open = false;
+    /* data is still waiting to be read */
+    ck_assert(!pipe_is_at_eof(p));
+
+    char buf[3];
+    bytes = read(p->read_fd, buf, 3u);
+    ck_assert_int_eq(bytes, 3);
+    ck_assert(pipe_is_at_eof(p));
+
+    pipe_array_free(pa);
+}
+END_TEST
+
 Suite *pipe_suite(void) {
     Suite *s = suite_create("pipe");
 
@@ -112,5 +174,10 @@ Suite *pipe_suite(void) {
     tcase_add_test(tc_open_and_close, test_pipe_open_and_close);
     suite_add_tcase(s, tc_open_and_close);
 
+    TCase *tc_state = tcase_create("pipe state");
+    tcase_add_test(tc_state, test_pipe_set_capacity);
+    tcase_add_test(tc_state, test_pipe_bytes_available);
+    suite_add_tcase(s, tc_state);
+
     return s;
 }
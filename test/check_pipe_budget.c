@@ -0,0 +1,105 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <check.h>
+
+#include "../src/parser.h"
+#include "../src/pipe.h"
+#include "../src/pipe_budget.h"
+
+START_TEST(test_pipe_budget_grant) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    pipe_budget_init(SIZE_MAX, false);
+    pipe_budget.max_pipe_size = 256u * page;
+
+    /* never shrinks a pipe */
+    ck_assert_uint_eq(pipe_budget_grant(16u * page, 4u * page), 16u * page);
+    /* rounds down to a power of two pages */
+    ck_assert_uint_eq(pipe_budget_grant(16u * page, 48u * page), 32u * page);
+    /* capped at the largest pipe size */
+    ck_assert_uint_eq(pipe_budget_grant(16u * page, 1024u * page), 256u * page);
+
+    /* only what is left of the budget can be given */
+    pipe_budget.limit = 40u * page;
+    pipe_budget.used = 16u * page;
+    ck_assert_uint_eq(pipe_budget_grant(16u * page, 64u * page), 32u * page);
+    pipe_budget.used = 40u * page;
+    ck_assert_uint_eq(pipe_budget_grant(16u * page, 64u * page), 16u * page);
+
+    pipe_budget_init(SIZE_MAX, false);
+}
+END_TEST
+
+START_TEST(test_pipe_note_full) {
+    int success;
+    pipe_budget_init(SIZE_MAX, true);
+
+    struct pipe_array *pa = pipe_array_new();
+    ck_assert(pa != NULL);
+    success = pipe_array_append_new(pa, "-", "edge");
+    ck_assert_int_eq(success, 0);
+    struct pipe *p = get_pipe(pa, 0);
+    size_t capacity = p->capacity;
+
+    for (int i = 0; i < PIPE_GROW_THRESHOLD - 1; i++)
+        pipe_note_full(p, true);
+    /* a pipe which is not full resets the count */
+    pipe_note_full(p, false);
+    pipe_note_full(p, true);
+    ck_assert_uint_eq(p->capacity, capacity);
+
+    for (int i = 0; i < PIPE_GROW_THRESHOLD; i++)
+        pipe_note_full(p, true);
+    ck_assert_uint_eq(p->capacity, capacity * 2u);
+    ck_assert_uint_eq(pipe_budget.used, capacity);
+    /* closing both ends gives the growth back */
+    ck_assert_int_eq(close_pipe(p), 0);
+    ck_assert_uint_eq(pipe_budget.used, 0u);
+
+    pipe_array_free(pa);
+    pipe_budget_init(SIZE_MAX, false);
+}
+END_TEST
+
+START_TEST(test_plan_fds) {
+    struct p4_file *pf = p4_file_new("data/join_with_ports.json");
+    ck_assert(pf != NULL);
+    /* cat, sed and diff's stdout; sed, save and diff's two ports' inputs */
+    ck_assert_uint_eq(plan_fd_count(pf, 0u), FD_RESERVE + 14u);
+    ck_assert_uint_eq(plan_fd_count(pf, 2u),
+                      FD_RESERVE + 2u * FDS_PER_RELAY_THREAD + 14u);
+
+    struct rlimit orig;
+    ck_assert_int_eq(getrlimit(RLIMIT_NOFILE, &orig), 0);
+    if (orig.rlim_max == RLIM_INFINITY || orig.rlim_max >= FD_RESERVE + 14u) {
+        struct rlimit low = orig;
+        low.rlim_cur = FD_RESERVE;
+        ck_assert_int_eq(setrlimit(RLIMIT_NOFILE, &low), 0);
+        ck_assert_int_eq(plan_fd_limit(pf, 0u), 0);
+        struct rlimit raised;
+        ck_assert_int_eq(getrlimit(RLIMIT_NOFILE, &raised), 0);
+        ck_assert_uint_eq(raised.rlim_cur, FD_RESERVE + 14u);
+        ck_assert_int_eq(setrlimit(RLIMIT_NOFILE, &orig), 0);
+    }
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *pipe_budget_suite(void) {
+    Suite *s = suite_create("pipe budget");
+
+    TCase *tc_budget = tcase_create("budget");
+    tcase_add_test(tc_budget, test_pipe_budget_grant);
+    tcase_add_test(tc_budget, test_pipe_note_full);
+    suite_add_tcase(s, tc_budget);
+
+    TCase *tc_fds = tcase_create("fds");
+    tcase_add_test(tc_fds, test_plan_fds);
+    suite_add_tcase(s, tc_fds);
+
+    return s;
+}
@@ -0,0 +1,695 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <event2/event.h>
+
+#include "../src/event_handlers.h"
+#include "../src/parser.h"
+#include "../src/pipe.h"
+#include "../src/record_node.h"
+
+/**
+ * Gives the SCATTER node of data/scatter.json an input pipe holding data,
+ * already closed, and its two outputs, then runs it to the end.
+ */
+void run_scatter(struct p4_file *pf, struct p4_node *split, const char *data,
+                 struct event_base *eb, struct sigchld_args *sa) {
+    ck_assert_int_eq(pipe_array_append_new(split->in_pipes, "-", "read-to-split"), 0);
+    ck_assert_int_eq(pipe_array_append_new(split->out_pipes, "a", "split-to-upa"), 0);
+    ck_assert_int_eq(pipe_array_append_new(split->out_pipes, "b", "split-to-upb"), 0);
+    struct pipe *in = get_pipe(split->in_pipes, 0);
+    ck_assert_int_eq(write(in->write_fd, data, strlen(data)), (int)strlen(data));
+    ck_assert_int_eq(close(in->write_fd), 0);
+    in->write_fd_is_open = false;
+
+    sa->pf = pf;
+    sa->eb = eb;
+    sa->n_children_exited = 0;
+    split->record = record_node_new(pf, split, eb, sa);
+    ck_assert(split->record != NULL);
+    while (!split->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa->n_children_exited, 1);
+}
+
+void assert_output(struct p4_node *split, int idx, const char *expected) {
+    struct pipe *p = get_pipe(split->out_pipes, idx);
+    ck_assert(!p->write_fd_is_open);
+    char buf[64] = {'\0'};
+    size_t len = 0u;
+    ssize_t n;
+    while ((n = read(p->read_fd, buf + len, sizeof(buf) - 1u - len)) > 0)
+        len += (size_t)n;
+    ck_assert_str_eq(buf, expected);
+}
+
+START_TEST(test_record_length) {
+    struct record_node rn;
+    rn.format = RECORDS_LINES;
+    ck_assert_uint_eq(record_length(&rn, "ab\ncd\n", 6u), 3u);
+    ck_assert_uint_eq(record_length(&rn, "\nab", 3u), 1u);
+    ck_assert_uint_eq(record_length(&rn, "abcd", 4u), 0u);
+
+    rn.format = RECORDS_FIXED;
+    rn.record_size = 4u;
+    ck_assert_uint_eq(record_length(&rn, "abcdef", 6u), 4u);
+    ck_assert_uint_eq(record_length(&rn, "abc", 3u), 0u);
+
+    rn.format = RECORDS_PREFIXED;
+    ck_assert_uint_eq(record_length(&rn, "\0\0\0\2abc", 7u), 6u);
+    ck_assert_uint_eq(record_length(&rn, "\0\0\0\5abc", 7u), 0u);
+    ck_assert_uint_eq(record_length(&rn, "\0\0", 2u), 0u);
+    ck_assert_uint_eq(record_length(&rn, "\0\0\1\0", 4u), 0u);
+}
+END_TEST
+
+START_TEST(test_record_too_long) {
+    struct record_node rn;
+    rn.max_record = 8u;
+    rn.format = RECORDS_LINES;
+    ck_assert(!record_too_long(&rn, "abcdefg", 7u));
+    ck_assert(record_too_long(&rn, "abcdefgh", 8u));
+    /* a whole record at the head is not held back */
+    ck_assert(!record_too_long(&rn, "ab\ncdefgh", 9u));
+
+    rn.format = RECORDS_PREFIXED;
+    ck_assert(!record_too_long(&rn, "\0\0", 2u));
+    ck_assert(!record_too_long(&rn, "\0\0\0\4", 4u));
+    ck_assert(record_too_long(&rn, "\0\0\0\5", 4u));
+    /* as from a corrupt prefix, known before any of the record comes */
+    ck_assert(record_too_long(&rn, "\xff\xff\xff\xff", 4u));
+}
+END_TEST
+
+START_TEST(test_scatter_round_robin) {
+    struct p4_file *pf = p4_file_new("data/scatter.json");
+    ck_assert(pf != NULL);
+    struct p4_node *split = find_node_by_id(pf, "split");
+    ck_assert(split != NULL);
+    ck_assert_str_eq(split->records, "lines");
+    ck_assert_str_eq(split->policy, "round_robin");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    /* edges may lower the default, not just raise it */
+    find_edge_by_id(pf, "read-to-split")->chunk_size = 4096u;
+    find_edge_by_id(pf, "split-to-upa")->chunk_size = 4096u;
+    find_edge_by_id(pf, "split-to-upb")->chunk_size = 4096u;
+    /* the last line has no newline, but is still a record */
+    run_scatter(pf, split, "one\ntwo\nthree\nfour\nfive", eb, &sa);
+    ck_assert_uint_eq(split->record->chunk_size, 4096u);
+    assert_output(split, 0, "one\nthree\nfive");
+    assert_output(split, 1, "two\nfour\n");
+
+    ck_assert_int_eq(split->record->outputs[0].records, 3);
+    ck_assert_int_eq(split->record->outputs[0].bytes, 14);
+    ck_assert_int_eq(split->record->outputs[1].records, 2);
+    ck_assert_int_eq(split->record->outputs[1].bytes, 9);
+    ck_assert_int_eq(split->record->inputs[0].records, 5);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_scatter_fixed) {
+    struct p4_file *pf = p4_file_new("data/scatter.json");
+    ck_assert(pf != NULL);
+    struct p4_node *split = find_node_by_id(pf, "split");
+    ck_assert(split != NULL);
+    free(split->records);
+    split->records = strdup("fixed");
+    split->record_size = 3u;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    run_scatter(pf, split, "aaabbbcccdddee", eb, &sa);
+    assert_output(split, 0, "aaacccee");
+    assert_output(split, 1, "bbbddd");
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_scatter_max_record) {
+    struct p4_file *pf = p4_file_new("data/scatter.json");
+    ck_assert(pf != NULL);
+    struct p4_node *split = find_node_by_id(pf, "split");
+    ck_assert(split != NULL);
+    split->max_record = 4u;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    /* the second record never ends within max_record, so is dropped */
+    run_scatter(pf, split, "ab\ncdefgh", eb, &sa);
+    assert_output(split, 0, "ab\n");
+    assert_output(split, 1, "");
+    ck_assert_int_eq(split->record->inputs[0].records, 1);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_scatter_least_full) {
+    struct p4_file *pf = p4_file_new("data/scatter.json");
+    ck_assert(pf != NULL);
+    struct p4_node *split = find_node_by_id(pf, "split");
+    ck_assert(split != NULL);
+    free(split->policy);
+    split->policy = strdup("least_full");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    /* much less than a chunk, so all of it goes to one output */
+    run_scatter(pf, split, "one\ntwo\nthree\n", eb, &sa);
+    assert_output(split, 0, "one\ntwo\nthree\n");
+    assert_output(split, 1, "");
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_scatter_config) {
+    struct p4_file *pf = p4_file_new("data/scatter.json");
+    ck_assert(pf != NULL);
+    struct p4_node *split = find_node_by_id(pf, "split");
+    ck_assert(split != NULL);
+    ck_assert_int_eq(pipe_array_append_new(split->in_pipes, "-", "read-to-split"), 0);
+    ck_assert_int_eq(pipe_array_append_new(split->out_pipes, "a", "split-to-upa"), 0);
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+
+    free(split->records);
+    split->records = strdup("words");
+    ck_assert(record_node_new(pf, split, eb, &sa) == NULL);
+
+    /* fixed records need a size */
+    free(split->records);
+    split->records = strdup("fixed");
+    ck_assert(record_node_new(pf, split, eb, &sa) == NULL);
+
+    free(split->records);
+    split->records = NULL;
+    free(split->policy);
+    split->policy = strdup("random");
+    ck_assert(record_node_new(pf, split, eb, &sa) == NULL);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+/**
+ * Gives the GATHER node of data/gather.json its two inputs and its output,
+ * and sets it up to run.
+ */
+void setup_gather(struct p4_file *pf, struct p4_node *join,
+                  struct event_base *eb, struct sigchld_args *sa) {
+    ck_assert_int_eq(pipe_array_append_new(join->in_pipes, "odd", "odd-to-join"), 0);
+    ck_assert_int_eq(pipe_array_append_new(join->in_pipes, "even", "even-to-join"), 0);
+    ck_assert_int_eq(pipe_array_append_new(join->out_pipes, "-", "join-to-save"), 0);
+    sa->pf = pf;
+    sa->eb = eb;
+    sa->n_children_exited = 0;
+    join->record = record_node_new(pf, join, eb, sa);
+    ck_assert(join->record != NULL);
+}
+
+void feed_input(struct p4_node *pn, int idx, const char *data, bool close_it) {
+    struct pipe *p = get_pipe(pn->in_pipes, idx);
+    ck_assert_int_eq(write(p->write_fd, data, strlen(data)), (int)strlen(data));
+    if (close_it) {
+        ck_assert_int_eq(close(p->write_fd), 0);
+        p->write_fd_is_open = false;
+    }
+}
+
+START_TEST(test_gather_round_robin) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    ck_assert_uint_eq(join->window, 65536u);
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+    /* once one input runs out, the other has the rest of the turns */
+    feed_input(join, 0, "one\nthree\nfive\nsix\n", true);
+    feed_input(join, 1, "two\nfour", true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa.n_children_exited, 1);
+
+    char buf[64] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 27);
+    ck_assert_str_eq(buf, "one\ntwo\nthree\nfourfive\nsix\n");
+    ck_assert_int_eq(join->record->inputs[0].records, 4);
+    ck_assert_int_eq(join->record->inputs[1].records, 2);
+    ck_assert_int_eq(join->record->inputs[1].bytes, 8);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_gather_sequence) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    free(join->policy);
+    join->policy = strdup("sequence");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+    feed_input(join, 0, "0\ta\n3\td\n4\te\n9\tj\n", true);
+    feed_input(join, 1, "1\tb\n2\tc\n7\th\n", true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+
+    char buf[64] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    ck_assert_int_gt(read(out->read_fd, buf, sizeof(buf) - 1u), 0);
+    ck_assert_str_eq(buf, "0\ta\n1\tb\n2\tc\n3\td\n4\te\n7\th\n9\tj\n");
+
+    struct record_node rn;
+    rn.format = RECORDS_PREFIXED;
+    ck_assert_uint_eq(record_sequence(&rn, "\0\0\0\00042x", 8u), 42u);
+    rn.format = RECORDS_LINES;
+    ck_assert_uint_eq(record_sequence(&rn, "x42\n", 4u), 0u);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_gather_unordered) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    free(join->policy);
+    join->policy = strdup("unordered");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+
+    /* records from one input go out while the other has none */
+    feed_input(join, 1, "two\nfour\n", false);
+    for (int i = 0; i < 4; i++)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_NONBLOCK), 0);
+    char buf[64] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 9);
+    ck_assert_str_eq(buf, "two\nfour\n");
+
+    feed_input(join, 0, "one\n", true);
+    feed_input(join, 1, "six", true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    memset(buf, 0, sizeof(buf));
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 7);
+    ck_assert(strcmp(buf, "one\nsix") == 0 || strcmp(buf, "sixone\n") == 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_gather_concatenate) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    free(join->policy);
+    join->policy = strdup("concatenate");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+
+    /* the second input waits until the first is drained */
+    feed_input(join, 1, "two\nfour", false);
+    for (int i = 0; i < 4; i++)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_NONBLOCK), 0);
+    char buf[64] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    ck_assert(fcntl(out->read_fd, F_SETFL, O_NONBLOCK) == 0);
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), -1);
+
+    /* and data, not records, is passed on */
+    feed_input(join, 0, "one\nthr", true);
+    feed_input(join, 1, "\nmore", true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 20);
+    ck_assert_str_eq(buf, "one\nthrtwo\nfour\nmore");
+    ck_assert_int_eq(join->record->inputs[0].bytes, 7);
+    ck_assert_int_eq(join->record->inputs[1].bytes, 13);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_gather_first_come) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    free(join->policy);
+    join->policy = strdup("first_come");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+
+    /* what an input has goes out without waiting for a whole record */
+    feed_input(join, 1, "tw", false);
+    for (int i = 0; i < 4; i++)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_NONBLOCK), 0);
+    char buf[64] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 2);
+    ck_assert_str_eq(buf, "tw");
+
+    feed_input(join, 0, "one\n", true);
+    feed_input(join, 1, "o\n", true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    memset(buf, 0, sizeof(buf));
+    ck_assert_int_eq(read(out->read_fd, buf, sizeof(buf) - 1u), 6);
+    ck_assert(strcmp(buf, "one\no\n") == 0 || strcmp(buf, "o\none\n") == 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_gather_window) {
+    struct p4_file *pf = p4_file_new("data/gather.json");
+    ck_assert(pf != NULL);
+    struct p4_node *join = find_node_by_id(pf, "join");
+    ck_assert(join != NULL);
+    join->window = 8u;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    setup_gather(pf, join, eb, &sa);
+
+    char odd[201] = {'\0'};
+    char even[201] = {'\0'};
+    char expected[401] = {'\0'};
+    for (int i = 0; i < 100; i++) {
+        strcat(odd, "1\n");
+        strcat(even, "2\n");
+        strcat(expected, "1\n2\n");
+    }
+
+    /* the first input gets ahead of the second by no more than the window,
+     * and the rest is left in its pipe */
+    feed_input(join, 0, odd, true);
+    for (int i = 0; i < 4; i++)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_NONBLOCK), 0);
+    ck_assert(!join->ended);
+    struct record_port *in = &join->record->inputs[0];
+    ck_assert_uint_le(in->len - in->start, 8u);
+    ck_assert_int_eq(pipe_bytes_available(in->pipe), 200 - (int)in->bytes);
+    ck_assert_int_le(in->bytes, 10);
+
+    feed_input(join, 1, even, true);
+    while (!join->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+
+    char buf[401] = {'\0'};
+    struct pipe *out = get_pipe(join->out_pipes, 0);
+    size_t len = 0u;
+    ssize_t n;
+    while ((n = read(out->read_fd, buf + len, sizeof(buf) - 1u - len)) > 0)
+        len += (size_t)n;
+    ck_assert_str_eq(buf, expected);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_record_bucket) {
+    ck_assert(key_hash("chr1", 4u) != key_hash("chr2", 4u));
+    ck_assert(key_hash("chromosome_1", 12u) != key_hash("chromosome_2", 12u));
+    ck_assert(key_hash("", 0u) != key_hash("\0", 1u));
+
+    struct record_node rn;
+    rn.format = RECORDS_LINES;
+    rn.delimiter = '\t';
+    rn.key_field = 2u;
+    rn.n_outputs = 1024u;
+    size_t bucket = record_bucket(&rn, "x\tchr1\ty\n", 10u);
+    ck_assert_uint_eq(bucket, key_hash("chr1", 4u) % 1024u);
+    ck_assert_uint_eq(record_bucket(&rn, "z\tchr1\n", 7u), bucket);
+    ck_assert_uint_eq(record_bucket(&rn, "z\tchr1", 6u), bucket);
+    /* too few fields for a key */
+    ck_assert_uint_eq(record_bucket(&rn, "chr1\n", 5u), key_hash("", 0u) % 1024u);
+
+    rn.format = RECORDS_PREFIXED;
+    rn.delimiter = ',';
+    rn.key_field = 1u;
+    ck_assert_uint_eq(record_bucket(&rn, "\0\0\0\6chr1,y", 10u), bucket);
+}
+END_TEST
+
+START_TEST(test_partition) {
+    struct p4_file *pf = p4_file_new("data/partition.json");
+    ck_assert(pf != NULL);
+    struct p4_node *part = find_node_by_id(pf, "part");
+    ck_assert(part != NULL);
+    ck_assert_str_eq(part->delimiter, "\t");
+    ck_assert_uint_eq(part->key_field, 2u);
+    ck_assert_int_eq(pipe_array_append_new(part->in_pipes, "-", "read-to-part"), 0);
+    ck_assert_int_eq(pipe_array_append_new(part->out_pipes, "a", "part-to-savea"), 0);
+    ck_assert_int_eq(pipe_array_append_new(part->out_pipes, "b", "part-to-saveb"), 0);
+    ck_assert_int_eq(pipe_array_append_new(part->out_pipes, "c", "part-to-savec"), 0);
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+    part->record = record_node_new(pf, part, eb, &sa);
+    ck_assert(part->record != NULL);
+
+    const char *keys[] = {"chr1", "chr2", "chrX"};
+    char expected[3][64] = {{'\0'}};
+    char line[16];
+    for (int i = 0; i < 9; i++) {
+        snprintf(line, sizeof(line), "%d\t%s\n", i, keys[i % 3]);
+        feed_input(part, 0, line, false);
+        size_t bucket = (size_t)(key_hash(keys[i % 3], 4u) % 3u);
+        strcat(expected[bucket], line);
+    }
+    feed_input(part, 0, "", true);
+    while (!part->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa.n_children_exited, 1);
+
+    for (int i = 0; i < 3; i++)
+        assert_output(part, i, expected[i]);
+    ck_assert_int_eq(part->record->inputs[0].records, 9);
+
+    /* a policy would be ignored, so is refused */
+    part->policy = strdup("round_robin");
+    ck_assert(record_node_new(pf, part, eb, &sa) == NULL);
+    free(part->policy);
+    part->policy = NULL;
+    part->delimiter[0] = '\0';
+    ck_assert(record_node_new(pf, part, eb, &sa) == NULL);
+    part->delimiter[0] = ',';
+    part->key_field = 0u;
+    ck_assert(record_node_new(pf, part, eb, &sa) == NULL);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+/**
+ * Gives the MERGE node of data/merge.json its first inputs, holding data,
+ * already closed, and its output, then runs it to the end.
+ */
+void run_merge(struct p4_file *pf, struct p4_node *merge, const char **data, int n,
+               struct event_base *eb, struct sigchld_args *sa) {
+    char port[2] = {'\0'};
+    char edge_id[16];
+    for (int i = 0; i < n; i++) {
+        port[0] = (char)('a' + i);
+        snprintf(edge_id, sizeof(edge_id), "read%s-to-merge", port);
+        ck_assert_int_eq(pipe_array_append_new(merge->in_pipes, port, edge_id), 0);
+    }
+    ck_assert_int_eq(pipe_array_append_new(merge->out_pipes, "-", "merge-to-save"), 0);
+    for (int i = 0; i < n; i++)
+        feed_input(merge, i, data[i], true);
+
+    sa->pf = pf;
+    sa->eb = eb;
+    sa->n_children_exited = 0;
+    merge->record = record_node_new(pf, merge, eb, sa);
+    ck_assert(merge->record != NULL);
+    while (!merge->ended)
+        ck_assert_int_ge(event_base_loop(eb, EVLOOP_ONCE), 0);
+    ck_assert_int_eq(sa->n_children_exited, 1);
+}
+
+START_TEST(test_key_number) {
+    ck_assert(key_number("42", 2u) == 42.0);
+    ck_assert(key_number(" -7.25x", 7u) == -7.25);
+    ck_assert(key_number("chr1", 4u) == 0.0);
+    /* only len bytes are read */
+    ck_assert(key_number("123", 2u) == 12.0);
+}
+END_TEST
+
+START_TEST(test_merge_numeric) {
+    struct p4_file *pf = p4_file_new("data/merge.json");
+    ck_assert(pf != NULL);
+    struct p4_node *merge = find_node_by_id(pf, "merge");
+    ck_assert(merge != NULL);
+    ck_assert_str_eq(merge->compare, "numeric");
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    /* the last record of an input need not end in a newline; a tie goes
+     * to the input of the earlier edge */
+    const char *data[] = {"a\t2\na\t10\na\t10\n", "b\t1\nb\t10\nb\t300",
+                          "", "d\t-5\n"};
+    run_merge(pf, merge, data, 4, eb, &sa);
+    assert_output(merge, 0, "d\t-5\nb\t1\na\t2\na\t10\na\t10\nb\t10\nb\t300");
+    ck_assert_int_eq(merge->record->inputs[0].records, 3);
+    ck_assert_int_eq(merge->record->inputs[2].records, 0);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_merge_lexical) {
+    struct p4_file *pf = p4_file_new("data/merge.json");
+    ck_assert(pf != NULL);
+    struct p4_node *merge = find_node_by_id(pf, "merge");
+    ck_assert(merge != NULL);
+    free(merge->compare);
+    merge->compare = NULL;
+    merge->key_field = 1u;
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    /* by bytes, as with LC_ALL=C sort -m; a key which is a prefix of
+     * another comes first */
+    const char *data[] = {"b\nba\nc\n", "a\nbb\n", "B\nbab\n"};
+    run_merge(pf, merge, data, 3, eb, &sa);
+    assert_output(merge, 0, "B\na\nb\nba\nbab\nbb\nc\n");
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_merge_config) {
+    struct p4_file *pf = p4_file_new("data/merge.json");
+    ck_assert(pf != NULL);
+    struct p4_node *merge = find_node_by_id(pf, "merge");
+    ck_assert(merge != NULL);
+    ck_assert_int_eq(pipe_array_append_new(merge->in_pipes, "a", "reada-to-merge"), 0);
+
+    struct event_base *eb = event_base_new();
+    ck_assert(eb != NULL);
+    struct sigchld_args sa;
+    sa.pf = pf;
+    sa.eb = eb;
+    sa.n_children_exited = 0;
+
+    /* no output */
+    ck_assert(record_node_new(pf, merge, eb, &sa) == NULL);
+    ck_assert_int_eq(pipe_array_append_new(merge->out_pipes, "-", "merge-to-save"), 0);
+
+    free(merge->compare);
+    merge->compare = strdup("natural");
+    ck_assert(record_node_new(pf, merge, eb, &sa) == NULL);
+    free(merge->compare);
+    merge->compare = NULL;
+    merge->policy = strdup("sequence");
+    ck_assert(record_node_new(pf, merge, eb, &sa) == NULL);
+
+    event_base_free(eb);
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *record_node_suite(void) {
+    Suite *s = suite_create("record_node");
+
+    TCase *tc_records = tcase_create("records");
+    tcase_add_test(tc_records, test_record_length);
+    tcase_add_test(tc_records, test_record_too_long);
+    suite_add_tcase(s, tc_records);
+
+    TCase *tc_scatter = tcase_create("scatter");
+    tcase_add_test(tc_scatter, test_scatter_round_robin);
+    tcase_add_test(tc_scatter, test_scatter_fixed);
+    tcase_add_test(tc_scatter, test_scatter_max_record);
+    tcase_add_test(tc_scatter, test_scatter_least_full);
+    tcase_add_test(tc_scatter, test_scatter_config);
+    suite_add_tcase(s, tc_scatter);
+
+    TCase *tc_gather = tcase_create("gather");
+    tcase_add_test(tc_gather, test_gather_round_robin);
+    tcase_add_test(tc_gather, test_gather_sequence);
+    tcase_add_test(tc_gather, test_gather_window);
+    tcase_add_test(tc_gather, test_gather_unordered);
+    tcase_add_test(tc_gather, test_gather_concatenate);
+    tcase_add_test(tc_gather, test_gather_first_come);
+    suite_add_tcase(s, tc_gather);
+
+    TCase *tc_partition = tcase_create("partition");
+    tcase_add_test(tc_partition, test_record_bucket);
+    tcase_add_test(tc_partition, test_partition);
+    suite_add_tcase(s, tc_partition);
+
+    TCase *tc_merge = tcase_create("merge");
+    tcase_add_test(tc_merge, test_key_number);
+    tcase_add_test(tc_merge, test_merge_numeric);
+    tcase_add_test(tc_merge, test_merge_lexical);
+    tcase_add_test(tc_merge, test_merge_config);
+    suite_add_tcase(s, tc_merge);
+
+    return s;
+}
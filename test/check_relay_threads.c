@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <check.h>
+
+#include "../src/parser.h"
+#include "../src/pipe.h"
+#include "../src/relay_threads.h"
+
+/**
+ * Gives a node's port a pipe for an edge, as hp4 does when building edges.
+ */
+struct pipe *add_edge_pipe(struct pipe_array *pa, char *edge_id) {
+    struct pipe *p = pipe_array_find_pipe_with_port(pa, "-");
+    if (p == NULL) {
+        ck_assert_int_eq(pipe_array_append_new(pa, "-", edge_id), 0);
+        return get_pipe(pa, (int)pa->length - 1);
+    }
+    ck_assert_int_eq(pipe_append_edge_id(p, edge_id), 0);
+    return p;
+}
+
+START_TEST(test_plan_relay_threads) {
+    struct p4_file *pf = p4_file_new("data/chunked.json");
+    ck_assert(pf != NULL);
+    struct p4_node *cat = find_node_by_id(pf, "cat");
+    struct p4_node *copy = find_node_by_id(pf, "copy");
+    struct p4_node *savea = find_node_by_id(pf, "savea");
+    struct p4_node *saveb = find_node_by_id(pf, "saveb");
+
+    struct pipe *cat_out = add_edge_pipe(cat->out_pipes, "cat-to-copy");
+    struct pipe *copy_in = add_edge_pipe(copy->in_pipes, "cat-to-copy");
+    struct pipe *copy_out = add_edge_pipe(copy->out_pipes, "copy-to-savea");
+    ck_assert(add_edge_pipe(copy->out_pipes, "copy-to-saveb") == copy_out);
+    struct pipe *savea_in = add_edge_pipe(savea->in_pipes, "copy-to-savea");
+    struct pipe *saveb_in = add_edge_pipe(saveb->in_pipes, "copy-to-saveb");
+
+    struct relay_pool *rp = relay_pool_new(2u, false);
+    ck_assert(rp != NULL);
+    ck_assert_int_eq(plan_relay_threads(pf, rp), 0);
+
+    /* the tee'd pair stays together, and goes first as the larger group */
+    ck_assert_int_eq(copy_out->relay_thread, 0);
+    ck_assert_int_eq(savea_in->relay_thread, 0);
+    ck_assert_int_eq(saveb_in->relay_thread, 0);
+    ck_assert_int_eq(cat_out->relay_thread, 1);
+    ck_assert_int_eq(copy_in->relay_thread, 1);
+    ck_assert_uint_eq(rp->threads[0].n_edges, 2u);
+    ck_assert_uint_eq(rp->threads[1].n_edges, 1u);
+    ck_assert(relay_pool_base(rp, copy_out) == rp->threads[0].eb);
+    ck_assert(relay_pool_base(rp, cat_out) == rp->threads[1].eb);
+
+    relay_pool_free(rp);
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *relay_threads_suite(void) {
+    Suite *s = suite_create("relay threads");
+
+    TCase *tc_plan = tcase_create("plan");
+    tcase_add_test(tc_plan, test_plan_relay_threads);
+    suite_add_tcase(s, tc_plan);
+
+    return s;
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "../src/parser.h"
+#include "../src/replicas.h"
+
+START_TEST(test_join_strings) {
+    char *s = join_strings("work", ".", "12");
+    ck_assert_str_eq(s, "work.12");
+    free(s);
+    s = join_strings("", "", "");
+    ck_assert_str_eq(s, "");
+    free(s);
+}
+END_TEST
+
+START_TEST(test_expand_replicas) {
+    struct p4_file *pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    ck_assert_uint_eq(find_node_by_id(pf, "work")->replicas, 4u);
+    ck_assert(find_node_by_id(pf, "work")->ordered);
+    ck_assert_int_eq(expand_replicas(pf), 0);
+
+    /* the node's copies stand in its place, between the splitter and the
+     * joiner */
+    const char *ids[] = {"read", "work.split", "work.1", "work.2", "work.3", "work.4",
+                         "work.join", "save"};
+    ck_assert_uint_eq(pf->nodes->length, 8u);
+    for (int i = 0; i < 8; i++)
+        ck_assert_str_eq(p4_file_get_node(pf, i)->id, ids[i]);
+    ck_assert(find_node_by_id(pf, "work") == NULL);
+
+    struct p4_node *split = find_node_by_id(pf, "work.split");
+    ck_assert_str_eq(split->type, "SCATTER");
+    ck_assert_str_eq(split->policy, "round_robin");
+    struct p4_node *join = find_node_by_id(pf, "work.join");
+    ck_assert_str_eq(join->type, "GATHER");
+    ck_assert_str_eq(join->policy, "round_robin");
+    struct p4_node *copy = find_node_by_id(pf, "work.3");
+    ck_assert_str_eq(copy->type, "EXEC");
+    ck_assert_str_eq(copy->cmd, "sed -e s/$/ done/");
+    ck_assert_str_eq(copy->argv[2], "s/$/ done/");
+    ck_assert(copy->argv[3] == NULL);
+    ck_assert_uint_eq(copy->replicas, 0u);
+
+    /* the graph's own edges keep their ids */
+    ck_assert_uint_eq(pf->edges->length, 10u);
+    struct p4_edge *pe = find_edge_by_id(pf, "read-to-work");
+    ck_assert_str_eq(pe->to, "work.split");
+    pe = find_edge_by_id(pf, "work-to-save");
+    ck_assert_str_eq(pe->from, "work.join");
+    pe = find_edge_by_id(pf, "work.split-to-work.2");
+    ck_assert(pe != NULL);
+    ck_assert_str_eq(pe->from, "work.split");
+    ck_assert_str_eq(pe->from_port, "2");
+    ck_assert_str_eq(pe->to, "work.2");
+    ck_assert_str_eq(pe->to_port, "-");
+    pe = find_edge_by_id(pf, "work.4-to-work.join");
+    ck_assert(pe != NULL);
+    ck_assert_str_eq(pe->from_port, "-");
+    ck_assert_str_eq(pe->to_port, "4");
+
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_expand_unordered) {
+    struct p4_file *pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    struct p4_node *work = find_node_by_id(pf, "work");
+    work->ordered = false;
+    work->replicas = 2u;
+    work->records = strdup("fixed");
+    work->record_size = 16u;
+    ck_assert_int_eq(expand_replicas(pf), 0);
+
+    ck_assert_uint_eq(pf->nodes->length, 6u);
+    struct p4_node *split = find_node_by_id(pf, "work.split");
+    ck_assert_str_eq(split->policy, "least_full");
+    ck_assert_str_eq(split->records, "fixed");
+    ck_assert_uint_eq(split->record_size, 16u);
+    struct p4_node *join = find_node_by_id(pf, "work.join");
+    ck_assert_str_eq(join->policy, "unordered");
+    ck_assert_uint_eq(join->record_size, 16u);
+    free_p4_file(pf);
+
+    /* a node with no output has no joiner */
+    pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    struct p4_edge *pe = find_edge_by_id(pf, "work-to-save");
+    free(pe->from);
+    pe->from = strdup("read");
+    ck_assert_int_eq(expand_replicas(pf), 0);
+    ck_assert_uint_eq(pf->nodes->length, 7u);
+    ck_assert(find_node_by_id(pf, "work.join") == NULL);
+    ck_assert_uint_eq(pf->edges->length, 6u);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_expand_errors) {
+    /* only EXEC nodes are copied */
+    struct p4_file *pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    find_node_by_id(pf, "read")->replicas = 2u;
+    ck_assert_int_eq(expand_replicas(pf), -1);
+    free_p4_file(pf);
+
+    /* records are shared from stdin alone */
+    pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    struct p4_edge *pe = find_edge_by_id(pf, "read-to-work");
+    free(pe->to_port);
+    pe->to_port = strdup("IN");
+    ck_assert_int_eq(expand_replicas(pf), -1);
+    free_p4_file(pf);
+
+    /* the copies need something to share */
+    pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    pe = find_edge_by_id(pf, "read-to-work");
+    free(pe->to);
+    pe->to = strdup("save");
+    ck_assert_int_eq(expand_replicas(pf), -1);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/replicas.json");
+    ck_assert(pf != NULL);
+    struct p4_node *save = find_node_by_id(pf, "save");
+    free(save->id);
+    save->id = strdup("work.4");
+    ck_assert_int_eq(expand_replicas(pf), -1);
+    free_p4_file(pf);
+}
+END_TEST
+
+START_TEST(test_expand_fan_in) {
+    struct p4_file *pf = p4_file_new("data/fan_in.json");
+    ck_assert(pf != NULL);
+    ck_assert_str_eq(find_node_by_id(pf, "cat")->fan_in, "concatenate");
+    ck_assert_int_eq(expand_fan_in(pf), 0);
+
+    /* the edges into the port go to the joiner, in their order */
+    ck_assert_uint_eq(pf->nodes->length, 6u);
+    struct p4_node *join = find_node_by_id(pf, "cat.fan_in");
+    ck_assert_str_eq(join->type, "GATHER");
+    ck_assert_str_eq(join->policy, "concatenate");
+    char port[2] = "1";
+    for (int i = 0; i < 3; i++) {
+        struct p4_edge *pe = p4_file_get_edge(pf, i);
+        ck_assert_str_eq(pe->to, "cat.fan_in");
+        ck_assert_str_eq(pe->to_port, port);
+        port[0]++;
+    }
+    struct p4_edge *pe = find_edge_by_id(pf, "cat.fan_in-to-cat");
+    ck_assert(pe != NULL);
+    ck_assert_str_eq(pe->to, "cat");
+    ck_assert_str_eq(pe->to_port, "-");
+    ck_assert_uint_eq(pf->edges->length, 5u);
+    free_p4_file(pf);
+
+    /* each port with fan-in has its own joiner, and one edge needs none */
+    pf = p4_file_new("data/fan_in.json");
+    ck_assert(pf != NULL);
+    for (int i = 1; i < 3; i++) {
+        pe = p4_file_get_edge(pf, i);
+        free(pe->to_port);
+        pe->to_port = strdup("IN");
+    }
+    ck_assert_int_eq(expand_fan_in(pf), 0);
+    ck_assert_uint_eq(pf->nodes->length, 6u);
+    ck_assert(find_node_by_id(pf, "cat.IN.fan_in") != NULL);
+    ck_assert_str_eq(find_edge_by_id(pf, "read0-to-cat")->to, "cat");
+    pe = find_edge_by_id(pf, "cat.IN.fan_in-to-cat");
+    ck_assert_str_eq(pe->to_port, "IN");
+    free_p4_file(pf);
+
+    /* the joiner feeds the splitter of a node with replicas */
+    pf = p4_file_new("data/fan_in.json");
+    ck_assert(pf != NULL);
+    find_node_by_id(pf, "cat")->replicas = 2u;
+    ck_assert_int_eq(expand_fan_in(pf), 0);
+    ck_assert_int_eq(expand_replicas(pf), 0);
+    ck_assert_str_eq(find_edge_by_id(pf, "cat.fan_in-to-cat")->to, "cat.split");
+    free_p4_file(pf);
+
+    /* without fan_in, nothing changes */
+    pf = p4_file_new("data/fan_in.json");
+    ck_assert(pf != NULL);
+    struct p4_node *cat = find_node_by_id(pf, "cat");
+    free(cat->fan_in);
+    cat->fan_in = NULL;
+    ck_assert_int_eq(expand_fan_in(pf), 0);
+    ck_assert_uint_eq(pf->nodes->length, 5u);
+    ck_assert_uint_eq(pf->edges->length, 4u);
+    free_p4_file(pf);
+}
+END_TEST
+
+Suite *replicas_suite(void) {
+    Suite *s = suite_create("replicas");
+
+    TCase *tc_expand = tcase_create("expand");
+    tcase_add_test(tc_expand, test_join_strings);
+    tcase_add_test(tc_expand, test_expand_replicas);
+    tcase_add_test(tc_expand, test_expand_unordered);
+    tcase_add_test(tc_expand, test_expand_errors);
+    tcase_add_test(tc_expand, test_expand_fan_in);
+    suite_add_tcase(s, tc_expand);
+
+    return s;
+}
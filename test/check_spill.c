@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "../src/spill.h"
+
+START_TEST(test_spill_file_round_trip) {
+    int success;
+    ssize_t bytes;
+    char buf[16] = {'\0'};
+
+    int pipe_fds[2] = {0, 0};
+    success = pipe(pipe_fds);
+    ck_assert_int_eq(success, 0);
+
+    struct spill_file *sf = spill_file_new("data");
+    ck_assert(sf != NULL);
+    ck_assert_uint_eq(spill_file_pending(sf), 0u);
+
+    success = spill_file_append(sf, "spilled", 7u);
+    ck_assert_int_eq(success, 0);
+    success = spill_file_append(sf, "data", 4u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_uint_eq(spill_file_pending(sf), 11u);
+
+    bytes = spill_file_splice_to_fd(sf, pipe_fds[1], 7u);
+    ck_assert_int_eq(bytes, 7);
+    ck_assert_uint_eq(spill_file_pending(sf), 4u);
+
+    /* asking for more than is pending only splices what is pending */
+    bytes = spill_file_splice_to_fd(sf, pipe_fds[1], 100u);
+    ck_assert_int_eq(bytes, 4);
+    ck_assert_uint_eq(spill_file_pending(sf), 0u);
+    /* drained file is truncated */
+    ck_assert_int_eq(sf->write_offset, 0);
+
+    bytes = read(pipe_fds[0], buf, sizeof(buf));
+    ck_assert_int_eq(bytes, 11);
+    ck_assert_str_eq(buf, "spilleddata");
+
+    spill_file_free(sf);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+END_TEST
+
+START_TEST(test_spill_file_in_memory) {
+    struct spill_file *sf = spill_file_new(NULL);
+    ck_assert(sf != NULL);
+
+    int success = spill_file_append(sf, "hp4", 3u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_uint_eq(spill_file_pending(sf), 3u);
+
+    spill_file_free(sf);
+}
+END_TEST
+
+START_TEST(test_spill_file_bad_dir) {
+    struct spill_file *sf = spill_file_new("data/no_such_dir");
+    ck_assert(sf == NULL);
+}
+END_TEST
+
+Suite *spill_suite(void) {
+    Suite *s = suite_create("spill");
+
+    TCase *tc_spill_file = tcase_create("spill file");
+    tcase_add_test(tc_spill_file, test_spill_file_round_trip);
+    tcase_add_test(tc_spill_file, test_spill_file_in_memory);
+    tcase_add_test(tc_spill_file, test_spill_file_bad_dir);
+    suite_add_tcase(s, tc_spill_file);
+
+    return s;
+}
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <check.h>
@@ -64,11 +65,71 @@ START_TEST(test_create_stats_file) {
 }
 END_TEST
 
+START_TEST(test_create_stats_file_detailed) {
+    int success;
+
+    int pipe_fds[2] = {0, 0};
+    success = pipe(pipe_fds);
+    ck_assert_int_eq(success, 0);
+
+    int orig_stdout = dup(STDOUT_FILENO);
+
+    success = dup2(pipe_fds[1], STDOUT_FILENO);
+    ck_assert_int_ge(success, 0);
+
+    struct p4_file *pf = p4_file_new("data/spill_tee.json");
+    ck_assert(pf != NULL);
+
+    struct p4_edge *pe = find_edge_by_id(pf, "cat-to-slow");
+    ck_assert(pe != NULL);
+    pe->bytes_spliced = 100l;
+    pe->bytes_spilled = 40l;
+    pe->spill_peak = 30l;
+    pf->startup_us = 1500;
+    pf->detailed_stats = true;
+
+    success = create_stats_file(pf);
+    ck_assert_int_eq(success, 0);
+    ck_assert(pe->bytes_spilled_reported == 40l);
+
+    success = fflush(stdout);
+    ck_assert_int_eq(success, 0);
+
+    success = close(pipe_fds[1]);
+    ck_assert_int_eq(success, 0);
+
+    char buf[1024] = {'\0'};
+    ssize_t bytes_read = read(pipe_fds[0], buf, 1023);
+    ck_assert_int_gt(bytes_read, 0);
+    buf[bytes_read] = '\0';
+
+    /* edge counts are kept apart from hp4's own stats */
+    ck_assert(strstr(buf, "{\"edges\": {") == buf);
+    ck_assert(strstr(buf, "\"cat-to-slow\": 100") != NULL);
+    ck_assert(strstr(buf, "\"spill\": {\"cat-to-slow\": {\"bytes\": 40, \"rate\": ") != NULL);
+    ck_assert(strstr(buf, "\"peak\": 30}}") != NULL);
+    /* edges which do not spill are not listed */
+    ck_assert(strstr(buf, "{\"cat-to-fast\": {") == NULL);
+    ck_assert(strstr(buf, "\"startup_us\": 1500}\n") != NULL);
+
+    free_p4_file(pf);
+
+    success = dup2(orig_stdout, STDOUT_FILENO);
+    ck_assert_int_ge(success, 0);
+
+    success = close(pipe_fds[0]);
+    ck_assert_int_eq(success, 0);
+    success = close(orig_stdout);
+    ck_assert_int_eq(success, 0);
+}
+END_TEST
+
 Suite *stats_suite(void) {
     Suite *s = suite_create("stats");
 
     TCase *tc_stats = tcase_create("create stats file");
     tcase_add_test(tc_stats, test_create_stats_file);
+    tcase_add_test(tc_stats, test_create_stats_file_detailed);
     suite_add_tcase(s, tc_stats);
 
     return s;
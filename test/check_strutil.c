@@ -127,6 +127,53 @@ START_TEST(test_parse_argstring) {
 }
 END_TEST
 
+START_TEST(test_unwrap_shell) {
+    struct argstruct outer;
+    struct argstruct direct;
+
+    ck_assert_int_eq(parse_argstring(&outer, "bash -c \"sed -e 's/a/A/g' -n\""), 0);
+    ck_assert_int_eq(unwrap_shell(&outer, &direct), 1);
+    ck_assert_int_eq(direct.argc, 4);
+    ck_assert_str_eq(direct.argv[0], "sed");
+    ck_assert_str_eq(direct.argv[1], "-e");
+    ck_assert_str_eq(direct.argv[2], "s/a/A/g");
+    ck_assert_str_eq(direct.argv[3], "-n");
+    ck_assert(direct.argv[4] == NULL);
+    free_argstring(&direct);
+    free_argstring(&outer);
+
+    ck_assert_int_eq(parse_argstring(&outer, "/bin/sh -c \"gzip -dc in.gz\""), 0);
+    ck_assert_int_eq(unwrap_shell(&outer, &direct), 1);
+    ck_assert_int_eq(direct.argc, 3);
+    ck_assert_str_eq(direct.argv[0], "gzip");
+    free_argstring(&direct);
+    free_argstring(&outer);
+
+    /* each of these needs a shell */
+    const char *shell_cmds[] = {
+        "bash -c \"cat > out.txt\"",
+        "bash -c \"sleep 2; cat\"",
+        "bash -c \"zcat *.gz\"",
+        "bash -c \"echo $HOME\"",
+        "bash -c \"cat in\\ file\"",
+        "bash -c \"echo a'b'\"",
+        "bash -c \"echo ''\"",
+        "bash -c \"LC_ALL=C sort\"",
+        "bash -c \"cd dir\"",
+        "bash -c \"read line\"",
+        "bash -c \"cat in\" name",
+        "python -c \"print\"",
+        "cat in",
+        NULL
+    };
+    for (int i = 0; shell_cmds[i] != NULL; i++) {
+        ck_assert_int_eq(parse_argstring(&outer, shell_cmds[i]), 0);
+        ck_assert_msg(unwrap_shell(&outer, &direct) == 0, "%s was unwrapped", shell_cmds[i]);
+        free_argstring(&outer);
+    }
+}
+END_TEST
+
 Suite *strutil_suite(void) {
     Suite *s;
     s = suite_create("strutil");
@@ -145,5 +192,9 @@ Suite *strutil_suite(void) {
     tcase_add_test(tc_parse_argstring, test_parse_argstring);
     suite_add_tcase(s, tc_parse_argstring);
 
+    TCase *tc_unwrap_shell = tcase_create("unwrap shell");
+    tcase_add_test(tc_unwrap_shell, test_unwrap_shell);
+    suite_add_tcase(s, tc_unwrap_shell);
+
     return s;
 }
@@ -0,0 +1,117 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "../src/uring.h"
+
+START_TEST(test_uring_run) {
+    struct uring *r = uring_new(4u);
+    if (r == NULL) {
+        /* built without io_uring, or the kernel does not allow it */
+        return;
+    }
+
+    int success;
+    int source[2], dest_a[2], dest_b[2];
+    success = pipe(source);
+    ck_assert_int_eq(success, 0);
+    success = pipe(dest_a);
+    ck_assert_int_eq(success, 0);
+    success = pipe(dest_b);
+    ck_assert_int_eq(success, 0);
+
+    ssize_t bytes = write(source[1], "hp4", 3u);
+    ck_assert_int_eq(bytes, 3);
+
+    struct uring_op ops[2];
+    ops[0].opcode = URING_TEE;
+    ops[0].fd_in = source[0];
+    ops[0].fd_out = dest_a[1];
+    ops[0].len = 3u;
+    ops[0].flags = SPLICE_F_NONBLOCK;
+    success = uring_run(r, ops, 1u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_int_eq(ops[0].res, 3);
+
+    ops[0].opcode = URING_SPLICE;
+    ops[0].fd_out = dest_b[1];
+    success = uring_run(r, ops, 1u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_int_eq(ops[0].res, 3);
+
+    /* the source is now empty, so a non-blocking splice fails */
+    success = uring_run(r, ops, 1u);
+    ck_assert_int_eq(success, 0);
+    ck_assert_int_eq(ops[0].res, -EAGAIN);
+
+    char buf[4] = {'\0'};
+    bytes = read(dest_a[0], buf, 3u);
+    ck_assert_int_eq(bytes, 3);
+    ck_assert_str_eq(buf, "hp4");
+    memset(buf, 0, sizeof(buf));
+    bytes = read(dest_b[0], buf, 3u);
+    ck_assert_int_eq(bytes, 3);
+    ck_assert_str_eq(buf, "hp4");
+
+    for (int i = 0; i < 2; i++) {
+        close(source[i]);
+        close(dest_a[i]);
+        close(dest_b[i]);
+    }
+    uring_free(r);
+}
+END_TEST
+
+START_TEST(test_uring_run_more_than_entries) {
+    struct uring *r = uring_new(2u);
+    if (r == NULL) {
+        return;
+    }
+
+    int success;
+    int fds[6][2];
+    struct uring_op ops[6];
+    int source[2];
+    success = pipe(source);
+    ck_assert_int_eq(success, 0);
+    ssize_t bytes = write(source[1], "x", 1u);
+    ck_assert_int_eq(bytes, 1);
+
+    for (int i = 0; i < 6; i++) {
+        success = pipe(fds[i]);
+        ck_assert_int_eq(success, 0);
+        ops[i].opcode = URING_TEE;
+        ops[i].fd_in = source[0];
+        ops[i].fd_out = fds[i][1];
+        ops[i].len = 1u;
+        ops[i].flags = SPLICE_F_NONBLOCK;
+    }
+    success = uring_run(r, ops, 6u);
+    ck_assert_int_eq(success, 0);
+    for (int i = 0; i < 6; i++) {
+        ck_assert_int_eq(ops[i].res, 1);
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    close(source[0]);
+    close(source[1]);
+    uring_free(r);
+}
+END_TEST
+
+Suite *uring_suite(void) {
+    Suite *s = suite_create("uring");
+
+    TCase *tc_run = tcase_create("run");
+    tcase_add_test(tc_run, test_uring_run);
+    tcase_add_test(tc_run, test_uring_run_more_than_entries);
+    suite_add_tcase(s, tc_run);
+
+    return s;
+}
@@ -1,4 +1,7 @@
 #include <stdbool.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
 
 #include <check.h>
 
@@ -152,6 +155,18 @@ START_TEST(test_node_missing_attributes) {
     valid = validate_p4_file(pf);
     ck_assert(!valid);
     free_p4_file(pf);
+
+    pf = p4_file_new("data/validate/node_infile_missing_name.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/validate/node_outfile_missing_name.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
 }
 END_TEST
 
@@ -203,6 +218,62 @@ START_TEST(test_port_not_in_cmd) {
 }
 END_TEST
 
+START_TEST(test_file_nodes) {
+    struct p4_file *pf;
+    bool valid;
+
+    pf = p4_file_new("data/infile.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(valid);
+    free_p4_file(pf);
+
+    pf = p4_file_new("data/outfile.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(valid);
+    free_p4_file(pf);
+
+    /* INFILE nodes have no input */
+    pf = p4_file_new("data/validate/edge_to_infile.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
+
+    /* and OUTFILE nodes no output */
+    pf = p4_file_new("data/validate/edge_from_outfile.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
+
+    /* nor any port but stdio */
+    pf = p4_file_new("data/validate/port_infile.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
+
+    /* a FIFO cannot be read from an offset */
+    remove("data/validate/fifo");
+    ck_assert_int_eq(mkfifo("data/validate/fifo", 0600), 0);
+    pf = p4_file_new("data/validate/node_infile_range_fifo.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(!valid);
+    free_p4_file(pf);
+
+    /* but can be read up to a length */
+    pf = p4_file_new("data/validate/node_infile_length_fifo.json");
+    ck_assert(pf != NULL);
+    valid = validate_p4_file(pf);
+    ck_assert(valid);
+    free_p4_file(pf);
+    ck_assert_int_eq(remove("data/validate/fifo"), 0);
+}
+END_TEST
+
 START_TEST(test_multiple_ports) {
     struct p4_file *pf;
     bool valid;
@@ -235,6 +306,7 @@ Suite *validate_suite(void) {
     tcase_add_test(tc_validate, test_unconnected_node);
     tcase_add_test(tc_validate, test_port_not_in_cmd);
     tcase_add_test(tc_validate, test_multiple_ports);
+    tcase_add_test(tc_validate, test_file_nodes);
 
     suite_add_tcase(s, tc_validate);
 